@@ -3,25 +3,53 @@
 #include <memory>
 #include <vector>
 #include <string>
+#include <string_view>
 #include <map>
 #include <set>
 #include <deque>
+#include <list>
+#include <mutex>
 #include <unordered_set>
 #include <unordered_map>
 #include <ostream>
 #include <sstream>
 #include <optional>
+#include <iterator>
+#include <functional>
+#include <atomic>
+#include <thread>
+#include <exception>
+#include <algorithm>
+#include <utility>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <type_traits>
 
 namespace InCommand
 {
     //------------------------------------------------------------------------------------------------
-    enum class ArgumentType
+    enum class ArgumentType : uint8_t
     {
         Category,
         Variable,
         Switch,
         Parameter,
     };
+
+    //------------------------------------------------------------------------------------------------
+    // Integer type of handles and of the indices in schema tables and expressions. 32 bits unless
+    // IN_COMMAND_INDEX_TYPE names another unsigned type, such as uint16_t for small schemas; the
+    // largest value is reserved for NullCategory, and declaring past it throws
+    // Exception(Status::OutOfRange).
+#if defined(IN_COMMAND_INDEX_TYPE)
+    using IndexType = IN_COMMAND_INDEX_TYPE;
+#else
+    using IndexType = uint32_t;
+#endif
+    static_assert(std::is_unsigned_v<IndexType> && sizeof(IndexType) <= sizeof(uint32_t), "IndexType must be an unsigned type of at most 32 bits");
     
     //------------------------------------------------------------------------------------------------
     enum class Status : int
@@ -37,6 +65,14 @@ namespace InCommand
         OutOfRange,
         NotFound,
         InvalidHandle,
+        InvalidResponseFile,
+        ResponseFileTooDeep,
+        ConnectionError,
+        SchemaMismatch,
+        InvalidFormat,
+        AmbiguousArgument,
+        SharedMemoryError,
+        HandlerError,
     };
 
     //------------------------------------------------------------------------------------------------
@@ -45,23 +81,156 @@ namespace InCommand
         Status ErrorStatus;
         int ArgIndex;
         std::string ArgString;
-        const void *ContextPtr;
+
+        // Index of the category (or, for InvalidValue and MissingVariableValue, the option) the
+        // error arose in, or NoContext. An index rather than a pointer, so the error stays
+        // describable after later declarations recompile the reader's schema.
+        static constexpr uint32_t NoContext = UINT32_MAX;
+        uint32_t ContextIndex = NoContext;
+        std::string FileName; // Response file containing the argument, empty for argv arguments
+        size_t FileOffset;    // Byte offset of the argument within FileName
+    };
+
+    //------------------------------------------------------------------------------------------------
+    struct ValidationResult
+    {
+        Status ErrorStatus;
+        int ArgIndex;
+    };
+
+    //------------------------------------------------------------------------------------------------
+    // Read-only memory mapping of a file. Used for @file response files so the argument text is
+    // tokenized in place rather than copied.
+    class CMappedFile
+    {
+        std::string m_Path;
+        const char *m_Data = nullptr;
+        size_t m_Size = 0;
+#if defined(_WIN32)
+        void *m_FileHandle = nullptr;
+        void *m_MappingHandle = nullptr;
+#endif
+
+        explicit CMappedFile(const std::string &path) :
+            m_Path(path)
+        {
+        }
+
+    public:
+        CMappedFile(const CMappedFile &) = delete;
+        CMappedFile &operator=(const CMappedFile &) = delete;
+        ~CMappedFile();
+
+        // Returns nullptr if the file cannot be opened or mapped
+        static std::shared_ptr<CMappedFile> Open(const std::string &path);
+
+        const std::string &GetPath() const { return m_Path; }
+        const char *GetData() const { return m_Data; }
+        size_t GetSize() const { return m_Size; }
+    };
+
+    //------------------------------------------------------------------------------------------------
+    enum class TokenFormat
+    {
+        Argv,
+        ResponseFile,
+        NulSeparated,
     };
 
+    //------------------------------------------------------------------------------------------------
+    enum class TokenScan
+    {
+        Token,
+        End,
+        UnterminatedQuote,
+    };
+
+    //------------------------------------------------------------------------------------------------
+    // Scans the next whitespace-separated token of response file text starting at cursor.
+    // A token beginning with a double quote extends to the next double quote and may contain
+    // whitespace; the quotes are not part of the token. On return rawBegin points at the first
+    // character of the token including any opening quote, and cursor is past the token.
+    inline TokenScan ScanResponseFileToken(const char *&cursor, const char *end, const char *&rawBegin, std::string_view &token)
+    {
+        while (cursor != end && (*cursor == ' ' || *cursor == '\t' || *cursor == '\r' || *cursor == '\n'))
+            ++cursor;
+
+        rawBegin = cursor;
+        if (cursor == end)
+            return TokenScan::End;
+
+        if (*cursor == '"')
+        {
+            const char *valueBegin = ++cursor;
+            while (cursor != end && *cursor != '"')
+                ++cursor;
+            if (cursor == end)
+                return TokenScan::UnterminatedQuote;
+            token = std::string_view(valueBegin, size_t(cursor - valueBegin));
+            ++cursor;
+            return TokenScan::Token;
+        }
+
+        while (cursor != end && !(*cursor == ' ' || *cursor == '\t' || *cursor == '\r' || *cursor == '\n'))
+            ++cursor;
+        token = std::string_view(rawBegin, size_t(cursor - rawBegin));
+        return TokenScan::Token;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    // Scans the next token of a NUL-separated buffer such as /proc/<pid>/cmdline. The terminating
+    // NUL of the last token is optional.
+    inline TokenScan ScanNulSeparatedToken(const char *&cursor, const char *end, const char *&rawBegin, std::string_view &token)
+    {
+        rawBegin = cursor;
+        if (cursor == end)
+            return TokenScan::End;
+
+        while (cursor != end && *cursor != '\0')
+            ++cursor;
+        token = std::string_view(rawBegin, size_t(cursor - rawBegin));
+        if (cursor != end)
+            ++cursor;
+        return TokenScan::Token;
+    }
+
     //------------------------------------------------------------------------------------------------
     template<ArgumentType Type>
     class HandleHasher;
 
+    template<typename Handler>
+    class CCommandDispatcher;
+
+    class CCommandReader;
+
+    //------------------------------------------------------------------------------------------------
+    // Schema generations identify the reader that issued a handle or read an expression. Generation
+    // 0 is compatible with every reader.
+    inline bool IsSameGeneration(uint32_t a, uint32_t b)
+    {
+        return a == 0 || b == 0 || a == b;
+    }
+
     //------------------------------------------------------------------------------------------------
+    // Handles compare by index only. They also carry the schema generation of the reader that
+    // issued them, so a handle used with an expression read by another version of a schema is
+    // detected (see CReloadableReader).
     template<ArgumentType Type>
     class Handle
     {
         friend class CCommandReader;
         friend class HandleHasher<Type>;
-        size_t m_Value;
+        template<typename Handler> friend class CCommandDispatcher;
+        friend class CSerializedExpression;
+        friend class CCommandExpression;
+        IndexType m_Value;
+        uint32_t m_Generation = 0;
+
+        Handle(size_t value, uint32_t generation) : m_Value(IndexType(value)), m_Generation(generation) {}
 
     public:
-        explicit Handle(size_t value) : m_Value(value) {}
+        explicit Handle(size_t value) : m_Value(IndexType(value)) {}
+        uint32_t GetGeneration() const { return m_Generation; }
         bool operator<(const Handle &o) const { return m_Value < o.m_Value; }
         bool operator==(const Handle &o) const { return m_Value == o.m_Value; }
         bool operator!=(const Handle &o) const { return m_Value != o.m_Value; }
@@ -98,6 +267,384 @@ namespace InCommand
         const std::string &GetMessage() const { return m_Message; }
     };
 
+    //------------------------------------------------------------------------------------------------
+    // Work done while reading command expressions. Counted only in builds defining
+    // IN_COMMAND_INSTRUMENTATION; otherwise the counting compiles out and every counter stays 0.
+    // Phase times are exclusive: ReadNanoseconds leaves out the schema compiles and populators
+    // that a read triggers.
+    struct ParseCounters
+    {
+        uint64_t Parses = 0;          // Command expressions read, visited or validated
+        uint64_t Tokens = 0;          // Argument tokens, including variable values and response file contents
+        uint64_t OptionLookups = 0;   // Switch and variable lookups
+        uint64_t CategoryLookups = 0; // Sub-category lookups
+        uint64_t Probes = 0;          // Hash table slots and ordered table entries examined by lookups
+        uint64_t Allocations = 0;     // Heap blocks allocated for expression contents and response files
+        uint64_t DomainChecks = 0;    // Variable values checked against a domain
+        uint64_t ReadNanoseconds = 0;
+        uint64_t FreezeNanoseconds = 0;   // Compiling the schema
+        uint64_t PopulateNanoseconds = 0; // Running deferred category populators
+        uint64_t FormatNanoseconds = 0;   // Formatting read errors
+
+        ParseCounters &operator+=(const ParseCounters &o);
+        ParseCounters &operator-=(const ParseCounters &o);
+        friend ParseCounters operator+(ParseCounters a, const ParseCounters &b) { return a += b; }
+        friend ParseCounters operator-(ParseCounters a, const ParseCounters &b) { return a -= b; }
+    };
+
+    // Returns the counters summed over all threads since the process started. Subtract two
+    // snapshots for the work done in between. Lock-free, and safe to call while other threads read.
+    ParseCounters GetParseCounters();
+
+    // Called after each read with the counters for that read alone and its result
+    using ParseObserver = std::function<void(const ParseCounters &counters, Status status)>;
+
+    //------------------------------------------------------------------------------------------------
+    // Per-thread counter storage behind ParseCounters. Each thread adds to a cache-line aligned
+    // block of its own with plain relaxed stores; snapshots sum the blocks with relaxed loads.
+    // Blocks are never freed, and the block of an exited thread is reused by the next new thread.
+    class CParseInstrumentation
+    {
+    public:
+        static constexpr size_t CounterCount = sizeof(ParseCounters) / sizeof(uint64_t);
+
+        struct alignas(64) Block
+        {
+            std::atomic<uint64_t> Values[CounterCount] = {};
+            std::atomic<bool> InUse{ false };
+            Block *Next = nullptr;
+        };
+
+    private:
+        static std::atomic<Block *> s_Blocks;
+        static inline thread_local Block *s_Local = nullptr;
+
+        static Block &RegisterThread();
+
+    public:
+        static Block &Local() { return s_Local ? *s_Local : RegisterThread(); }
+
+        static void Add(size_t counter, uint64_t n)
+        {
+            std::atomic<uint64_t> &value = Local().Values[counter];
+            value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+        }
+
+        // Counters of the calling thread alone
+        static ParseCounters LocalSnapshot();
+        static ParseCounters Snapshot();
+
+        static uint64_t Now()
+        {
+            return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+
+        // Adds the time until the end of the scope to a phase counter
+        struct PhaseTimer
+        {
+            size_t Counter;
+            uint64_t Start = Now();
+
+            explicit PhaseTimer(size_t counter) : Counter(counter) {}
+            ~PhaseTimer() { Add(Counter, Now() - Start); }
+        };
+    };
+
+    static_assert(std::is_standard_layout_v<ParseCounters> && sizeof(ParseCounters) == CParseInstrumentation::CounterCount * sizeof(uint64_t),
+        "ParseCounters must hold only uint64_t counters");
+
+#if defined(IN_COMMAND_INSTRUMENTATION)
+#define IN_COMMAND_COUNT(counter, n) ::InCommand::CParseInstrumentation::Add(offsetof(::InCommand::ParseCounters, counter) / sizeof(uint64_t), uint64_t(n))
+#define IN_COMMAND_TIME_PHASE(counter) ::InCommand::CParseInstrumentation::PhaseTimer inCommandPhaseTimer(offsetof(::InCommand::ParseCounters, counter) / sizeof(uint64_t))
+#else
+#define IN_COMMAND_COUNT(counter, n) ((void)0)
+#define IN_COMMAND_TIME_PHASE(counter) ((void)0)
+#endif
+
+    //------------------------------------------------------------------------------------------------
+    // Trace spans of reads, declarations, schema compiles, populators, help rendering and
+    // dispatch, written as Chrome trace-event JSON for chrome://tracing or Perfetto. Recorded only
+    // in builds defining IN_COMMAND_TRACING; otherwise the spans compile out. Each thread records
+    // into a ring of its own holding its most recent RingCapacity spans. Timestamps are
+    // std::chrono::steady_clock time, so spans line up with an application's own spans taken
+    // from the same clock.
+    class CTraceRecorder
+    {
+    public:
+        static constexpr size_t RingCapacity = 4096;
+
+        struct Event
+        {
+            const char *Name; // String literal
+            uint32_t ThreadId;
+            uint64_t Start;   // Nanoseconds
+            uint64_t Duration;
+        };
+
+        struct Ring
+        {
+            std::mutex Mutex; // Taken by the owning thread per span and by Write, so rarely contended
+            Event Events[RingCapacity];
+            uint64_t Recorded = 0;
+            std::atomic<bool> InUse{ false };
+            Ring *Next = nullptr;
+        };
+
+    private:
+        static std::atomic<Ring *> s_Rings;
+        static std::atomic<bool> s_Enabled;
+        static inline thread_local Ring *s_Local = nullptr;
+        static inline thread_local uint32_t s_ThreadId = 0;
+
+        static Ring &RegisterThread();
+
+    public:
+        static bool IsEnabled() { return s_Enabled.load(std::memory_order_relaxed); }
+        static void SetEnabled(bool enabled) { s_Enabled.store(enabled, std::memory_order_relaxed); }
+
+        static void Record(const char *name, uint64_t start, uint64_t duration);
+
+        // Writes the buffered spans of all threads, including exited ones, and discards them
+        static void Write(std::ostream &out);
+
+        // Records a span from construction to the end of the scope
+        class Span
+        {
+            const char *m_Name;
+            uint64_t m_Start;
+            bool m_Recording;
+
+        public:
+            explicit Span(const char *name) :
+                m_Name(name),
+                m_Start(0),
+                m_Recording(IsEnabled())
+            {
+                if (m_Recording)
+                    m_Start = CParseInstrumentation::Now();
+            }
+
+            ~Span()
+            {
+                if (m_Recording)
+                    Record(m_Name, m_Start, CParseInstrumentation::Now() - m_Start);
+            }
+
+            Span(const Span &) = delete;
+            Span &operator=(const Span &) = delete;
+        };
+    };
+
+    // Pauses or resumes span recording in tracing builds. Recording starts enabled.
+    inline void SetTraceEnabled(bool enabled) { CTraceRecorder::SetEnabled(enabled); }
+
+    // Writes the spans buffered so far as Chrome trace-event JSON and discards them. Returns
+    // Status::NotFound if path cannot be opened for writing. Without IN_COMMAND_TRACING the trace
+    // is empty.
+    Status WriteTrace(const std::string &path);
+    inline void WriteTrace(std::ostream &out) { CTraceRecorder::Write(out); }
+
+#if defined(IN_COMMAND_TRACING)
+#define IN_COMMAND_TRACE_SPAN(name) ::InCommand::CTraceRecorder::Span inCommandTraceSpan(name)
+#else
+#define IN_COMMAND_TRACE_SPAN(name) ((void)0)
+#endif
+
+    //------------------------------------------------------------------------------------------------
+    // Usage counts of a reader's categories or options (see CCommandReader::EnableUsageCounters).
+    // Each thread increments a shard of its own, made of cache-line aligned blocks, with relaxed
+    // atomics, so threads reading through a shared reader do not contend; Get sums the shards.
+    // A shard is allocated when a thread first counts into it, and there are at most MaxShards,
+    // so memory follows the threads that actually read rather than the core count. Threads
+    // beyond the shard count share shards.
+    class CUsageCounters
+    {
+        static constexpr size_t ValuesPerLine = 8;
+        static constexpr size_t MaxShards = 16; // A power of 2
+
+        struct alignas(64) Line
+        {
+            std::atomic<uint64_t> Values[ValuesPerLine] = {};
+        };
+
+        size_t m_Size;
+        size_t m_LinesPerShard;
+        size_t m_ShardMask; // Shard count minus 1, a power of 2
+        std::atomic<Line *> m_Shards[MaxShards]; // Null until first counted into
+
+        static inline std::atomic<size_t> s_NextShard{ 0 };
+
+        static size_t ThreadShard()
+        {
+            static thread_local size_t shard = s_NextShard.fetch_add(1, std::memory_order_relaxed);
+            return shard;
+        }
+
+        static std::atomic<uint64_t> &Value(Line *lines, size_t index)
+        {
+            return lines[index / ValuesPerLine].Values[index % ValuesPerLine];
+        }
+
+        // Returns the lines of the shard, allocating them if no thread has yet
+        Line *AllocateShard(size_t shard);
+
+    public:
+        // Counts size indices, starting from the counts of previous if given
+        explicit CUsageCounters(size_t size, const CUsageCounters *previous = nullptr);
+        ~CUsageCounters();
+
+        CUsageCounters(const CUsageCounters &) = delete;
+        CUsageCounters &operator=(const CUsageCounters &) = delete;
+
+        size_t GetSize() const { return m_Size; }
+
+        void Increment(size_t index)
+        {
+            if (index >= m_Size)
+                return;
+            size_t shard = ThreadShard() & m_ShardMask;
+            Line *lines = m_Shards[shard].load(std::memory_order_acquire);
+            if (!lines)
+                lines = AllocateShard(shard);
+            Value(lines, index).fetch_add(1, std::memory_order_relaxed);
+        }
+
+        uint64_t Get(size_t index) const;
+        void Reset();
+    };
+
+    //------------------------------------------------------------------------------------------------
+    struct UsageCount
+    {
+        ArgumentType Type;
+        IndexType Index;  // Of the category or option handle
+        std::string Path; // Category names from the root, followed by the option for options
+        uint64_t Count;
+    };
+
+    //------------------------------------------------------------------------------------------------
+    // Values of a rest parameter. The values are not copied; each run of consecutive values is
+    // recorded as a single segment referring either to the original argv elements or to the
+    // response file text they were read from. Memory use therefore depends on the number of
+    // interruptions (options, response file boundaries) rather than the number of values.
+    // The argv array or buffer passed to ReadCommandExpression must outlive the span.
+    class CParameterSpan
+    {
+        friend class CCommandReader;
+        friend class CSerializedExpression;
+
+        struct Segment
+        {
+            TokenFormat Format;
+            const char *const *Argv; // First argv element of the run for TokenFormat::Argv
+            const char *Begin;       // Text containing the run for other formats
+            const char *End;
+            size_t Count;
+        };
+
+        std::vector<Segment> m_Segments;
+        size_t m_Size = 0;
+        size_t m_LastFrame = 0;
+        size_t m_LastOrdinal = 0;
+
+        void Append(TokenFormat format, const char *const *argvElement, const char *rawBegin, const char *rawEnd, size_t frame, size_t ordinal)
+        {
+            if (m_Size > 0 && frame == m_LastFrame && ordinal == m_LastOrdinal + 1)
+            {
+                Segment &segment = m_Segments.back();
+                segment.End = rawEnd;
+                segment.Count++;
+            }
+            else
+            {
+                m_Segments.push_back({ format, argvElement, rawBegin, rawEnd, 1 });
+            }
+
+            m_LastFrame = frame;
+            m_LastOrdinal = ordinal;
+            m_Size++;
+        }
+
+    public:
+        class Iterator
+        {
+            const Segment *m_Segment;
+            const Segment *m_SegmentEnd;
+            size_t m_Index = 0;
+            const char *m_Cursor = nullptr;
+            std::string_view m_Value;
+
+            void Load()
+            {
+                if (m_Segment == m_SegmentEnd)
+                    return;
+
+                const char *rawBegin;
+                switch (m_Segment->Format)
+                {
+                case TokenFormat::Argv:
+                    m_Value = m_Segment->Argv[m_Index];
+                    break;
+                case TokenFormat::ResponseFile:
+                    ScanResponseFileToken(m_Cursor, m_Segment->End, rawBegin, m_Value);
+                    break;
+                case TokenFormat::NulSeparated:
+                    ScanNulSeparatedToken(m_Cursor, m_Segment->End, rawBegin, m_Value);
+                    break;
+                }
+            }
+
+        public:
+            using iterator_category = std::forward_iterator_tag;
+            using value_type = std::string_view;
+            using difference_type = std::ptrdiff_t;
+            using pointer = const std::string_view *;
+            using reference = const std::string_view &;
+
+            Iterator(const Segment *segment, const Segment *segmentEnd) :
+                m_Segment(segment),
+                m_SegmentEnd(segmentEnd)
+            {
+                if (m_Segment != m_SegmentEnd)
+                    m_Cursor = m_Segment->Begin;
+                Load();
+            }
+
+            reference operator*() const { return m_Value; }
+            pointer operator->() const { return &m_Value; }
+
+            Iterator &operator++()
+            {
+                if (++m_Index == m_Segment->Count)
+                {
+                    m_Index = 0;
+                    if (++m_Segment != m_SegmentEnd)
+                        m_Cursor = m_Segment->Begin;
+                }
+                Load();
+                return *this;
+            }
+
+            Iterator operator++(int)
+            {
+                Iterator it = *this;
+                ++*this;
+                return it;
+            }
+
+            bool operator==(const Iterator &o) const { return m_Segment == o.m_Segment && m_Index == o.m_Index; }
+            bool operator!=(const Iterator &o) const { return !(*this == o); }
+        };
+
+        Iterator begin() const { return Iterator(m_Segments.data(), m_Segments.data() + m_Segments.size()); }
+        Iterator end() const { return Iterator(m_Segments.data() + m_Segments.size(), m_Segments.data() + m_Segments.size()); }
+        size_t size() const { return m_Size; }
+        bool empty() const { return m_Size == 0; }
+
+        // Number of contiguous runs the values are stored as
+        size_t GetSegmentCount() const { return m_Segments.size(); }
+    };
+
     //------------------------------------------------------------------------------------------------
     class CCommandExpression
     {
@@ -111,13 +658,25 @@ namespace InCommand
             }
             
             CategoryHandle Category;
-            size_t ParameterCount = 0;
         };
 
         std::vector<CategoryLevel> m_CategoryLevels;
         std::unordered_map<VariableHandle, std::string, HandleHasher<ArgumentType::Variable>> m_VariableMap;
         std::unordered_map<ParameterHandle, std::string, HandleHasher<ArgumentType::Parameter>> m_ParameterMap;
         std::unordered_set<SwitchHandle, HandleHasher<ArgumentType::Switch>> m_Switches;
+        std::unordered_map<ParameterHandle, CParameterSpan, HandleHasher<ArgumentType::Parameter>> m_RestParameterMap;
+
+        // Keeps response files referenced by rest parameter values mapped
+        std::vector<std::shared_ptr<const CMappedFile>> m_ResponseFiles;
+
+        uint32_t m_Generation = 0; // Of the reader that read the expression
+
+        template<ArgumentType Type>
+        void CheckGeneration(const Handle<Type> &handle) const // throw Exception
+        {
+            if (!IsSameGeneration(handle.m_Generation, m_Generation))
+                throw Exception(Status::InvalidHandle);
+        }
 
         size_t AddCategoryLevel(CategoryHandle category)
         {
@@ -134,8 +693,11 @@ namespace InCommand
             return m_CategoryLevels.back().Category;
         }
 
+        // The Get methods throw Exception(Status::InvalidHandle) for handles issued by a reader
+        // other than the one that read the expression.
         const std::string &GetParameterValue(ParameterHandle parameter, const std::string &defaultValue) const
         {
+            CheckGeneration(parameter);
             auto it = m_ParameterMap.find(parameter);
             if (it == m_ParameterMap.end())
                 return defaultValue;
@@ -145,6 +707,7 @@ namespace InCommand
 
         const std::string &GetVariableValue(VariableHandle variable, const std::string &defaultValue) const
         {
+            CheckGeneration(variable);
             auto it = m_VariableMap.find(variable);
             if (it == m_VariableMap.end())
                 return defaultValue;
@@ -152,148 +715,1243 @@ namespace InCommand
             return it->second;
         }
 
+        // Returns the values of a rest parameter in the order they were read
+        const CParameterSpan &GetRestParameterValues(ParameterHandle parameter) const
+        {
+            static const CParameterSpan emptySpan;
+            CheckGeneration(parameter);
+            auto it = m_RestParameterMap.find(parameter);
+            if (it == m_RestParameterMap.end())
+                return emptySpan;
+
+            return it->second;
+        }
+
         bool GetParameterIsSet(ParameterHandle parameter) const
         {
+            CheckGeneration(parameter);
             auto it = m_ParameterMap.find(parameter);
-            return it != m_ParameterMap.end();
+            return it != m_ParameterMap.end() || m_RestParameterMap.find(parameter) != m_RestParameterMap.end();
         }
 
         bool GetVariableIsSet(VariableHandle variable) const
         {
+            CheckGeneration(variable);
             auto it = m_VariableMap.find(variable);
             return it != m_VariableMap.end();
         }
 
         bool GetSwitchIsSet(SwitchHandle sh) const
         {
+            CheckGeneration(sh);
             auto it = m_Switches.find(sh);
             return it != m_Switches.end();
         }
+
+        // 64-bit hash of the expression's category path, switches and values. Independent of the
+        // order options appeared in and of short versus long option spelling, so equivalent command
+        // lines hash identically.
+        uint64_t GetCanonicalHash() const;
     };
 
-    inline const CategoryHandle RootCategory = CategoryHandle(0);
-    inline const CategoryHandle NullCategory = CategoryHandle(size_t(0) - 1);
+    //------------------------------------------------------------------------------------------------
+    // Receives parameter values as they are read. Values refer to argv or response file text and
+    // remain valid while the argv array and the CCommandExpression being read are alive.
+    using ParameterSink = std::function<void(std::string_view value)>;
 
     //------------------------------------------------------------------------------------------------
-    class CCommandReader
+    // Bounded single-producer/single-consumer queue of parameter values. Lets a consumer thread
+    // process values while ReadCommandExpression is still reading arguments. Push waits while the
+    // queue is full, so memory use is bounded by the capacity.
+    class CParameterQueue
     {
-        struct OptionDesc
+        std::vector<std::string_view> m_Ring;
+        size_t m_Mask;
+        alignas(64) std::atomic<size_t> m_Head{ 0 }; // Next slot to pop
+        alignas(64) std::atomic<size_t> m_Tail{ 0 }; // Next slot to push
+        std::atomic<bool> m_Closed{ false };
+
+    public:
+        // Capacity is rounded up to a power of two
+        explicit CParameterQueue(size_t capacity)
         {
-            ArgumentType Type;
-            std::string Name;
-            std::string Description;
-            std::set<std::string> Domain;
+            size_t size = 1;
+            while (size < capacity)
+                size <<= 1;
+            m_Ring.resize(size);
+            m_Mask = size - 1;
+        }
 
-            OptionDesc(ArgumentType type, const std::string &name, const std::string &description) :
-                Type(type),
-                Name(name),
-                Description(description)
-            {
-            }
+        void Push(std::string_view value)
+        {
+            size_t tail = m_Tail.load(std::memory_order_relaxed);
+            while (tail - m_Head.load(std::memory_order_acquire) == m_Ring.size())
+                std::this_thread::yield();
+            m_Ring[tail & m_Mask] = value;
+            m_Tail.store(tail + 1, std::memory_order_release);
+        }
 
-            OptionDesc(ArgumentType type, const std::string &name, const std::string &description, const std::vector<std::string> domain) :
-                Type(type),
-                Name(name),
-                Description(description),
-                Domain(std::set<std::string>(domain.begin(), domain.end()))
-            {
-            }
-        };
+        // Signals the consumer that no more values will be pushed
+        void Close()
+        {
+            m_Closed.store(true, std::memory_order_release);
+        }
 
-        struct CategoryDesc
+        // Waits for the next value. Returns false once the queue is closed and drained.
+        bool Pop(std::string_view &value)
         {
-            CategoryDesc(CategoryHandle parent, const std::string &name, const std::string &description) :
-                Parent(parent),
-                Name(name),
-                Description(description)
+            size_t head = m_Head.load(std::memory_order_relaxed);
+            for (;;)
             {
+                if (head != m_Tail.load(std::memory_order_acquire))
+                    break;
+                if (m_Closed.load(std::memory_order_acquire))
+                {
+                    if (head != m_Tail.load(std::memory_order_acquire))
+                        break;
+                    return false;
+                }
+                std::this_thread::yield();
             }
-            
-            CategoryHandle Parent;
-            std::string Name;
-            std::string Description;
-            std::map<std::string, CategoryHandle> SubCategoryMap;
-            std::map<std::string, size_t> OptionDescIndexByNameMap;
-            std::unordered_map<char, size_t> OptionDescIndexByShortNameMap;
-            std::vector<size_t> ParameterIds;
-        };
+            value = m_Ring[head & m_Mask];
+            m_Head.store(head + 1, std::memory_order_release);
+            return true;
+        }
 
-        CategoryDesc &CategoryDescThrow(size_t categoryIndex) // throw Exception
+        ParameterSink GetSink()
         {
-            if (categoryIndex >= m_CategoryDescs.size())
-                throw Exception(Status::OutOfRange);
-
-            return m_CategoryDescs[categoryIndex];
+            return [this](std::string_view value) { Push(value); };
         }
+    };
 
-        size_t AddVariableOrSwitchOption(
-            ArgumentType type,
-            CategoryHandle category,
-            const std::string &name,
-            char shortName,
-            const std::vector<std::string> &domain,
-            const std::string &description);
+    inline const CategoryHandle RootCategory = CategoryHandle(0);
+    inline const CategoryHandle NullCategory = CategoryHandle(std::numeric_limits<IndexType>::max());
 
-    private:
-        std::vector<CategoryDesc> m_CategoryDescs;
-        std::vector<OptionDesc> m_OptionsDescs;
-        ReadErrorDesc m_LastReadError;
+    //------------------------------------------------------------------------------------------------
+    // Read-only view of a blob produced by CCommandReader::SerializeExpression. Queries are answered
+    // directly from the blob without decoding it into a CCommandExpression; returned values refer
+    // into the blob, which must outlive this object.
+    //
+    // Layout (host byte order, no padding):
+    //   uint32 magic, uint32 version, uint64 schema fingerprint
+    //   uint32 category count, uint32 category index[count]           - category path from the root
+    //   uint32 switch word count, uint64 switch bits[count]           - bit i set for switch handle i
+    //   uint32 variable count, { uint32 handle, uint32 length, bytes }[count]
+    //   uint32 parameter count, { uint32 handle, uint32 length, bytes }[count]
+    //   uint32 rest count, { uint32 handle, uint32 value count, uint32 length, NUL-separated values }[count]
+    class CSerializedExpression
+    {
+        std::string_view m_Blob;
+        size_t m_CategoryOffset = 0;
+        size_t m_SwitchOffset = 0;
+        size_t m_VariableOffset = 0;
+        size_t m_ParameterOffset = 0;
+        size_t m_RestOffset = 0;
 
-    public:
-        CCommandReader(const std::string appName) :
-            m_CategoryDescs(1, CategoryDesc(NullCategory, appName, ""))
+        static uint32_t ReadU32(const char *p)
         {
+            uint32_t value;
+            std::memcpy(&value, p, sizeof(value));
+            return value;
         }
 
-        CategoryHandle DeclareCategory(CategoryHandle parent, const std::string &name, const std::string &description = std::string())
+        // Finds a length-prefixed value entry in the section at offset
+        bool FindValue(size_t offset, size_t handle, std::string_view &value) const
         {
-            if (parent.m_Value >= m_CategoryDescs.size())
-                throw Exception(Status::InvalidHandle);
-
-            CategoryHandle category = CategoryHandle(m_CategoryDescs.size());
-            m_CategoryDescs.emplace_back(parent, name, description);
-            m_CategoryDescs[parent.m_Value].SubCategoryMap.emplace(name, category);
-            return category;
+            if (!IsOpen())
+                return false;
+            const char *p = m_Blob.data() + offset;
+            uint32_t count = ReadU32(p);
+            p += 4;
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                uint32_t length = ReadU32(p + 4);
+                if (ReadU32(p) == handle)
+                {
+                    value = std::string_view(p + 8, length);
+                    return true;
+                }
+                p += 8 + length;
+            }
+            return false;
         }
 
-        CategoryHandle DeclareCategory(const std::string &name, const std::string &description = std::string())
+    public:
+        static const uint32_t Magic = 0x58434E49; // "INCX"
+        static const uint32_t Version = 1;
+
+        // Validates the blob structure and checks that it was produced for reader's schema. Returns
+        // Status::SchemaMismatch if the fingerprints differ or Status::InvalidFormat if the blob is
+        // malformed.
+        Status Open(const CCommandReader &reader, std::string_view blob);
+
+        // False until Open succeeds. Until then the getters return their defaults, except
+        // GetCategory, which throws Exception(Status::InvalidFormat).
+        bool IsOpen() const { return !m_Blob.empty(); }
+
+        CategoryHandle GetCategory() const // throw Exception
         {
-            return DeclareCategory(RootCategory, name, description);
+            if (!IsOpen())
+                throw Exception(Status::InvalidFormat);
+            uint32_t count = ReadU32(m_Blob.data() + m_CategoryOffset);
+            return CategoryHandle(ReadU32(m_Blob.data() + m_CategoryOffset + 4 * count));
         }
 
-        ParameterHandle DeclareParameter(CategoryHandle category, const std::string &name, const std::string &description = std::string())
+        bool GetSwitchIsSet(SwitchHandle sh) const
         {
-            if (category.m_Value >= m_CategoryDescs.size())
-                throw Exception(Status::OutOfRange);
-            size_t index = m_OptionsDescs.size();
-            m_OptionsDescs.emplace_back(ArgumentType::Parameter, name, description);
-            m_CategoryDescs[category.m_Value].ParameterIds.push_back(index);
-            return ParameterHandle(index);
+            if (!IsOpen())
+                return false;
+            uint32_t wordCount = ReadU32(m_Blob.data() + m_SwitchOffset);
+            size_t word = sh.m_Value / 64;
+            if (word >= wordCount)
+                return false;
+            uint64_t bits;
+            std::memcpy(&bits, m_Blob.data() + m_SwitchOffset + 4 + 8 * word, sizeof(bits));
+            return (bits >> (sh.m_Value % 64)) & 1;
         }
 
-        ParameterHandle DeclareParameter(const std::string &name, const std::string &description = std::string())
+        std::string_view GetVariableValue(VariableHandle variable, std::string_view defaultValue) const
         {
-            return DeclareParameter(RootCategory, name, description);
+            std::string_view value;
+            return FindValue(m_VariableOffset, variable.m_Value, value) ? value : defaultValue;
         }
 
-        VariableHandle DeclareVariable(CategoryHandle category, const std::string &name, const std::string &description = std::string())
+        bool GetVariableIsSet(VariableHandle variable) const
         {
-            return VariableHandle(AddVariableOrSwitchOption(ArgumentType::Variable, category, name, '-', {}, description));
+            std::string_view value;
+            return FindValue(m_VariableOffset, variable.m_Value, value);
         }
 
-        VariableHandle DeclareVariable(CategoryHandle category, const std::string &name, const std::vector<std::string> &domain, const std::string &description = std::string())
+        std::string_view GetParameterValue(ParameterHandle parameter, std::string_view defaultValue) const
         {
-            return VariableHandle(AddVariableOrSwitchOption(ArgumentType::Variable, category, name, '-', domain, description));
+            std::string_view value;
+            return FindValue(m_ParameterOffset, parameter.m_Value, value) ? value : defaultValue;
         }
 
-        VariableHandle DeclareVariable(const std::string &name, const std::vector<std::string> &domain, const std::string &description = std::string())
+        bool GetParameterIsSet(ParameterHandle parameter) const
+        {
+            std::string_view value;
+            return FindValue(m_ParameterOffset, parameter.m_Value, value) || !GetRestParameterValues(parameter).empty();
+        }
+
+        // The returned span refers into the blob
+        CParameterSpan GetRestParameterValues(ParameterHandle parameter) const
+        {
+            CParameterSpan span;
+            if (!IsOpen())
+                return span;
+            const char *p = m_Blob.data() + m_RestOffset;
+            uint32_t count = ReadU32(p);
+            p += 4;
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                uint32_t valueCount = ReadU32(p + 4);
+                uint32_t length = ReadU32(p + 8);
+                if (ReadU32(p) == parameter.m_Value)
+                {
+                    span.m_Segments.push_back({ TokenFormat::NulSeparated, nullptr, p + 12, p + 12 + length, valueCount });
+                    span.m_Size = valueCount;
+                    break;
+                }
+                p += 12 + length;
+            }
+            return span;
+        }
+    };
+
+    //------------------------------------------------------------------------------------------------
+    // Maps categories to command handlers. Handlers are stored in a dense table indexed by category
+    // so Dispatch is a single indexed call regardless of the number of categories. Handler may be
+    // any callable type accepting (const CCommandExpression &, Args...). With a concrete callable
+    // type rather than std::function the call is resolved at compile time and can be inlined.
+    template<typename Handler = std::function<int(const CCommandExpression &)>>
+    class CCommandDispatcher
+    {
+        std::vector<std::optional<Handler>> m_Handlers;
+        uint32_t m_Generation = 0; // Of the first category given a handler
+
+    public:
+        // Handlers must all be set for categories of one reader. Throws
+        // Exception(Status::InvalidHandle) for a category of another schema generation.
+        void SetHandler(CategoryHandle category, Handler handler)
+        {
+            if (category == NullCategory || !IsSameGeneration(category.m_Generation, m_Generation))
+                throw Exception(Status::InvalidHandle);
+            if (m_Generation == 0)
+                m_Generation = category.m_Generation;
+            if (category.m_Value >= m_Handlers.size())
+                m_Handlers.resize(category.m_Value + 1);
+            m_Handlers[category.m_Value] = std::move(handler);
+        }
+
+        bool HasHandler(CategoryHandle category) const
+        {
+            return category.m_Value < m_Handlers.size() && m_Handlers[category.m_Value].has_value();
+        }
+
+        // Invokes the handler registered for the expression's category. Throws
+        // Exception(Status::NotFound) if the category has no handler, or
+        // Exception(Status::InvalidHandle) if the expression was read by a reader of another
+        // schema generation than the handlers were set for.
+        template<typename... Args>
+        decltype(auto) Dispatch(const CCommandExpression &expression, Args &&...args) const
+        {
+            IN_COMMAND_TRACE_SPAN("Dispatch");
+            CategoryHandle category = expression.GetCategory();
+            if (!IsSameGeneration(category.m_Generation, m_Generation))
+                throw Exception(Status::InvalidHandle);
+            if (!HasHandler(category))
+                throw Exception(Status::NotFound);
+            return (*m_Handlers[category.m_Value])(expression, std::forward<Args>(args)...);
+        }
+
+        // Dispatches each expression and returns the handler results in order. With a threadCount
+        // greater than 1 the expressions are dispatched concurrently, so they must be independent
+        // and the handlers thread-safe. If any handler throws, the first exception is rethrown
+        // after all threads finish. Handlers returning void make DispatchAll return void.
+        template<typename... Args>
+        auto DispatchAll(const std::vector<CCommandExpression> &expressions, unsigned threadCount, const Args &...args) const
+        {
+            using Result = std::decay_t<decltype(Dispatch(expressions.front(), args...))>;
+            constexpr bool hasResult = !std::is_void_v<Result>;
+            std::vector<std::optional<std::conditional_t<hasResult, Result, bool>>> results(hasResult ? expressions.size() : 0);
+            std::vector<std::exception_ptr> exceptions(expressions.size());
+            std::atomic<size_t> next{ 0 };
+
+            auto worker = [&]()
+            {
+                for (size_t i = next.fetch_add(1, std::memory_order_relaxed); i < expressions.size(); i = next.fetch_add(1, std::memory_order_relaxed))
+                {
+                    try
+                    {
+                        if constexpr (hasResult)
+                            results[i].emplace(Dispatch(expressions[i], args...));
+                        else
+                            Dispatch(expressions[i], args...);
+                    }
+                    catch (...)
+                    {
+                        exceptions[i] = std::current_exception();
+                    }
+                }
+            };
+
+            std::vector<std::thread> threads;
+            for (unsigned t = 1; t < std::min<size_t>(threadCount, expressions.size()); ++t)
+                threads.emplace_back(worker);
+            worker();
+            for (auto &thread : threads)
+                thread.join();
+
+            for (auto &exception : exceptions)
+            {
+                if (exception)
+                    std::rethrow_exception(exception);
+            }
+
+            if constexpr (hasResult)
+            {
+                std::vector<Result> values;
+                values.reserve(results.size());
+                for (auto &result : results)
+                    values.push_back(std::move(*result));
+                return values;
+            }
+        }
+    };
+
+    //------------------------------------------------------------------------------------------------
+    // Declares the contents of a deferred category. See CCommandReader::DeclareCategory.
+    using CategoryPopulator = std::function<void(CCommandReader &reader, CategoryHandle category)>;
+
+    //------------------------------------------------------------------------------------------------
+    class CCommandReader
+    {
+        friend class CReloadableReader;
+        friend class CCommandServer;
+        friend class CExpressionCache;
+
+        // Location of a string in the reader's string pool. All schema strings are interned in the
+        // pool once and referred to by offset, so the schema holds no pointers and equal names
+        // share one copy.
+        struct PooledString
+        {
+            uint32_t Offset = 0;
+            uint32_t Length = 0;
+
+            bool operator==(const PooledString &o) const { return Offset == o.Offset && Length == o.Length; }
+        };
+
+        struct OptionDesc
+        {
+            std::vector<PooledString> Domain; // Ordered by value
+            PooledString Name;
+            PooledString Description;
+            ArgumentType Type;
+            char ShortName = '-';
+            bool Inherited = false; // Visible in all descendants of the declaring category
+
+            OptionDesc(ArgumentType type, PooledString name, PooledString description) :
+                Name(name),
+                Description(description),
+                Type(type)
+            {
+            }
+        };
+
+        // Compiled, read-only form of the schema. Freeze builds one from the declarations and every
+        // read uses it exclusively. Records refer to each other by index and to strings and arrays
+        // by offset from the start of the image, so an image works at any address; PublishSchema
+        // places one in shared memory for other processes to map.
+        //
+        // A layered image, compiled by a copy of a reader, extends the image of the copied reader
+        // (its base) and holds only what the copy declared since. Its index and offset spaces
+        // continue those of the base, and it carries its own records for the base categories whose
+        // contents changed, listed in Overrides. Everything else is looked up in the base.
+        //
+        // Layout, each section aligned to 8 bytes:
+        //   Header | Category[] | uint32_t Overrides[OverrideCount] | Option[] | uint32_t[] words | char[] strings
+        // Categories are the new ones followed by the overriding records, in the order of Overrides.
+        class SchemaImage
+        {
+        public:
+            static constexpr uint32_t Magic = 0x53434e49; // "INCS"
+            static constexpr uint32_t Version = 3;
+            static constexpr uint32_t NoIndex = UINT32_MAX;
+
+            // Run of words in the word section
+            struct Range
+            {
+                uint32_t Offset;
+                uint32_t Count;
+            };
+
+            // Counts and sizes include the base; the Base fields are 0 for images without one
+            struct Header
+            {
+                uint32_t Magic;
+                uint32_t Version;
+                uint64_t Fingerprint;
+                uint32_t Generation; // Of the compiling reader
+                uint32_t CategoryCount;
+                uint32_t OptionCount;
+                uint32_t WordCount;
+                uint32_t StringsSize;
+                uint32_t BaseCategoryCount;
+                uint32_t BaseOptionCount;
+                uint32_t BaseWordCount;
+                uint32_t BaseStringsSize;
+                uint32_t OverrideCount;
+            };
+
+            // Switches and variables are the category's own options merged with those inherited
+            // from its ancestors, held in a hash-and-displace perfect hash keyed on the argument as
+            // written ("--name" or "-n"), so lookup is a single probe regardless of category depth.
+            struct Category
+            {
+                uint32_t Parent; // NoIndex for the root
+                PooledString Name;
+                PooledString Description;
+                Range SubCategories; // Ordered by name
+                Range ParameterIds;
+                uint32_t RestParameterId; // NoIndex if none
+                uint32_t Deferred;        // Non-zero until the category's populator has run
+                Range Seeds;              // Displacement seed per bucket
+                Range Slots;              // Option index per slot, or NoIndex
+                Range SortedNames;        // Option indices ordered by name, for prefix matching
+            };
+
+            struct Option
+            {
+                PooledString Name;
+                PooledString Description;
+                Range Domain;      // Offset and length word pairs, ordered by value
+                uint32_t Category; // Declaring category
+                uint8_t Type;      // ArgumentType
+                char ShortName;
+                uint8_t Inherited;
+                uint8_t Reserved;
+            };
+
+            template<typename T>
+            struct Span
+            {
+                const T *Data;
+                size_t Count;
+
+                const T *begin() const { return Data; }
+                const T *end() const { return Data + Count; }
+                size_t size() const { return Count; }
+                bool empty() const { return Count == 0; }
+                const T &operator[](size_t index) const { return Data[index]; }
+            };
+
+            static size_t SectionSize(size_t size) { return (size + 7) & ~size_t(7); }
+
+            // Total size of an image with the given header counts
+            static size_t ImageSize(const Header &header)
+            {
+                return SectionSize(sizeof(Header)) +
+                    SectionSize(size_t(header.CategoryCount - header.BaseCategoryCount + header.OverrideCount) * sizeof(Category)) +
+                    SectionSize(size_t(header.OverrideCount) * sizeof(uint32_t)) +
+                    SectionSize(size_t(header.OptionCount - header.BaseOptionCount) * sizeof(Option)) +
+                    SectionSize(size_t(header.WordCount - header.BaseWordCount) * sizeof(uint32_t)) +
+                    SectionSize(header.StringsSize - header.BaseStringsSize);
+            }
+
+            // Checks that data holds a complete image without a base whose indices and ranges are
+            // all in bounds
+            static bool IsValid(const char *data, size_t size);
+
+        private:
+            std::shared_ptr<const void> m_Storage; // Keeps the image bytes alive
+            std::shared_ptr<const SchemaImage> m_Base;
+            const Header *m_Header;
+            const Category *m_Categories;
+            const uint32_t *m_Overrides;
+            const Option *m_Options;
+            const uint32_t *m_Words;
+            const char *m_Strings;
+            uint32_t m_BaseCategoryCount;
+            uint32_t m_BaseOptionCount;
+            uint32_t m_BaseWordCount;
+            uint32_t m_BaseStringsSize;
+
+            const Category &GetBaseCategory(size_t index) const
+            {
+                const uint32_t *overridesEnd = m_Overrides + m_Header->OverrideCount;
+                const uint32_t *it = std::lower_bound(m_Overrides, overridesEnd, uint32_t(index));
+                if (it != overridesEnd && *it == index)
+                    return m_Categories[m_Header->CategoryCount - m_BaseCategoryCount + (it - m_Overrides)];
+                return m_Base->GetCategory(index);
+            }
+
+            void CopyWords(uint32_t *words) const;
+            void CopyStrings(char *strings) const;
+
+        public:
+            // data must be 8-byte aligned and hold a valid image, extending base if it has one
+            SchemaImage(std::shared_ptr<const void> storage, const char *data, std::shared_ptr<const SchemaImage> base = nullptr) :
+                m_Storage(std::move(storage)),
+                m_Base(std::move(base))
+            {
+                m_Header = reinterpret_cast<const Header *>(data);
+                m_BaseCategoryCount = m_Header->BaseCategoryCount;
+                m_BaseOptionCount = m_Header->BaseOptionCount;
+                m_BaseWordCount = m_Header->BaseWordCount;
+                m_BaseStringsSize = m_Header->BaseStringsSize;
+                data += SectionSize(sizeof(Header));
+                m_Categories = reinterpret_cast<const Category *>(data);
+                data += SectionSize(size_t(m_Header->CategoryCount - m_BaseCategoryCount + m_Header->OverrideCount) * sizeof(Category));
+                m_Overrides = reinterpret_cast<const uint32_t *>(data);
+                data += SectionSize(size_t(m_Header->OverrideCount) * sizeof(uint32_t));
+                m_Options = reinterpret_cast<const Option *>(data);
+                data += SectionSize(size_t(m_Header->OptionCount - m_BaseOptionCount) * sizeof(Option));
+                m_Words = reinterpret_cast<const uint32_t *>(data);
+                data += SectionSize(size_t(m_Header->WordCount - m_BaseWordCount) * sizeof(uint32_t));
+                m_Strings = data;
+            }
+
+            // Copies a layered image and its bases into a single image without a base
+            std::shared_ptr<const SchemaImage> Flatten() const;
+
+            bool IsLayered() const { return m_Base != nullptr; }
+            const char *GetData() const { return reinterpret_cast<const char *>(m_Header); }
+            size_t GetSize() const { return ImageSize(*m_Header); }
+            uint64_t GetFingerprint() const { return m_Header->Fingerprint; }
+            uint32_t GetGeneration() const { return m_Header->Generation; }
+            size_t GetCategoryCount() const { return m_Header->CategoryCount; }
+            size_t GetOptionCount() const { return m_Header->OptionCount; }
+            size_t GetWordCount() const { return m_Header->WordCount; }
+            size_t GetStringsSize() const { return m_Header->StringsSize; }
+
+            const Category &GetCategory(size_t index) const
+            {
+                return index >= m_BaseCategoryCount ? m_Categories[index - m_BaseCategoryCount] : GetBaseCategory(index);
+            }
+
+            const Option &GetOption(size_t index) const
+            {
+                return index >= m_BaseOptionCount ? m_Options[index - m_BaseOptionCount] : m_Base->GetOption(index);
+            }
+
+            Span<uint32_t> GetWords(Range range) const
+            {
+                if (range.Offset < m_BaseWordCount)
+                    return m_Base->GetWords(range);
+                return { m_Words + (range.Offset - m_BaseWordCount), range.Count };
+            }
+
+            std::string_view GetString(PooledString s) const
+            {
+                if (s.Offset < m_BaseStringsSize)
+                    return m_Base->GetString(s);
+                return std::string_view(m_Strings + (s.Offset - m_BaseStringsSize), s.Length);
+            }
+
+            std::string_view GetDomainValue(const Option &option, size_t index) const
+            {
+                Span<uint32_t> domain = GetWords(option.Domain);
+                return GetString({ domain[2 * index], domain[2 * index + 1] });
+            }
+
+            size_t FindOption(const Category &category, std::string_view arg) const
+            {
+                if (category.Slots.Count == 0)
+                    return NoIndex;
+
+                uint64_t hash = OptionKeyHash(arg);
+                uint32_t seed = GetWords(category.Seeds)[OptionBucket(hash, category.Seeds.Count)];
+                uint32_t optionIndex = GetWords(category.Slots)[OptionSlot(hash, seed, category.Slots.Count)];
+                IN_COMMAND_COUNT(Probes, 1);
+                if (optionIndex == NoIndex)
+                    return NoIndex;
+
+                // The slot only proves the key hashes like a declared option; confirm the name
+                const Option &option = GetOption(optionIndex);
+                bool match = arg[1] == '-' ? arg.substr(2) == GetString(option.Name) : arg[1] == option.ShortName;
+                return match ? optionIndex : NoIndex;
+            }
+
+            // Returns the first of the category's visible options whose name is not less than name
+            const uint32_t *LowerBoundOption(const Category &category, std::string_view name) const
+            {
+                Span<uint32_t> names = GetWords(category.SortedNames);
+                return std::lower_bound(names.begin(), names.end(), name,
+                    [this](uint32_t index, std::string_view key)
+                    {
+                        IN_COMMAND_COUNT(Probes, 1);
+                        return GetString(GetOption(index).Name) < key;
+                    });
+            }
+
+            // Finds the options whose long names start with prefix. Returns the number of matches,
+            // stopping at 2, and the first match in optionIndex.
+            size_t FindOptionByPrefix(const Category &category, std::string_view prefix, size_t &optionIndex) const
+            {
+                size_t matchCount = 0;
+                for (const uint32_t *it = LowerBoundOption(category, prefix);
+                    it != GetWords(category.SortedNames).end() && matchCount < 2 && GetString(GetOption(*it).Name).substr(0, prefix.size()) == prefix; ++it)
+                {
+                    IN_COMMAND_COUNT(Probes, 1);
+                    if (matchCount++ == 0)
+                        optionIndex = *it;
+                }
+                return matchCount;
+            }
+
+            // Returns the first sub-category whose name is not less than name
+            const uint32_t *LowerBoundSubCategory(const Category &category, std::string_view name) const
+            {
+                Span<uint32_t> subCategories = GetWords(category.SubCategories);
+                return std::lower_bound(subCategories.begin(), subCategories.end(), name,
+                    [this](uint32_t index, std::string_view key)
+                    {
+                        IN_COMMAND_COUNT(Probes, 1);
+                        return GetString(GetCategory(index).Name) < key;
+                    });
+            }
+
+            size_t FindSubCategory(const Category &category, std::string_view name) const
+            {
+                const uint32_t *it = LowerBoundSubCategory(category, name);
+                if (it == GetWords(category.SubCategories).end() || GetString(GetCategory(*it).Name) != name)
+                    return NoIndex;
+                return *it;
+            }
+
+            // Sub-category counterpart of FindOptionByPrefix
+            size_t FindSubCategoryByPrefix(const Category &category, std::string_view prefix, size_t &categoryIndex) const
+            {
+                size_t matchCount = 0;
+                for (const uint32_t *it = LowerBoundSubCategory(category, prefix);
+                    it != GetWords(category.SubCategories).end() && matchCount < 2 && GetString(GetCategory(*it).Name).substr(0, prefix.size()) == prefix; ++it)
+                {
+                    IN_COMMAND_COUNT(Probes, 1);
+                    if (matchCount++ == 0)
+                        categoryIndex = *it;
+                }
+                return matchCount;
+            }
+
+            bool IsInDomain(const Option &option, std::string_view value) const
+            {
+                size_t first = 0;
+                size_t count = option.Domain.Count / 2;
+                while (count > 0)
+                {
+                    size_t step = count / 2;
+                    IN_COMMAND_COUNT(Probes, 1);
+                    if (GetDomainValue(option, first + step) < value)
+                    {
+                        first += step + 1;
+                        count -= step + 1;
+                    }
+                    else
+                        count = step;
+                }
+                return first < option.Domain.Count / 2 && GetDomainValue(option, first) == value;
+            }
+        };
+
+        static uint64_t OptionKeyHash(std::string_view key)
+        {
+            uint64_t hash = 14695981039346656037ull; // FNV-1a
+            for (char c : key)
+                hash = (hash ^ uint8_t(c)) * 1099511628211ull;
+            return hash;
+        }
+
+        static size_t OptionBucket(uint64_t hash, size_t bucketCount)
+        {
+            return size_t((hash >> 32) % bucketCount);
+        }
+
+        static size_t OptionSlot(uint64_t hash, uint32_t seed, size_t slotCount)
+        {
+            hash ^= (uint64_t(seed) + 1) * 0x9e3779b97f4a7c15ull;
+            hash = (hash ^ (hash >> 29)) * 0xbf58476d1ce4e5b9ull;
+            return size_t((hash ^ (hash >> 32)) % slotCount);
+        }
+
+        struct CategoryDesc
+        {
+            CategoryDesc(CategoryHandle parent, PooledString name, PooledString description) :
+                Parent(parent),
+                Name(name),
+                Description(description)
+            {
+            }
+            
+            CategoryHandle Parent;
+            PooledString Name;
+            PooledString Description;
+            std::vector<CategoryHandle> SubCategories; // In declaration order
+            std::vector<IndexType> OptionIds;          // Switches and variables in declaration order
+            std::vector<IndexType> ParameterIds;
+            std::optional<IndexType> RestParameterId;
+            CategoryPopulator Populator; // Declares the category's contents on first use
+        };
+
+        // Sizes of the index and offset spaces taken by the base of a layered reader
+        size_t GetBaseCategoryCount() const { return m_BaseSchema ? m_BaseSchema->GetCategoryCount() : 0; }
+        size_t GetBaseOptionCount() const { return m_BaseSchema ? m_BaseSchema->GetOptionCount() : 0; }
+        size_t GetBaseStringsSize() const { return m_BaseSchema ? m_BaseSchema->GetStringsSize() : 0; }
+
+        size_t GetCategoryCount() const { return GetBaseCategoryCount() + m_CategoryDescs.size(); }
+        size_t GetOptionCount() const { return GetBaseOptionCount() + m_OptionsDescs.size(); }
+
+        // Returns the declarations of a category, creating the delta of a base category on first use
+        CategoryDesc &GetCategoryDesc(size_t categoryIndex);
+
+        // Returns the declarations of a category, or nullptr for a base category without a delta
+        const CategoryDesc *FindCategoryDesc(size_t categoryIndex) const
+        {
+            size_t baseCount = GetBaseCategoryCount();
+            if (categoryIndex >= baseCount)
+                return &m_CategoryDescs[categoryIndex - baseCount];
+            auto it = m_BaseCategoryDeltas.find(categoryIndex);
+            return it == m_BaseCategoryDeltas.end() ? nullptr : &it->second;
+        }
+
+        // Base options are immutable; only options declared by this reader have an OptionDesc
+        OptionDesc &GetOptionDesc(size_t optionIndex) { return m_OptionsDescs[optionIndex - GetBaseOptionCount()]; }
+        const OptionDesc &GetOptionDesc(size_t optionIndex) const { return m_OptionsDescs[optionIndex - GetBaseOptionCount()]; }
+
+        struct ArgumentToken
+        {
+            std::string_view Value;
+            TokenFormat Format;
+            int ArgIndex;             // Index of the argv element the token was read from
+            const CMappedFile *File;  // Response file containing the token, nullptr for argv
+            size_t FileOffset;
+            const char *const *ArgvElement; // argv element holding the token, nullptr for response files
+            const char *RawBegin;     // Buffer text of the token including any quotes
+            const char *RawEnd;
+            size_t Frame;             // 0 for argv, unique per response file expansion otherwise
+            size_t Ordinal;           // Position of the token in the stream
+        };
+
+        // Produces argument tokens from argv, expanding @file response files in place
+        class ArgumentStream
+        {
+            struct Frame
+            {
+                std::shared_ptr<CMappedFile> File;
+                const char *Cursor;
+                size_t Id;
+            };
+
+            int m_Argc = 0;
+            const char **m_Argv = nullptr;
+            const char *m_Cursor = nullptr; // NUL-separated buffer, used when m_Argv is nullptr
+            const char *m_BufferEnd = nullptr;
+            int m_NextArg = 1; // Assume the first argument is the app name
+            int m_ArgIndex = 0;
+            size_t m_ResponseFileMaxDepth;
+            std::vector<Frame> m_Frames;
+            std::vector<std::shared_ptr<const CMappedFile>> &m_RetainedFiles;
+            size_t m_FrameCount = 0;
+            size_t m_Ordinal = 0;
+            std::string_view m_Separator;
+            bool m_AtSeparator = false;
+            Status m_Status = Status::Success;
+
+        public:
+            ArgumentStream(int argc, const char *argv[], size_t responseFileMaxDepth, std::vector<std::shared_ptr<const CMappedFile>> &retainedFiles) :
+                m_Argc(argc),
+                m_Argv(argv),
+                m_ResponseFileMaxDepth(responseFileMaxDepth),
+                m_RetainedFiles(retainedFiles)
+            {
+            }
+
+            ArgumentStream(std::string_view nulSeparated, size_t responseFileMaxDepth, std::vector<std::shared_ptr<const CMappedFile>> &retainedFiles) :
+                m_Cursor(nulSeparated.data()),
+                m_BufferEnd(nulSeparated.data() + nulSeparated.size()),
+                m_ResponseFileMaxDepth(responseFileMaxDepth),
+                m_RetainedFiles(retainedFiles)
+            {
+                // Skip the app name
+                const char *rawBegin;
+                std::string_view appName;
+                ScanNulSeparatedToken(m_Cursor, m_BufferEnd, rawBegin, appName);
+            }
+
+            // Returns false at the end of the arguments or on error. On error GetStatus()
+            // returns the failure and token describes the offending argument.
+            bool Next(ArgumentToken &token);
+            Status GetStatus() const { return m_Status; }
+
+            // Makes Next stop at each occurrence of separator as if the arguments ended there
+            void SetSeparator(std::string_view separator) { m_Separator = separator; }
+
+            // Continues past a separator. Returns false if the stream did not stop at one.
+            bool ResumeAfterSeparator()
+            {
+                bool atSeparator = m_AtSeparator;
+                m_AtSeparator = false;
+                return atSeparator;
+            }
+        };
+
+        static Status SetReadError(ReadErrorDesc &error, Status status, const ArgumentToken &token, size_t contextIndex);
+        Status ReadArguments(ArgumentStream &stream, CCommandExpression &commandExpression, ReadErrorDesc &error) const;
+
+        // Command expression state machine. Reports each argument to handler, which receives the
+        // token it was read from:
+        //   void OnCategory(CategoryHandle category);
+        //   void OnSwitch(SwitchHandle option);
+        //   void OnVariable(VariableHandle option, const ArgumentToken &value);
+        //   void OnParameter(ParameterHandle parameter, const ArgumentToken &value, bool isRest);
+        //   Status OnError(Status status, const ArgumentToken &token, size_t contextIndex);
+        template<typename Handler>
+        Status MatchTokens(ArgumentStream &stream, Handler &handler) const;
+
+        // Runs MatchTokens, tracing it, timing it and reporting to the parse observer in
+        // instrumented builds
+        template<typename Handler>
+        Status ReadTokens(ArgumentStream &stream, Handler &handler) const
+        {
+            IN_COMMAND_TRACE_SPAN("Read");
+#if defined(IN_COMMAND_INSTRUMENTATION)
+            ParseCounters before = CParseInstrumentation::LocalSnapshot();
+            uint64_t start = CParseInstrumentation::Now();
+            Status status = MatchTokens(stream, handler);
+            uint64_t elapsed = CParseInstrumentation::Now() - start;
+
+            // Leave out the nested phases, which counted their own time
+            ParseCounters nested = CParseInstrumentation::LocalSnapshot() - before;
+            IN_COMMAND_COUNT(Parses, 1);
+            IN_COMMAND_COUNT(ReadNanoseconds, elapsed - std::min(elapsed, nested.FreezeNanoseconds + nested.PopulateNanoseconds));
+            if (m_ParseObserver)
+                m_ParseObserver(CParseInstrumentation::LocalSnapshot() - before, status);
+            return status;
+#else
+            return MatchTokens(stream, handler);
+#endif
+        }
+
+        struct ExpressionBuilder;
+        struct ValidationHandler;
+
+        // Adapts a public visitor to the ReadTokens handler interface
+        template<typename Visitor>
+        struct VisitorAdapter
+        {
+            const CCommandReader &m_Reader;
+            Visitor &m_Visitor;
+
+            void OnCategory(CategoryHandle category)
+            {
+                CountUsage(m_Reader.m_CategoryUsage, category.m_Value);
+                m_Visitor.OnCategory(category);
+            }
+
+            void OnSwitch(SwitchHandle option)
+            {
+                CountUsage(m_Reader.m_OptionUsage, option.m_Value);
+                m_Visitor.OnSwitch(option);
+            }
+
+            void OnVariable(VariableHandle option, const ArgumentToken &value)
+            {
+                CountUsage(m_Reader.m_OptionUsage, option.m_Value);
+                m_Visitor.OnVariable(option, value.Value);
+            }
+
+            void OnParameter(ParameterHandle parameter, const ArgumentToken &value, bool)
+            {
+                CountUsage(m_Reader.m_OptionUsage, parameter.m_Value);
+                m_Visitor.OnParameter(parameter, value.Value);
+            }
+
+            Status OnError(Status status, const ArgumentToken &token, size_t contextIndex)
+            {
+                ReadErrorDesc error;
+                SetReadError(error, status, token, contextIndex);
+                m_Visitor.OnError(error);
+                return status;
+            }
+        };
+
+        size_t AddVariableOrSwitchOption(
+            ArgumentType type,
+            CategoryHandle category,
+            const std::string &name,
+            char shortName,
+            const std::vector<std::string> &domain,
+            const std::string &description);
+        void SetOptionInherited(ArgumentType type, size_t optionIndex, bool inherited);
+
+        // Collects the switches and variables visible in a category, its own options first followed
+        // by inherited options from the nearest ancestor outwards, skipping shadowed names
+        void CollectOptions(size_t categoryIndex, std::map<std::string_view, IndexType> &byName, std::map<char, IndexType> &byShortName) const;
+        static void BuildOptionTable(const std::map<std::string_view, IndexType> &byName, const std::map<char, IndexType> &byShortName, std::vector<uint32_t> &seeds, std::vector<uint32_t> &slots);
+        std::shared_ptr<const SchemaImage> CompileSchema() const;
+
+        // Runs a deferred category's populator. Like Freeze, this is part of reading and so callable
+        // on a const reader, although it adds declarations.
+        void PopulateCategory(CategoryHandle category) const;
+
+        // Returns the index of a handle, rejecting handles issued by another reader
+        template<ArgumentType Type>
+        size_t HandleIndex(const Handle<Type> &handle) const // throw Exception
+        {
+            if (!IsSameGeneration(handle.m_Generation, m_Generation))
+                throw Exception(Status::InvalidHandle);
+            return handle.m_Value;
+        }
+
+        // Throws Exception(Status::OutOfRange) if a new category or option would not fit IndexType
+        static IndexType CheckedIndex(size_t index)
+        {
+            if (index >= std::numeric_limits<IndexType>::max())
+                throw Exception(Status::OutOfRange);
+            return IndexType(index);
+        }
+
+        static uint32_t NextGeneration();
+
+        // Attached readers hold no declarations of their own, only the attached schema, so any
+        // declaration against them fails with an invalid handle
+        bool IsAttached() const { return m_CategoryDescs.empty() && !m_BaseSchema; }
+
+        // Returns the compiled schema, compiling it first if there were declarations since
+        const SchemaImage &EnsureFrozen() const
+        {
+            if (!m_Frozen.load(std::memory_order_acquire))
+                Freeze();
+            return *m_Schema;
+        }
+
+        void AppendSuggestions(const ReadErrorDesc &error, std::string &errorString) const;
+
+        // Response files are expanded from NUL-separated buffers only when the caller asks
+        size_t NulSeparatedResponseFileDepth(bool expandResponseFiles) const
+        {
+            return expandResponseFiles ? m_ResponseFileMaxDepth : 0;
+        }
+
+        static void CountUsage(const std::unique_ptr<CUsageCounters> &counters, size_t index)
+        {
+            if (counters)
+                counters->Increment(index);
+        }
+
+        // Takes over other's state for the move constructor and move assignment
+        void MoveFrom(CCommandReader &other);
+
+        // Makes room in the usage counters for handles declared since they were allocated
+        void GrowUsageCounters() const;
+
+        // Hashes and compares pooled strings by content, for interning
+        struct PooledStringHasher
+        {
+            const CCommandReader *Reader;
+            size_t operator()(PooledString s) const { return std::hash<std::string_view>()(Reader->GetString(s)); }
+        };
+
+        struct PooledStringEqual
+        {
+            const CCommandReader *Reader;
+            bool operator()(PooledString a, PooledString b) const { return Reader->GetString(a) == Reader->GetString(b); }
+        };
+
+        PooledString Intern(std::string_view value);
+
+        // Lean builds (IN_COMMAND_NO_DESCRIPTIONS) keep no descriptions at all
+        PooledString InternDescription(const std::string &description)
+        {
+#if defined(IN_COMMAND_NO_DESCRIPTIONS)
+            (void)description;
+            return PooledString();
+#else
+            return Intern(description);
+#endif
+        }
+
+        // Resolves a declared description through the description catalog, if any
+        std::string_view GetDescription(std::string_view description) const;
+
+        // Strings below the base size are the base's; this reader's pool continues after them
+        std::string_view GetString(PooledString s) const
+        {
+            size_t baseSize = GetBaseStringsSize();
+            if (s.Offset < baseSize)
+                return m_BaseSchema->GetString(s);
+            return std::string_view(m_StringPool.data() + (s.Offset - baseSize), s.Length);
+        }
+
+    private:
+        std::string m_StringPool; // Append-only
+        using InternedStringSet = std::unordered_set<PooledString, PooledStringHasher, PooledStringEqual>;
+        InternedStringSet m_InternedStrings{ 0, PooledStringHasher{ this }, PooledStringEqual{ this } };
+        std::unordered_set<uint64_t> m_DeclaredOptionNames; // Category index and interned name offset
+        std::shared_ptr<const SchemaImage> m_BaseSchema;   // Schema of the reader this one was copied from
+        std::map<IndexType, CategoryDesc> m_BaseCategoryDeltas; // Declarations added to base categories
+        std::vector<CategoryDesc> m_CategoryDescs;           // Categories declared by this reader
+        std::vector<OptionDesc> m_OptionsDescs;              // Options declared by this reader
+        ReadErrorDesc m_LastReadError;
+        size_t m_ResponseFileMaxDepth = 0;
+        bool m_PrefixMatching = false;
+        uint64_t m_SchemaFingerprint = 14695981039346656037ull; // FNV-1a offset basis
+        uint32_t m_Generation = 0; // Assigned by CReloadableReader::CreateVersion
+        mutable std::mutex m_FreezeMutex;
+        mutable std::atomic<bool> m_Frozen{ false };
+        mutable std::shared_ptr<const SchemaImage> m_Schema; // Built by Freeze, or attached
+        std::vector<ParameterSink> m_ParameterSinks;         // By parameter index
+        ParseObserver m_ParseObserver;
+        mutable std::unique_ptr<CUsageCounters> m_CategoryUsage; // Allocated by EnableUsageCounters, grown by Freeze
+        mutable std::unique_ptr<CUsageCounters> m_OptionUsage;
+
+        // Description catalog, mapped and indexed on first use
+        struct DescriptionCatalog
+        {
+            std::string Path;
+            bool Loaded = false;
+            std::shared_ptr<CMappedFile> File;
+            std::vector<std::pair<std::string_view, std::string_view>> Entries; // Ordered by key
+        };
+        mutable std::mutex m_CatalogMutex;
+        mutable DescriptionCatalog m_Catalog;
+
+        // Folds a declaration into the schema fingerprint. Every declaration passes through here, so
+        // this also invalidates the lookup tables built by Freeze.
+        void MixSchemaFingerprint(ArgumentType type, size_t owner, std::string_view name, char shortName = '-')
+        {
+            m_Frozen.store(false, std::memory_order_relaxed);
+            auto mix = [this](const void *data, size_t size)
+            {
+                const unsigned char *bytes = static_cast<const unsigned char *>(data);
+                for (size_t i = 0; i < size; ++i)
+                    m_SchemaFingerprint = (m_SchemaFingerprint ^ bytes[i]) * 1099511628211ull;
+            };
+            uint64_t fields[3] = { uint64_t(type), uint64_t(owner), uint64_t(uint8_t(shortName)) };
+            uint64_t nameSize = name.size();
+            mix(fields, sizeof(fields));
+            mix(&nameSize, sizeof(nameSize));
+            mix(name.data(), name.size());
+        }
+
+        // Runs pending populators, including those declared by other populators. Part of reading,
+        // like PopulateCategory.
+        void PopulatePending() const;
+
+    public:
+        CCommandReader(const std::string appName)
+        {
+            m_CategoryDescs.emplace_back(NullCategory, Intern(appName), PooledString());
+        }
+
+        // Copies a reader cheaply. The copy shares the source's compiled schema as an immutable
+        // base and stores only what is declared on it afterwards, so many specialized variants of
+        // one schema take little memory between them. Handles of the source stay valid in the
+        // copy; declarations made on the source after copying are not seen by it. The source's
+        // pending populators run first. Options of the source cannot be made inherited in the copy.
+        CCommandReader(const CCommandReader &base);
+
+        CCommandReader &operator=(const CCommandReader &) = delete;
+
+        // Moves the declarations, compiled schema and settings without cloning; handles issued by
+        // other stay valid. other must not be read from during the move, and afterwards may only be
+        // destroyed or assigned to.
+        CCommandReader(CCommandReader &&other) noexcept;
+        CCommandReader &operator=(CCommandReader &&other) noexcept;
+
+        CategoryHandle DeclareCategory(CategoryHandle parent, const std::string &name, const std::string &description = std::string())
+        {
+            IN_COMMAND_TRACE_SPAN("DeclareCategory");
+            size_t parentIndex = HandleIndex(parent);
+            if (parentIndex >= GetCategoryCount())
+                throw Exception(Status::InvalidHandle);
+
+            CategoryHandle category = CategoryHandle(CheckedIndex(GetCategoryCount()), m_Generation);
+            m_CategoryDescs.emplace_back(parent, Intern(name), InternDescription(description));
+            GetCategoryDesc(parentIndex).SubCategories.push_back(category);
+            MixSchemaFingerprint(ArgumentType::Category, parentIndex, name);
+            return category;
+        }
+
+        CategoryHandle DeclareCategory(const std::string &name, const std::string &description = std::string())
+        {
+            return DeclareCategory(RootCategory, name, description);
+        }
+
+        // Declares a category whose options and sub-categories are declared on demand. populator is
+        // called once, the first time a read or usage string enters the category, and may itself
+        // declare deferred sub-categories. Handles declared by populators depend on the order
+        // categories are first entered. Readers with pending populators must not be read from
+        // several threads at once; call PopulateAll first to share them.
+        CategoryHandle DeclareCategory(CategoryHandle parent, const std::string &name, CategoryPopulator populator, const std::string &description = std::string())
+        {
+            CategoryHandle category = DeclareCategory(parent, name, description);
+            GetCategoryDesc(category.m_Value).Populator = std::move(populator);
+            return category;
+        }
+
+        CategoryHandle DeclareCategory(const std::string &name, CategoryPopulator populator, const std::string &description = std::string())
+        {
+            return DeclareCategory(RootCategory, name, std::move(populator), description);
+        }
+
+        // Runs all pending populators, including those declared by other populators
+        void PopulateAll() { PopulatePending(); }
+
+        ParameterHandle DeclareParameter(CategoryHandle category, const std::string &name, const std::string &description = std::string())
+        {
+            IN_COMMAND_TRACE_SPAN("DeclareParameter");
+            size_t categoryIndex = HandleIndex(category);
+            if (categoryIndex >= GetCategoryCount())
+                throw Exception(Status::OutOfRange);
+            IndexType index = CheckedIndex(GetOptionCount());
+            m_OptionsDescs.emplace_back(ArgumentType::Parameter, Intern(name), InternDescription(description));
+            GetCategoryDesc(categoryIndex).ParameterIds.push_back(index);
+            MixSchemaFingerprint(ArgumentType::Parameter, categoryIndex, name);
+            return ParameterHandle(index, m_Generation);
+        }
+
+        ParameterHandle DeclareParameter(const std::string &name, const std::string &description = std::string())
+        {
+            return DeclareParameter(RootCategory, name, description);
+        }
+
+        // Declares a parameter that receives every parameter argument following the category's
+        // fixed parameters. Values are read with CCommandExpression::GetRestParameterValues.
+        ParameterHandle DeclareRestParameter(CategoryHandle category, const std::string &name, const std::string &description = std::string())
+        {
+            IN_COMMAND_TRACE_SPAN("DeclareRestParameter");
+            size_t categoryIndex = HandleIndex(category);
+            if (categoryIndex >= GetCategoryCount())
+                throw Exception(Status::OutOfRange);
+            const CategoryDesc *categoryDesc = FindCategoryDesc(categoryIndex);
+            if ((categoryDesc && categoryDesc->RestParameterId) ||
+                (categoryIndex < GetBaseCategoryCount() && m_BaseSchema->GetCategory(categoryIndex).RestParameterId != SchemaImage::NoIndex))
+                throw Exception(Status::DuplicateOption);
+            IndexType index = CheckedIndex(GetOptionCount());
+            m_OptionsDescs.emplace_back(ArgumentType::Parameter, Intern(name), InternDescription(description));
+            GetCategoryDesc(categoryIndex).RestParameterId = index;
+            MixSchemaFingerprint(ArgumentType::Parameter, categoryIndex, name, '*');
+            return ParameterHandle(index, m_Generation);
+        }
+
+        ParameterHandle DeclareRestParameter(const std::string &name, const std::string &description = std::string())
+        {
+            return DeclareRestParameter(RootCategory, name, description);
+        }
+
+        // Routes the values of a parameter to sink as they are read instead of storing them in the
+        // CCommandExpression. Pass an empty sink to restore the default behavior. Values are
+        // delivered while the arguments are still being read, so a read that fails on a later
+        // argument (UnknownOption, InvalidValue and so on) has already delivered the values before
+        // it. The sink is not told of the failure; check the read's status before acting on what
+        // it received.
+        void SetParameterSink(ParameterHandle parameter, ParameterSink sink)
+        {
+            size_t index = HandleIndex(parameter);
+            const SchemaImage *schema = IsAttached() ? m_Schema.get() : m_BaseSchema.get();
+            bool isParameter = schema && index < schema->GetOptionCount() ?
+                ArgumentType(schema->GetOption(index).Type) == ArgumentType::Parameter :
+                index < GetOptionCount() && GetOptionDesc(index).Type == ArgumentType::Parameter;
+            if (!isParameter)
+                throw Exception(Status::InvalidHandle);
+
+            if (index >= m_ParameterSinks.size())
+                m_ParameterSinks.resize(index + 1);
+            m_ParameterSinks[index] = std::move(sink);
+        }
+
+        // Calls observer after every read, visit or validation with the counters for that read.
+        // Only instrumented builds (IN_COMMAND_INSTRUMENTATION) call it. Pass an empty observer
+        // to stop.
+        void SetParseObserver(ParseObserver observer) { m_ParseObserver = std::move(observer); }
+
+        // Counts how often each category and option is read from now on. Reads and visits count
+        // each category entered and each option and parameter argument, so a rest parameter counts
+        // once per value. Arguments of reads that fail further on are counted; Validate counts
+        // nothing. Call before sharing the reader between
+        // threads; the counters themselves are safe to update and read concurrently. Copies of
+        // the reader do not count unless this is called on them too.
+        void EnableUsageCounters();
+
+        bool IsCountingUsage() const { return m_CategoryUsage != nullptr; }
+
+        // Returns 0 if usage counting is not enabled
+        template<ArgumentType Type>
+        uint64_t GetUsageCount(const Handle<Type> &handle) const // throw Exception
+        {
+            size_t index = HandleIndex(handle);
+            const std::unique_ptr<CUsageCounters> &counters = Type == ArgumentType::Category ? m_CategoryUsage : m_OptionUsage;
+            return counters && index < counters->GetSize() ? counters->Get(index) : 0;
+        }
+
+        void ResetUsageCounters();
+
+        // Returns the count of every category and option, including those never used, in
+        // declaration order with categories first
+        std::vector<UsageCount> GetUsageCounts() const;
+
+        // Writes GetUsageCounts as lines of count and path
+        void WriteUsageCounts(std::ostream &out) const;
+
+        VariableHandle DeclareVariable(CategoryHandle category, const std::string &name, const std::string &description = std::string())
+        {
+            return VariableHandle(AddVariableOrSwitchOption(ArgumentType::Variable, category, name, '-', {}, description), m_Generation);
+        }
+
+        VariableHandle DeclareVariable(CategoryHandle category, const std::string &name, const std::vector<std::string> &domain, const std::string &description = std::string())
+        {
+            return VariableHandle(AddVariableOrSwitchOption(ArgumentType::Variable, category, name, '-', domain, description), m_Generation);
+        }
+
+        VariableHandle DeclareVariable(const std::string &name, const std::vector<std::string> &domain, const std::string &description = std::string())
         {
             return DeclareVariable(RootCategory, name, domain, description);
         }
 
         VariableHandle DeclareVariable(CategoryHandle category, const std::string &name, char shortName, const std::string &description = std::string())
         {
-            return VariableHandle(AddVariableOrSwitchOption(ArgumentType::Variable, category, name, shortName, {}, description));
+            return VariableHandle(AddVariableOrSwitchOption(ArgumentType::Variable, category, name, shortName, {}, description), m_Generation);
         }
 
         VariableHandle DeclareVariable(const std::string &name, char shortName, const std::string &description = std::string())
@@ -303,7 +1961,7 @@ namespace InCommand
 
         VariableHandle DeclareVariable(CategoryHandle category, const std::string &name, char shortName, const std::vector<std::string> &domain, const std::string &description = std::string())
         {
-            return VariableHandle(AddVariableOrSwitchOption(ArgumentType::Variable, category, name, shortName, domain, description));
+            return VariableHandle(AddVariableOrSwitchOption(ArgumentType::Variable, category, name, shortName, domain, description), m_Generation);
         }
         
         VariableHandle DeclareVariable(const std::string &name, char shortName, const std::vector<std::string> &domain, const std::string &description = std::string())
@@ -313,7 +1971,7 @@ namespace InCommand
 
         SwitchHandle DeclareSwitch(CategoryHandle category, const std::string &name, const std::string &description = std::string())
         {
-            return SwitchHandle(AddVariableOrSwitchOption(ArgumentType::Switch, category, name, '-', {}, description));
+            return SwitchHandle(AddVariableOrSwitchOption(ArgumentType::Switch, category, name, '-', {}, description), m_Generation);
         }
 
         SwitchHandle DeclareSwitch(const std::string &name, const std::string &description = std::string())
@@ -323,7 +1981,7 @@ namespace InCommand
 
         SwitchHandle DeclareSwitch(CategoryHandle category, const std::string &name, char shortName, const std::string &description = std::string())
         {
-            return SwitchHandle(AddVariableOrSwitchOption(ArgumentType::Switch, category, name, shortName, {}, description));
+            return SwitchHandle(AddVariableOrSwitchOption(ArgumentType::Switch, category, name, shortName, {}, description), m_Generation);
         }
         
         SwitchHandle DeclareSwitch(const std::string &name, char shortName, const std::string &description = std::string())
@@ -331,18 +1989,497 @@ namespace InCommand
             return DeclareSwitch(RootCategory, name, shortName, description);
         }
 
+        // Makes a switch or variable visible in every descendant of the category it was declared
+        // in, as if declared there too. An option declared with the same name or short name in a
+        // descendant takes precedence.
+        void SetOptionInherited(SwitchHandle option, bool inherited = true)
+        {
+            SetOptionInherited(ArgumentType::Switch, HandleIndex(option), inherited);
+        }
+
+        void SetOptionInherited(VariableHandle option, bool inherited = true)
+        {
+            SetOptionInherited(ArgumentType::Variable, HandleIndex(option), inherited);
+        }
+
+        // Builds the per-category option lookup tables. Reading freezes the reader automatically
+        // after any declaration; calling Freeze up front moves that cost out of the first read.
+        // Thread-safe with respect to concurrent reads.
+        void Freeze() const;
+
+        // Enables expansion of @file arguments into the whitespace-separated tokens of the named
+        // response file. Response files may reference other response files up to maxDepth levels
+        // deep. A maxDepth of 0 disables expansion (the default), leaving @file as a literal argument.
+        void SetResponseFileMaxDepth(size_t maxDepth)
+        {
+            m_ResponseFileMaxDepth = maxDepth;
+        }
+
+        size_t GetResponseFileMaxDepth() const { return m_ResponseFileMaxDepth; }
+
+        // Treats declared descriptions as keys into a catalog file of "key=text" lines, such as a
+        // per-language help text file. The file is only mapped when a description is first needed
+        // for help output. Descriptions without a catalog entry are shown as declared. Pass an
+        // empty path to show declared descriptions directly again.
+        void SetDescriptionCatalog(const std::string &path);
+
+        // Accepts any unambiguous prefix of a long option name or sub-category name, so "--verb"
+        // reads as "--verbose". Exact names always win. A prefix matching several names fails with
+        // Status::AmbiguousArgument, and GetLastReadError lists the candidates. Sub-category
+        // prefixes are only tried where the argument cannot be a parameter. Disabled by default.
+        void SetPrefixMatching(bool enable)
+        {
+            m_PrefixMatching = enable;
+        }
+
         Status ReadCommandExpression(int argc, const char *argv[], CCommandExpression &commandExpression);
+
+        // Reads a NUL-separated argument buffer in the /proc/<pid>/cmdline format in place. The first
+        // element is the app name. The buffer must outlive commandExpression. Such buffers usually
+        // come from other processes, so @file arguments are only expanded (up to
+        // GetResponseFileMaxDepth levels) when expandResponseFiles is set; otherwise they are
+        // literal arguments.
+        Status ReadCommandExpression(std::string_view nulSeparated, CCommandExpression &commandExpression, bool expandResponseFiles = false);
+
+        // Thread-safe variants that report errors through error rather than GetLastReadError.
+        // Any parameter sinks must also be safe to call concurrently.
+        Status ReadCommandExpression(int argc, const char *argv[], CCommandExpression &commandExpression, ReadErrorDesc &error) const;
+        Status ReadCommandExpression(std::string_view nulSeparated, CCommandExpression &commandExpression, ReadErrorDesc &error, bool expandResponseFiles = false) const;
+
+        // Reads several command expressions from one argument list in a single pass. Expressions are
+        // separated by arguments equal to separator (for example ";" or "--then"); each expression
+        // starts again at the root category. On an error, expressions holds the expressions read
+        // up to and including the failing one.
+        Status ReadCommandSequence(int argc, const char *argv[], std::string_view separator, std::vector<CCommandExpression> &expressions);
+        Status ReadCommandSequence(int argc, const char *argv[], std::string_view separator, std::vector<CCommandExpression> &expressions, ReadErrorDesc &error) const;
+
+        // Reads a command expression without building a CCommandExpression, reporting each argument
+        // to visitor as it is read. Visitor must provide:
+        //   void OnCategory(CategoryHandle category);   // Called for the root category first
+        //   void OnSwitch(SwitchHandle option);
+        //   void OnVariable(VariableHandle option, std::string_view value);
+        //   void OnParameter(ParameterHandle parameter, std::string_view value);
+        //   void OnError(const ReadErrorDesc &error);
+        // Values from response files are only valid for the duration of the callback. The calls are
+        // resolved at compile time, and nothing is allocated unless an error or response file is read.
+        template<typename Visitor>
+        Status VisitCommandExpression(int argc, const char *argv[], Visitor &visitor) const
+        {
+            std::vector<std::shared_ptr<const CMappedFile>> responseFiles;
+            ArgumentStream stream(argc, argv, m_ResponseFileMaxDepth, responseFiles);
+            VisitorAdapter<Visitor> adapter{ *this, visitor };
+            return ReadTokens(stream, adapter);
+        }
+
+        template<typename Visitor>
+        Status VisitCommandExpression(std::string_view nulSeparated, Visitor &visitor, bool expandResponseFiles = false) const
+        {
+            std::vector<std::shared_ptr<const CMappedFile>> responseFiles;
+            ArgumentStream stream(nulSeparated, NulSeparatedResponseFileDepth(expandResponseFiles), responseFiles);
+            VisitorAdapter<Visitor> adapter{ *this, visitor };
+            return ReadTokens(stream, adapter);
+        }
+
+        // Checks a command expression against the declared schema without storing any values or
+        // invoking parameter sinks. Reports the first error and the index of the offending argument.
+        // Nothing is allocated unless a response file is read.
+        ValidationResult Validate(int argc, const char *argv[]) const;
+        ValidationResult Validate(std::string_view nulSeparated, bool expandResponseFiles = false) const;
+
+        // Reads many NUL-separated buffers concurrently on up to threadCount threads (0 uses the
+        // hardware concurrency). Pending populators run first, on the calling thread. expressions and errors are resized to match buffers, and
+        // errors[i].ErrorStatus holds the result for buffers[i]. Response files are treated as for
+        // a single NUL-separated buffer.
+        void ReadCommandExpressions(
+            const std::vector<std::string_view> &buffers,
+            std::vector<CCommandExpression> &expressions,
+            std::vector<ReadErrorDesc> &errors,
+            unsigned threadCount = 0,
+            bool expandResponseFiles = false) const;
+
         std::string SimpleUsageString(CategoryHandle category) const;
         std::string OptionDetailsString(CategoryHandle category) const;
-        Status SetLastReadError(Status status, int argIndex, const char *argv[], const void *contextPtr)
+        Status SetLastReadError(Status status, int argIndex, const char *argv[], size_t contextIndex)
         {
             m_LastReadError.ErrorStatus = status;
             m_LastReadError.ArgIndex = argIndex;
             m_LastReadError.ArgString = argv[argIndex];
-            m_LastReadError.ContextPtr = contextPtr;
+            m_LastReadError.ContextIndex = uint32_t(contextIndex);
+            m_LastReadError.FileName.clear();
+            m_LastReadError.FileOffset = 0;
             return status;
         }
 
+        // Identifies the declared schema. Readers built by the same sequence of declarations have the
+        // same fingerprint; descriptions do not contribute.
+        uint64_t GetSchemaFingerprint() const { return m_SchemaFingerprint; }
+
+        // Readers created by CReloadableReader::CreateVersion each have a schema generation of their
+        // own. Handles the reader issues and expressions it reads carry it, and are rejected by the
+        // expressions and methods of readers of other generations. Other readers have generation 0,
+        // which is compatible with every reader. Attached readers take the publisher's generation.
+        uint32_t GetGeneration() const { return m_Generation; }
+
+        // Encodes commandExpression as a compact binary blob tied to this schema's fingerprint. The
+        // blob is read with CSerializedExpression, typically in another process. The encoding uses
+        // the host byte order.
+        void SerializeExpression(const CCommandExpression &commandExpression, std::string &blob) const;
+
+        // Describes a read error. Unknown options, unexpected arguments and invalid values include
+        // the nearest declared names as suggestions.
         Status GetLastReadError(std::string &errorString) const;
+        Status FormatReadError(const ReadErrorDesc &error, std::string &errorString) const;
+
+#if !defined(_WIN32)
+        // Copies the compiled schema into the POSIX shared memory object name (see shm_open, for
+        // example "/mytool-schema"), replacing any existing object, after running any pending
+        // populators. The schema holds no pointers, so other processes map it as is with
+        // AttachSchema. Returns Status::SharedMemoryError if the object cannot be written.
+        Status PublishSchema(const std::string &name);
+
+        // Replaces this reader's schema with one published by PublishSchema, mapped read-only and
+        // shared with every other process attached to it. Reads, usage strings, error descriptions
+        // and parameter sinks work as on the publishing reader, with the same handles and
+        // fingerprint, but the reader no longer accepts declarations. Returns Status::NotFound if
+        // name does not exist and Status::InvalidFormat if it does not hold a complete schema,
+        // leaving the reader unchanged.
+        Status AttachSchema(const std::string &name);
+
+        // Removes the shared memory object name. Attached readers keep their mapping.
+        static Status UnpublishSchema(const std::string &name);
+#endif
+    };
+
+    //------------------------------------------------------------------------------------------------
+    // Least-recently-used cache of command expressions keyed on the argument bytes. A repeated
+    // command line returns the expression read the first time without reading it again. Parameter
+    // sinks only run when arguments are actually read, and argument lists naming response files
+    // are never cached since the file contents may change. Thread-safe.
+    class CExpressionCache
+    {
+        struct Entry
+        {
+            std::string Arguments; // NUL-separated copy of argv that Expression refers to
+            CCommandExpression Expression;
+        };
+        using EntryList = std::list<std::shared_ptr<Entry>>;
+
+        const CCommandReader &m_Reader;
+        size_t m_Capacity;
+        mutable std::mutex m_Mutex;
+        EntryList m_Entries; // Most recently used first
+        std::unordered_map<std::string_view, EntryList::iterator> m_EntryMap;
+
+    public:
+        // Runs the reader's pending category populators and compiles its schema up front, since
+        // misses on different threads read through the reader concurrently
+        CExpressionCache(const CCommandReader &reader, size_t capacity) :
+            m_Reader(reader),
+            m_Capacity(capacity)
+        {
+            m_Reader.PopulatePending();
+            m_Reader.EnsureFrozen();
+        }
+
+        CExpressionCache(const CExpressionCache &) = delete;
+        CExpressionCache &operator=(const CExpressionCache &) = delete;
+
+        // Returns the expression for argv, reading it only if it is not cached. Returns nullptr if
+        // the arguments fail to read, with the error in error. The expression stays valid for as
+        // long as the returned pointer is held, even once evicted.
+        std::shared_ptr<const CCommandExpression> ReadCommandExpression(int argc, const char *argv[], ReadErrorDesc &error);
+
+        size_t GetSize() const
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            return m_Entries.size();
+        }
+
+        void Clear()
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_EntryMap.clear();
+            m_Entries.clear();
+        }
     };
+
+    //------------------------------------------------------------------------------------------------
+    // Serves reads from a schema that is replaced at runtime, for example when configuration
+    // changes. Each version of the schema is a separate reader, created with CreateVersion and
+    // declared off to the side (typically on a background thread), then made current with Publish.
+    // A read pins the version that is current when it starts and finishes against it without
+    // taking any lock; a replaced version is destroyed when the last read pinning it finishes.
+    // Every version has its own schema generation, so handles kept from an older version throw
+    // Exception(Status::InvalidHandle) when used with expressions read by a newer one.
+    class CReloadableReader
+    {
+        // Reads count themselves on a stripe chosen per thread, each on a cache line of its own,
+        // so concurrent reads do not contend. Threads beyond the stripe count share stripes.
+        static constexpr size_t StripeCount = 16; // A power of 2
+
+        struct alignas(64) PinStripe
+        {
+            std::atomic<intptr_t> Count{ 0 };
+        };
+
+        struct alignas(64) AcquireStripe
+        {
+            std::atomic<size_t> Count[2] = {}; // Acquires in progress, by the parity they read
+        };
+
+        // A replaced version's stripes are folded into one count. Stripes hold FoldedStripe from
+        // then on, and the bias keeps the count above zero until the fold completes.
+        static constexpr intptr_t FoldedStripe = INTPTR_MIN / 2;
+        static constexpr intptr_t FoldBias = INTPTR_MAX / 2;
+
+        struct Version
+        {
+            std::unique_ptr<const CCommandReader> Reader;
+            PinStripe Pins[StripeCount];
+            std::atomic<intptr_t> Folded{ FoldBias };
+        };
+
+        std::atomic<Version *> m_Current;
+        mutable AcquireStripe m_Acquiring[StripeCount]; // Acquires between loading m_Current and pinning it
+        std::atomic<size_t> m_Parity{ 0 };
+        std::mutex m_PublishMutex;
+
+        static inline std::atomic<size_t> s_NextStripe{ 0 };
+
+        static size_t ThreadStripe()
+        {
+            static thread_local size_t stripe = s_NextStripe.fetch_add(1, std::memory_order_relaxed) & (StripeCount - 1);
+            return stripe;
+        }
+
+        // Until the version is replaced a pin is released on its stripe. Afterwards the release
+        // goes to the folded count, and whichever of the releases and the fold brings that to
+        // zero destroys the version.
+        static void Unpin(Version *version, size_t stripe)
+        {
+            if (version->Pins[stripe].Count.fetch_sub(1, std::memory_order_acq_rel) <= 0 &&
+                version->Folded.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                delete version;
+        }
+
+        static void Retire(Version *version);
+
+        // Waits for the acquires in progress that read parity to pin their version
+        void WaitForAcquires(size_t parity) const;
+
+    public:
+        // Keeps one version of the schema alive for as long as it is held
+        class CPinnedReader
+        {
+            friend class CReloadableReader;
+            Version *m_Version;
+            size_t m_Stripe; // Pinned on, so released on the same stripe from any thread
+
+            CPinnedReader(Version *version, size_t stripe) :
+                m_Version(version),
+                m_Stripe(stripe)
+            {
+            }
+
+        public:
+            CPinnedReader(CPinnedReader &&o) noexcept :
+                m_Version(std::exchange(o.m_Version, nullptr)),
+                m_Stripe(o.m_Stripe)
+            {
+            }
+
+            CPinnedReader &operator=(CPinnedReader &&o) noexcept
+            {
+                if (this != &o)
+                {
+                    if (m_Version)
+                        Unpin(m_Version, m_Stripe);
+                    m_Version = std::exchange(o.m_Version, nullptr);
+                    m_Stripe = o.m_Stripe;
+                }
+                return *this;
+            }
+
+            CPinnedReader(const CPinnedReader &) = delete;
+            CPinnedReader &operator=(const CPinnedReader &) = delete;
+
+            ~CPinnedReader()
+            {
+                if (m_Version)
+                    Unpin(m_Version, m_Stripe);
+            }
+
+            const CCommandReader &operator*() const { return *m_Version->Reader; }
+            const CCommandReader *operator->() const { return m_Version->Reader.get(); }
+        };
+
+        // reader is the first version, normally created by CreateVersion
+        explicit CReloadableReader(std::unique_ptr<CCommandReader> reader);
+        ~CReloadableReader();
+
+        CReloadableReader(const CReloadableReader &) = delete;
+        CReloadableReader &operator=(const CReloadableReader &) = delete;
+
+        // Creates an empty reader with a new schema generation, to be declared and published
+        static std::unique_ptr<CCommandReader> CreateVersion(const std::string &appName);
+
+        // Makes reader the current version, after running its pending populators and freezing it.
+        // Reads in progress finish against the version they started with. Waits only for reads
+        // that are part-way through pinning a version, not for pinned ones. Thread-safe.
+        void Publish(std::unique_ptr<CCommandReader> reader);
+
+        // Pins the current version. Lock-free, and touches only the calling thread's stripes.
+        CPinnedReader Acquire() const
+        {
+            // Publish waits for the acquires counted here before retiring a replaced version, so
+            // the version loaded here stays alive until it is pinned
+            size_t stripe = ThreadStripe();
+            std::atomic<size_t> &acquiring = m_Acquiring[stripe].Count[m_Parity.load(std::memory_order_relaxed)];
+            acquiring.fetch_add(1, std::memory_order_seq_cst);
+            Version *version = m_Current.load(std::memory_order_seq_cst);
+            version->Pins[stripe].Count.fetch_add(1, std::memory_order_relaxed);
+            acquiring.fetch_sub(1, std::memory_order_release);
+            return CPinnedReader(version, stripe);
+        }
+
+        // Read against the current version. Errors are described in errorString while the version
+        // is still pinned, since a ReadErrorDesc refers into the version it was read with.
+        Status ReadCommandExpression(int argc, const char *argv[], CCommandExpression &commandExpression, std::string &errorString) const;
+        Status ReadCommandExpression(std::string_view nulSeparated, CCommandExpression &commandExpression, std::string &errorString, bool expandResponseFiles = false) const;
+
+        uint32_t GetGeneration() const { return Acquire()->GetGeneration(); }
+    };
+
+    //------------------------------------------------------------------------------------------------
+    template<typename Handler>
+    Status CCommandReader::MatchTokens(ArgumentStream &stream, Handler &handler) const
+    {
+        const SchemaImage *schema = &EnsureFrozen();
+
+        bool ignoreSwitchesAndVariables = false;
+        size_t categoryIndex = 0;
+        size_t parameterCount = 0;
+        handler.OnCategory(CategoryHandle(0, m_Generation));
+        ArgumentToken token;
+        while (stream.Next(token))
+        {
+            std::string_view arg = token.Value;
+            const SchemaImage::Category &categoryDesc = schema->GetCategory(categoryIndex);
+
+            // Is this a variable or switch?
+            if (!ignoreSwitchesAndVariables && !arg.empty() && arg[0] == '-')
+            {
+                size_t optionIndex;
+
+                // Is this a short or long name
+                if (arg.size() > 1 && arg[1] == '-')
+                {
+                    // Long name
+                    std::string_view name(arg.substr(2));
+                    if (name.empty())
+                    {
+                        ignoreSwitchesAndVariables = true;
+                        continue;
+                    }
+
+                    IN_COMMAND_COUNT(OptionLookups, 1);
+                    optionIndex = schema->FindOption(categoryDesc, arg);
+                    if (optionIndex == SchemaImage::NoIndex)
+                    {
+                        size_t matchCount = m_PrefixMatching ? schema->FindOptionByPrefix(categoryDesc, name, optionIndex) : 0;
+                        if (matchCount == 0)
+                            return handler.OnError(Status::UnknownOption, token, categoryIndex);
+                        if (matchCount > 1)
+                            return handler.OnError(Status::AmbiguousArgument, token, categoryIndex);
+                    }
+                }
+                else
+                {
+                    // Short name
+                    if (arg.size() != 2)
+                        return handler.OnError(Status::UnexpectedArgument, token, categoryIndex);
+
+                    IN_COMMAND_COUNT(OptionLookups, 1);
+                    optionIndex = schema->FindOption(categoryDesc, arg);
+                    if (optionIndex == SchemaImage::NoIndex)
+                        return handler.OnError(Status::UnknownOption, token, categoryIndex);
+                }
+
+                const SchemaImage::Option &optionDesc = schema->GetOption(optionIndex);
+
+                if (ArgumentType(optionDesc.Type) == ArgumentType::Variable)
+                {
+                    // Read the value
+                    ArgumentToken optionToken = token;
+                    if (!stream.Next(token))
+                    {
+                        if (stream.GetStatus() != Status::Success)
+                            return handler.OnError(stream.GetStatus(), token, ReadErrorDesc::NoContext);
+                        return handler.OnError(Status::MissingVariableValue, optionToken, optionIndex);
+                    }
+
+                    std::string_view value = token.Value;
+
+                    if (!value.empty() && value[0] == '-')
+                        return handler.OnError(Status::MissingVariableValue, optionToken, optionIndex);
+
+                    if (optionDesc.Domain.Count > 0)
+                    {
+                        // Verify the value is in the declared domain
+                        IN_COMMAND_COUNT(DomainChecks, 1);
+                        if (!schema->IsInDomain(optionDesc, value))
+                            return handler.OnError(Status::InvalidValue, token, optionIndex);
+                    }
+
+                    handler.OnVariable(VariableHandle(optionIndex, m_Generation), token);
+                }
+                else
+                {
+                    handler.OnSwitch(SwitchHandle(optionIndex, m_Generation));
+                }
+            }
+            else
+            {
+                // Is this a sub-category?
+                SchemaImage::Span<uint32_t> parameterIds = schema->GetWords(categoryDesc.ParameterIds);
+                IN_COMMAND_COUNT(CategoryLookups, 1);
+                size_t subCategory = schema->FindSubCategory(categoryDesc, arg);
+                if (subCategory == SchemaImage::NoIndex && m_PrefixMatching && parameterCount == parameterIds.size() && categoryDesc.RestParameterId == SchemaImage::NoIndex)
+                {
+                    if (schema->FindSubCategoryByPrefix(categoryDesc, arg, subCategory) > 1)
+                        return handler.OnError(Status::AmbiguousArgument, token, categoryIndex);
+                }
+
+                if (subCategory != SchemaImage::NoIndex)
+                {
+                    if (schema->GetCategory(subCategory).Deferred)
+                    {
+                        // Populating compiles a new schema
+                        PopulateCategory(CategoryHandle(subCategory, m_Generation));
+                        schema = m_Schema.get();
+                    }
+                    handler.OnCategory(CategoryHandle(subCategory, m_Generation));
+                    categoryIndex = subCategory;
+                    parameterCount = 0;
+                }
+                else if (parameterCount == parameterIds.size())
+                {
+                    if (categoryDesc.RestParameterId == SchemaImage::NoIndex)
+                        return handler.OnError(Status::UnexpectedArgument, token, categoryIndex);
+
+                    handler.OnParameter(ParameterHandle(categoryDesc.RestParameterId, m_Generation), token, true);
+                }
+                else
+                {
+                    handler.OnParameter(ParameterHandle(parameterIds[parameterCount], m_Generation), token, false);
+                    parameterCount++;
+                }
+            }
+        }
+
+        if (stream.GetStatus() != Status::Success)
+            return handler.OnError(stream.GetStatus(), token, ReadErrorDesc::NoContext);
+
+        return Status::Success;
+    }
 }
\ No newline at end of file
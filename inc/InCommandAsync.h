@@ -0,0 +1,290 @@
+#pragma once
+
+// Coroutine-based command dispatch. Opt-in layer over InCommand.h requiring C++20; the core
+// library remains C++17.
+
+#if !defined(__cpp_impl_coroutine) && !(defined(_MSVC_LANG) && _MSVC_LANG >= 202002L)
+#error InCommandAsync.h requires C++20 coroutine support
+#endif
+
+#include <coroutine>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#include <optional>
+#include <deque>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <algorithm>
+
+#include "InCommand.h"
+
+namespace InCommand
+{
+    //------------------------------------------------------------------------------------------------
+    // Lazily started coroutine producing a value of type T. The coroutine begins running when the
+    // task is awaited and resumes the awaiting coroutine when it completes.
+    template<typename T>
+    class CTask
+    {
+    public:
+        struct promise_type
+        {
+            std::optional<T> m_Value;
+            std::exception_ptr m_Exception;
+            std::coroutine_handle<> m_Continuation;
+
+            CTask get_return_object()
+            {
+                return CTask(std::coroutine_handle<promise_type>::from_promise(*this));
+            }
+
+            std::suspend_always initial_suspend() noexcept { return {}; }
+
+            auto final_suspend() noexcept
+            {
+                struct FinalAwaiter
+                {
+                    bool await_ready() noexcept { return false; }
+                    std::coroutine_handle<> await_suspend(std::coroutine_handle<promise_type> h) noexcept
+                    {
+                        std::coroutine_handle<> continuation = h.promise().m_Continuation;
+                        return continuation ? continuation : std::noop_coroutine();
+                    }
+                    void await_resume() noexcept {}
+                };
+                return FinalAwaiter{};
+            }
+
+            void return_value(T value) { m_Value.emplace(std::move(value)); }
+            void unhandled_exception() { m_Exception = std::current_exception(); }
+        };
+
+    private:
+        std::coroutine_handle<promise_type> m_Handle;
+
+        explicit CTask(std::coroutine_handle<promise_type> handle) :
+            m_Handle(handle)
+        {
+        }
+
+    public:
+        CTask(CTask &&o) noexcept :
+            m_Handle(std::exchange(o.m_Handle, nullptr))
+        {
+        }
+
+        CTask &operator=(CTask &&o) noexcept
+        {
+            if (this != &o)
+            {
+                if (m_Handle)
+                    m_Handle.destroy();
+                m_Handle = std::exchange(o.m_Handle, nullptr);
+            }
+            return *this;
+        }
+
+        CTask(const CTask &) = delete;
+        CTask &operator=(const CTask &) = delete;
+
+        ~CTask()
+        {
+            if (m_Handle)
+                m_Handle.destroy();
+        }
+
+        bool await_ready() const noexcept { return false; }
+
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<> continuation) noexcept
+        {
+            m_Handle.promise().m_Continuation = continuation;
+            return m_Handle;
+        }
+
+        T await_resume()
+        {
+            if (m_Handle.promise().m_Exception)
+                std::rethrow_exception(m_Handle.promise().m_Exception);
+            return std::move(*m_Handle.promise().m_Value);
+        }
+    };
+
+    //------------------------------------------------------------------------------------------------
+    // Runs resumed coroutines. co_await executor.Schedule() moves the calling coroutine onto the
+    // executor.
+    class CExecutor
+    {
+    public:
+        virtual ~CExecutor() = default;
+        virtual void Post(std::coroutine_handle<> handle) = 0;
+
+        auto Schedule()
+        {
+            struct ScheduleAwaiter
+            {
+                CExecutor &m_Executor;
+                bool await_ready() const noexcept { return false; }
+                void await_suspend(std::coroutine_handle<> handle) { m_Executor.Post(handle); }
+                void await_resume() const noexcept {}
+            };
+            return ScheduleAwaiter{ *this };
+        }
+    };
+
+    //------------------------------------------------------------------------------------------------
+    // Executes coroutines on a fixed set of worker threads. The destructor finishes all queued work
+    // before joining the workers.
+    class CThreadPoolExecutor : public CExecutor
+    {
+        std::mutex m_Mutex;
+        std::condition_variable m_Condition;
+        std::deque<std::coroutine_handle<>> m_Queue;
+        std::vector<std::thread> m_Threads;
+        bool m_Stopping = false;
+
+        void WorkerMain()
+        {
+            for (;;)
+            {
+                std::coroutine_handle<> handle;
+                {
+                    std::unique_lock<std::mutex> lock(m_Mutex);
+                    m_Condition.wait(lock, [this]() { return m_Stopping || !m_Queue.empty(); });
+                    if (m_Queue.empty())
+                        return;
+                    handle = m_Queue.front();
+                    m_Queue.pop_front();
+                }
+                handle.resume();
+            }
+        }
+
+    public:
+        explicit CThreadPoolExecutor(unsigned threadCount)
+        {
+            for (unsigned i = 0; i < std::max(1u, threadCount); ++i)
+                m_Threads.emplace_back([this]() { WorkerMain(); });
+        }
+
+        ~CThreadPoolExecutor()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_Stopping = true;
+            }
+            m_Condition.notify_all();
+            for (auto &thread : m_Threads)
+                thread.join();
+        }
+
+        void Post(std::coroutine_handle<> handle) override
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                m_Queue.push_back(handle);
+            }
+            m_Condition.notify_one();
+        }
+    };
+
+    //------------------------------------------------------------------------------------------------
+    // Single-threaded executor that only runs work when asked. Makes coroutine scheduling
+    // deterministic for tests and for hosts that drive their own event loop.
+    class CManualExecutor : public CExecutor
+    {
+        std::mutex m_Mutex;
+        std::deque<std::coroutine_handle<>> m_Queue;
+
+    public:
+        void Post(std::coroutine_handle<> handle) override
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            m_Queue.push_back(handle);
+        }
+
+        // Resumes one queued coroutine. Returns false if the queue was empty.
+        bool RunOne()
+        {
+            std::coroutine_handle<> handle;
+            {
+                std::lock_guard<std::mutex> lock(m_Mutex);
+                if (m_Queue.empty())
+                    return false;
+                handle = m_Queue.front();
+                m_Queue.pop_front();
+            }
+            handle.resume();
+            return true;
+        }
+
+        // Runs until no work remains. Returns the number of coroutines resumed.
+        size_t RunUntilIdle()
+        {
+            size_t count = 0;
+            while (RunOne())
+                ++count;
+            return count;
+        }
+    };
+
+    //------------------------------------------------------------------------------------------------
+    using AsyncCommandHandler = std::function<CTask<int>(const CCommandExpression &)>;
+    using CAsyncCommandDispatcher = CCommandDispatcher<AsyncCommandHandler>;
+
+    //------------------------------------------------------------------------------------------------
+    // Runs parsed command expressions through an async dispatcher on an executor. Each Run call
+    // starts an independent command, so many commands can be in flight at once.
+    class CAsyncCommandRunner
+    {
+        // Eagerly started coroutine that destroys itself on completion
+        struct DetachedTask
+        {
+            struct promise_type
+            {
+                DetachedTask get_return_object() { return {}; }
+                std::suspend_never initial_suspend() noexcept { return {}; }
+                std::suspend_never final_suspend() noexcept { return {}; }
+                void return_void() {}
+                void unhandled_exception() { std::terminate(); }
+            };
+        };
+
+        const CAsyncCommandDispatcher &m_Dispatcher;
+        CExecutor &m_Executor;
+
+        static DetachedTask RunDetached(const CAsyncCommandDispatcher &dispatcher, CExecutor &executor, CCommandExpression expression, std::promise<int> promise)
+        {
+            co_await executor.Schedule();
+            try
+            {
+                promise.set_value(co_await dispatcher.Dispatch(expression));
+            }
+            catch (...)
+            {
+                promise.set_exception(std::current_exception());
+            }
+        }
+
+    public:
+        CAsyncCommandRunner(const CAsyncCommandDispatcher &dispatcher, CExecutor &executor) :
+            m_Dispatcher(dispatcher),
+            m_Executor(executor)
+        {
+        }
+
+        // Schedules the handler for expression's category. The returned future receives the
+        // handler's result, or the exception it threw (Exception(Status::NotFound) if the category
+        // has no handler).
+        std::future<int> Run(CCommandExpression expression)
+        {
+            std::promise<int> promise;
+            std::future<int> future = promise.get_future();
+            RunDetached(m_Dispatcher, m_Executor, std::move(expression), std::move(promise));
+            return future;
+        }
+    };
+}
@@ -0,0 +1,101 @@
+#pragma once
+
+// Local command server. Keeps a CCommandReader resident and serves command expressions sent by
+// clients over a Unix domain socket, so frequently invoked tools skip schema construction.
+// Available on POSIX platforms only.
+
+#include "InCommand.h"
+
+namespace InCommand
+{
+    //------------------------------------------------------------------------------------------------
+    // Server-side command handler. Text written to out is returned to the client.
+    using ServerCommandHandler = std::function<int(const CCommandExpression &, std::ostream &out)>;
+    using CServerCommandDispatcher = CCommandDispatcher<ServerCommandHandler>;
+
+    //------------------------------------------------------------------------------------------------
+    struct ServerReply
+    {
+        Status ReadStatus;     // Result of reading the command expression on the server
+        Status DispatchStatus; // NotFound if the category has no handler, the status of an Exception
+                               // thrown by the handler, HandlerError for any other exception
+        int ExitCode;          // Handler result, or -1 if no handler ran to completion
+        std::string Output;    // Handler output, serialized expression, or the error description
+    };
+
+    //------------------------------------------------------------------------------------------------
+    // Accepts connections on a Unix domain socket. Each request carries an argument list in the
+    // NUL-separated cmdline format; the server reads it with the resident reader, dispatches it and
+    // replies with a ServerReply. Without a dispatcher the reply output is instead the expression
+    // serialized by CCommandReader::SerializeExpression, for the client to read with
+    // CSerializedExpression. A connection may carry any number of requests. @file arguments are
+    // never expanded, so clients cannot make the server read files. The socket is created with
+    // owner-only permissions and connections from other users are refused.
+    class CCommandServer
+    {
+        const CCommandReader &m_Reader;
+        const CServerCommandDispatcher *m_Dispatcher;
+        std::string m_SocketPath;
+        int m_ListenSocket = -1;
+        std::atomic<bool> m_Stopping{ false };
+
+        struct Connection;
+
+        // Reads what has arrived on a connection and answers the requests it completes. Returns
+        // false if the connection should be closed.
+        bool Receive(int socket, Connection &connection) const;
+
+        // Answers one request. Returns false if the connection should be closed.
+        bool ServeRequest(int socket, std::string_view request) const;
+
+    public:
+        CCommandServer(const CCommandReader &reader, const CServerCommandDispatcher &dispatcher) :
+            m_Reader(reader),
+            m_Dispatcher(&dispatcher)
+        {
+        }
+
+        explicit CCommandServer(const CCommandReader &reader) :
+            m_Reader(reader),
+            m_Dispatcher(nullptr)
+        {
+        }
+
+        CCommandServer(const CCommandServer &) = delete;
+        CCommandServer &operator=(const CCommandServer &) = delete;
+        ~CCommandServer();
+
+        // Binds and listens on socketPath, replacing any stale socket file. Runs the reader's
+        // pending populators, so the reader must not be read elsewhere during the call.
+        Status Listen(const std::string &socketPath);
+
+        // Serves connections until Stop is called. Each Run call waits on the listening socket and
+        // on the connections it accepted together, reading requests as their bytes arrive, so idle
+        // or slow clients do not hold up others. A client that takes more than a few seconds to
+        // finish sending a request it has begun, or to take its reply, is disconnected. May be
+        // called from several threads to serve requests concurrently; the reader and handlers must
+        // then be thread-safe.
+        void Run();
+
+        // Makes Run close its connections and return once it finishes the request in progress
+        void Stop() { m_Stopping.store(true); }
+    };
+
+    //------------------------------------------------------------------------------------------------
+    // Client side of CCommandServer. Keeps one connection open for any number of requests.
+    class CCommandClient
+    {
+        int m_Socket = -1;
+
+    public:
+        CCommandClient() = default;
+        CCommandClient(const CCommandClient &) = delete;
+        CCommandClient &operator=(const CCommandClient &) = delete;
+        ~CCommandClient();
+
+        Status Connect(const std::string &socketPath);
+
+        // Sends argv (including the app name in argv[0]) and waits for the reply
+        Status Send(int argc, const char *argv[], ServerReply &reply);
+    };
+}
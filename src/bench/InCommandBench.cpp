@@ -0,0 +1,132 @@
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <chrono>
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+#include "InCommand.h"
+#if !defined(_WIN32)
+#include <filesystem>
+#include <thread>
+#include "InCommandServer.h"
+#endif
+
+// Counts heap allocations so each benchmark can report allocations per operation
+static std::atomic<size_t> g_AllocationCount{ 0 };
+
+void *operator new(size_t size)
+{
+    g_AllocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    std::free(p);
+}
+
+template<typename Func>
+static void Measure(const char *name, size_t iterations, Func &&func)
+{
+    // Warm up
+    for (size_t i = 0; i < iterations / 10; ++i)
+        func();
+
+    size_t allocations = g_AllocationCount.load();
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < iterations; ++i)
+        func();
+    auto end = std::chrono::steady_clock::now();
+    allocations = g_AllocationCount.load() - allocations;
+
+    double ns = std::chrono::duration<double, std::nano>(end - start).count() / double(iterations);
+    std::cout << std::left << std::setw(40) << name
+        << std::right << std::setw(10) << std::fixed << std::setprecision(1) << ns << " ns/op"
+        << std::setw(10) << std::setprecision(2) << double(allocations) / double(iterations) << " allocs/op" << std::endl;
+}
+
+static InCommand::CategoryHandle DeclareSchema(InCommand::CCommandReader &reader)
+{
+    auto submit = reader.DeclareCategory("submit", "Submit a job");
+    reader.DeclareVariable(submit, "queue", 'q', { "batch", "interactive", "gpu" }, "Target queue");
+    reader.DeclareVariable(submit, "name", 'n', "Job name");
+    reader.DeclareSwitch(submit, "wait", 'w', "Wait for completion");
+    reader.DeclareSwitch(submit, "verbose", 'v', "Verbose output");
+    reader.DeclareParameter(submit, "script", "Job script");
+    reader.DeclareRestParameter(submit, "args", "Script arguments");
+    for (int i = 0; i < 50; ++i)
+        reader.DeclareCategory("command" + std::to_string(i));
+    return submit;
+}
+
+int main()
+{
+    InCommand::CCommandReader reader("bench");
+    auto submit = DeclareSchema(reader);
+
+    const char *argv[] = { "bench", "submit", "--queue", "batch", "-n", "nightly-build", "--wait", "-v", "build.sh", "--", "--target", "all" };
+    const int argc = int(sizeof(argv) / sizeof(argv[0]));
+    const size_t iterations = 200000;
+
+    Measure("ReadCommandExpression", iterations, [&]()
+        {
+            InCommand::CCommandExpression cmdExp;
+            if (reader.ReadCommandExpression(argc, argv, cmdExp) != InCommand::Status::Success)
+                std::abort();
+        });
+
+    Measure("Validate", iterations, [&]()
+        {
+            if (reader.Validate(argc, argv).ErrorStatus != InCommand::Status::Success)
+                std::abort();
+        });
+
+#if !defined(_WIN32)
+    // Cold start: what each invocation of a standalone tool pays before running its handler
+    Measure("Cold start (schema + read)", iterations / 10, [&]()
+        {
+            InCommand::CCommandReader coldReader("bench");
+            DeclareSchema(coldReader);
+            InCommand::CCommandExpression cmdExp;
+            if (coldReader.ReadCommandExpression(argc, argv, cmdExp) != InCommand::Status::Success)
+                std::abort();
+        });
+
+    InCommand::CServerCommandDispatcher dispatcher;
+    dispatcher.SetHandler(submit, [](const InCommand::CCommandExpression &, std::ostream &) { return 0; });
+
+    std::string socketPath = (std::filesystem::temp_directory_path() / "incommand_bench.sock").string();
+    InCommand::CCommandServer server(reader, dispatcher);
+    if (server.Listen(socketPath) != InCommand::Status::Success)
+        return -1;
+    std::thread serverThread([&server]() { server.Run(); });
+
+    {
+        // The server serves this connection until the client disconnects
+        InCommand::CCommandClient client;
+        if (client.Connect(socketPath) != InCommand::Status::Success)
+            return -1;
+
+        InCommand::ServerReply reply;
+        Measure("Command server round trip", iterations / 10, [&]()
+            {
+                if (client.Send(argc, argv, reply) != InCommand::Status::Success || reply.ReadStatus != InCommand::Status::Success)
+                    std::abort();
+            });
+    }
+
+    server.Stop();
+    serverThread.join();
+#endif
+
+    return 0;
+}
@@ -0,0 +1,34 @@
+#include <iostream>
+#include <cstdlib>
+
+#include "InCommandServer.h"
+
+// Thin client for CCommandServer. Forwards its arguments to the server listening on the socket
+// named by the INCOMMAND_SOCKET environment variable and prints the reply.
+int main(int argc, const char *argv[])
+{
+    const char *socketPath = std::getenv("INCOMMAND_SOCKET");
+    if (!socketPath)
+    {
+        std::cerr << "INCOMMAND_SOCKET is not set" << std::endl;
+        return -1;
+    }
+
+    InCommand::CCommandClient client;
+    InCommand::ServerReply reply;
+    if (client.Connect(socketPath) != InCommand::Status::Success ||
+        client.Send(argc, argv, reply) != InCommand::Status::Success)
+    {
+        std::cerr << "Unable to reach command server at '" << socketPath << "'" << std::endl;
+        return -1;
+    }
+
+    if (reply.ReadStatus != InCommand::Status::Success || reply.DispatchStatus != InCommand::Status::Success)
+    {
+        std::cerr << reply.Output << std::endl;
+        return -1;
+    }
+
+    std::cout << reply.Output;
+    return reply.ExitCode;
+}
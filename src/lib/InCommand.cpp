@@ -1,219 +1,1916 @@
 #include <sstream>
+#include <fstream>
 #include <iomanip>
 #include <stack>
+#include <algorithm>
+
+#if defined(_WIN32)
+#include <windows.h>
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#elif defined(__APPLE__)
+#include <pthread.h>
+#endif
+#endif
 
 #include "InCommand.h"
 
-namespace InCommand
-{
+namespace InCommand
+{
+    //------------------------------------------------------------------------------------------------
+    static std::string StatusString(Status status)
+    {
+        switch (status)
+        {
+        case Status::Success:
+            return "Success";
+        case Status::DuplicateCategory:
+            return "Duplicate category";
+        case Status::DuplicateOption:
+            return "Duplicate option";
+        case Status::UnexpectedArgument:
+            return "Unexpected argument";
+        case Status::UnknownOption:
+            return "Unknown option";
+        case Status::MissingVariableValue:
+            return "Missing variable value";
+        case Status::TooManyParameters:
+            return "Too many parameters";
+        case Status::InvalidValue:
+            return "Invalid value";
+        case Status::OutOfRange:
+            return "Out of range";
+        case Status::NotFound:
+            return "Not found";
+        case Status::InvalidHandle:
+            return "Invalid handle";
+        case Status::InvalidResponseFile:
+            return "Invalid response file";
+        case Status::ResponseFileTooDeep:
+            return "Response file nesting too deep";
+        case Status::ConnectionError:
+            return "Connection error";
+        case Status::SchemaMismatch:
+            return "Schema mismatch";
+        case Status::InvalidFormat:
+            return "Invalid format";
+        case Status::AmbiguousArgument:
+            return "Ambiguous argument";
+        case Status::SharedMemoryError:
+            return "Shared memory error";
+        case Status::HandlerError:
+            return "Handler error";
+        }
+
+        return "Unknown error";
+    }
+    
+    //------------------------------------------------------------------------------------------------
+    std::shared_ptr<CMappedFile> CMappedFile::Open(const std::string &path)
+    {
+        std::shared_ptr<CMappedFile> file(new CMappedFile(path));
+
+#if defined(_WIN32)
+        HANDLE fileHandle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (fileHandle == INVALID_HANDLE_VALUE)
+            return nullptr;
+        file->m_FileHandle = fileHandle;
+
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(fileHandle, &size))
+            return nullptr;
+        file->m_Size = size_t(size.QuadPart);
+
+        if (file->m_Size > 0)
+        {
+            HANDLE mappingHandle = CreateFileMappingA(fileHandle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            if (!mappingHandle)
+                return nullptr;
+            file->m_MappingHandle = mappingHandle;
+
+            file->m_Data = static_cast<const char *>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+            if (!file->m_Data)
+                return nullptr;
+        }
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return nullptr;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+        {
+            close(fd);
+            return nullptr;
+        }
+        file->m_Size = size_t(st.st_size);
+
+        if (file->m_Size > 0)
+        {
+            void *data = mmap(nullptr, file->m_Size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED)
+            {
+                close(fd);
+                return nullptr;
+            }
+            file->m_Data = static_cast<const char *>(data);
+        }
+
+        // The mapping remains valid after the descriptor is closed
+        close(fd);
+#endif
+
+        return file;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    CMappedFile::~CMappedFile()
+    {
+#if defined(_WIN32)
+        if (m_Data)
+            UnmapViewOfFile(m_Data);
+        if (m_MappingHandle)
+            CloseHandle(m_MappingHandle);
+        if (m_FileHandle)
+            CloseHandle(m_FileHandle);
+#else
+        if (m_Data)
+            munmap(const_cast<char *>(m_Data), m_Size);
+#endif
+    }
+
+    //------------------------------------------------------------------------------------------------
+    ParseCounters &ParseCounters::operator+=(const ParseCounters &o)
+    {
+        uint64_t values[CParseInstrumentation::CounterCount];
+        uint64_t others[CParseInstrumentation::CounterCount];
+        std::memcpy(values, this, sizeof(values));
+        std::memcpy(others, &o, sizeof(others));
+        for (size_t i = 0; i < CParseInstrumentation::CounterCount; ++i)
+            values[i] += others[i];
+        std::memcpy(this, values, sizeof(values));
+        return *this;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    ParseCounters &ParseCounters::operator-=(const ParseCounters &o)
+    {
+        uint64_t values[CParseInstrumentation::CounterCount];
+        uint64_t others[CParseInstrumentation::CounterCount];
+        std::memcpy(values, this, sizeof(values));
+        std::memcpy(others, &o, sizeof(others));
+        for (size_t i = 0; i < CParseInstrumentation::CounterCount; ++i)
+            values[i] -= others[i];
+        std::memcpy(this, values, sizeof(values));
+        return *this;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    ParseCounters GetParseCounters()
+    {
+        return CParseInstrumentation::Snapshot();
+    }
+
+    //------------------------------------------------------------------------------------------------
+    std::atomic<CParseInstrumentation::Block *> CParseInstrumentation::s_Blocks{ nullptr };
+
+    //------------------------------------------------------------------------------------------------
+    CParseInstrumentation::Block &CParseInstrumentation::RegisterThread()
+    {
+        // Releases the thread's block for reuse when the thread exits
+        struct Releaser
+        {
+            Block *Owned = nullptr;
+            ~Releaser()
+            {
+                if (Owned)
+                    Owned->InUse.store(false, std::memory_order_release);
+                s_Local = nullptr;
+            }
+        };
+        static thread_local Releaser releaser;
+
+        Block *block = s_Blocks.load(std::memory_order_acquire);
+        for (; block; block = block->Next)
+        {
+            bool inUse = false;
+            if (!block->InUse.load(std::memory_order_relaxed) && block->InUse.compare_exchange_strong(inUse, true, std::memory_order_acquire))
+                break;
+        }
+
+        if (!block)
+        {
+            block = new Block();
+            block->InUse.store(true, std::memory_order_relaxed);
+            block->Next = s_Blocks.load(std::memory_order_relaxed);
+            while (!s_Blocks.compare_exchange_weak(block->Next, block, std::memory_order_release, std::memory_order_relaxed))
+            {
+            }
+        }
+
+        releaser.Owned = block;
+        s_Local = block;
+        return *block;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    static ParseCounters LoadCounters(const CParseInstrumentation::Block &block)
+    {
+        uint64_t values[CParseInstrumentation::CounterCount];
+        for (size_t i = 0; i < CParseInstrumentation::CounterCount; ++i)
+            values[i] = block.Values[i].load(std::memory_order_relaxed);
+        ParseCounters counters;
+        std::memcpy(&counters, values, sizeof(values));
+        return counters;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    ParseCounters CParseInstrumentation::LocalSnapshot()
+    {
+        return LoadCounters(Local());
+    }
+
+    //------------------------------------------------------------------------------------------------
+    ParseCounters CParseInstrumentation::Snapshot()
+    {
+        ParseCounters counters;
+        for (const Block *block = s_Blocks.load(std::memory_order_acquire); block; block = block->Next)
+            counters += LoadCounters(*block);
+        return counters;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    std::atomic<CTraceRecorder::Ring *> CTraceRecorder::s_Rings{ nullptr };
+    std::atomic<bool> CTraceRecorder::s_Enabled{ true };
+
+    //------------------------------------------------------------------------------------------------
+    CTraceRecorder::Ring &CTraceRecorder::RegisterThread()
+    {
+        // Releases the thread's ring for reuse when the thread exits. Its spans stay buffered
+        // until written, tagged with the exited thread's id.
+        struct Releaser
+        {
+            Ring *Owned = nullptr;
+            ~Releaser()
+            {
+                if (Owned)
+                    Owned->InUse.store(false, std::memory_order_release);
+                s_Local = nullptr;
+            }
+        };
+        static thread_local Releaser releaser;
+
+        Ring *ring = s_Rings.load(std::memory_order_acquire);
+        for (; ring; ring = ring->Next)
+        {
+            bool inUse = false;
+            if (!ring->InUse.load(std::memory_order_relaxed) && ring->InUse.compare_exchange_strong(inUse, true, std::memory_order_acquire))
+                break;
+        }
+
+        if (!ring)
+        {
+            ring = new Ring();
+            ring->InUse.store(true, std::memory_order_relaxed);
+            ring->Next = s_Rings.load(std::memory_order_relaxed);
+            while (!s_Rings.compare_exchange_weak(ring->Next, ring, std::memory_order_release, std::memory_order_relaxed))
+            {
+            }
+        }
+
+        releaser.Owned = ring;
+        s_Local = ring;
+        // Tag spans with the OS thread id so they line up with debuggers, profilers and other
+        // trace sources
+#if defined(_WIN32)
+        s_ThreadId = (uint32_t)GetCurrentThreadId();
+#elif defined(__linux__)
+        s_ThreadId = (uint32_t)syscall(SYS_gettid);
+#elif defined(__APPLE__)
+        uint64_t threadId = 0;
+        pthread_threadid_np(nullptr, &threadId);
+        s_ThreadId = (uint32_t)threadId;
+#else
+        static std::atomic<uint32_t> lastThreadId{ 0 };
+        s_ThreadId = lastThreadId.fetch_add(1, std::memory_order_relaxed) + 1;
+#endif
+        return *ring;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CTraceRecorder::Record(const char *name, uint64_t start, uint64_t duration)
+    {
+        Ring &ring = s_Local ? *s_Local : RegisterThread();
+        std::lock_guard<std::mutex> lock(ring.Mutex);
+        ring.Events[ring.Recorded++ % RingCapacity] = Event{ name, s_ThreadId, start, duration };
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CTraceRecorder::Write(std::ostream &out)
+    {
+#if defined(_WIN32)
+        unsigned long processId = GetCurrentProcessId();
+#else
+        unsigned long processId = (unsigned long)getpid();
+#endif
+
+        // Chrome trace-event timestamps are in microseconds
+        auto writeMicroseconds = [&out](uint64_t nanoseconds)
+        {
+            std::string fraction = std::to_string(nanoseconds % 1000);
+            out << nanoseconds / 1000 << '.' << std::string(3 - fraction.size(), '0') << fraction;
+        };
+
+        out << "{\"traceEvents\":[";
+        bool first = true;
+        for (Ring *ring = s_Rings.load(std::memory_order_acquire); ring; ring = ring->Next)
+        {
+            std::lock_guard<std::mutex> lock(ring->Mutex);
+            uint64_t begin = ring->Recorded > RingCapacity ? ring->Recorded - RingCapacity : 0;
+            for (uint64_t i = begin; i < ring->Recorded; ++i)
+            {
+                const Event &event = ring->Events[i % RingCapacity];
+                out << (first ? "\n" : ",\n") << "{\"name\":\"" << event.Name << "\",\"cat\":\"InCommand\",\"ph\":\"X\",\"pid\":" << processId
+                    << ",\"tid\":" << event.ThreadId << ",\"ts\":";
+                writeMicroseconds(event.Start);
+                out << ",\"dur\":";
+                writeMicroseconds(event.Duration);
+                out << "}";
+                first = false;
+            }
+            ring->Recorded = 0;
+        }
+        out << "\n]}\n";
+    }
+
+    //------------------------------------------------------------------------------------------------
+    Status WriteTrace(const std::string &path)
+    {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        if (!file)
+            return Status::NotFound;
+        CTraceRecorder::Write(file);
+        return Status::Success;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    CUsageCounters::CUsageCounters(size_t size, const CUsageCounters *previous) :
+        m_Size(size),
+        m_LinesPerShard((size + ValuesPerLine - 1) / ValuesPerLine)
+    {
+        size_t shardCount = 1;
+        while (shardCount < MaxShards && shardCount < std::thread::hardware_concurrency())
+            shardCount *= 2;
+        m_ShardMask = shardCount - 1;
+        for (std::atomic<Line *> &shard : m_Shards)
+            shard.store(nullptr, std::memory_order_relaxed);
+
+        if (previous)
+        {
+            for (size_t index = 0; index < std::min(size, previous->m_Size); ++index)
+            {
+                if (uint64_t count = previous->Get(index))
+                    Value(AllocateShard(0), index).store(count, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    //------------------------------------------------------------------------------------------------
+    CUsageCounters::~CUsageCounters()
+    {
+        for (std::atomic<Line *> &shard : m_Shards)
+            delete[] shard.load(std::memory_order_relaxed);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    CUsageCounters::Line *CUsageCounters::AllocateShard(size_t shard)
+    {
+        Line *lines = m_Shards[shard].load(std::memory_order_acquire);
+        if (lines)
+            return lines;
+
+        // Threads sharing the shard may race to allocate it; the first one wins
+        Line *allocated = new Line[m_LinesPerShard];
+        if (m_Shards[shard].compare_exchange_strong(lines, allocated, std::memory_order_acq_rel, std::memory_order_acquire))
+            return allocated;
+        delete[] allocated;
+        return lines;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    uint64_t CUsageCounters::Get(size_t index) const
+    {
+        uint64_t count = 0;
+        for (size_t shard = 0; shard <= m_ShardMask; ++shard)
+        {
+            if (Line *lines = m_Shards[shard].load(std::memory_order_acquire))
+                count += Value(lines, index).load(std::memory_order_relaxed);
+        }
+        return count;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CUsageCounters::Reset()
+    {
+        for (size_t shard = 0; shard <= m_ShardMask; ++shard)
+        {
+            Line *lines = m_Shards[shard].load(std::memory_order_acquire);
+            for (size_t line = 0; lines && line < m_LinesPerShard; ++line)
+            {
+                for (std::atomic<uint64_t> &value : lines[line].Values)
+                    value.store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+
+    //------------------------------------------------------------------------------------------------
+    bool CCommandReader::ArgumentStream::Next(ArgumentToken &token)
+    {
+        for (;;)
+        {
+            if (!m_Frames.empty())
+            {
+                Frame &frame = m_Frames.back();
+                const char *end = frame.File->GetData() + frame.File->GetSize();
+                const char *rawBegin;
+                TokenScan scan = ScanResponseFileToken(frame.Cursor, end, rawBegin, token.Value);
+                if (scan == TokenScan::End)
+                {
+                    m_Frames.pop_back();
+                    continue;
+                }
+
+                token.Format = TokenFormat::ResponseFile;
+                token.ArgIndex = m_ArgIndex;
+                token.File = frame.File.get();
+                token.FileOffset = size_t(rawBegin - frame.File->GetData());
+                token.ArgvElement = nullptr;
+                token.RawBegin = rawBegin;
+                token.RawEnd = frame.Cursor;
+                token.Frame = frame.Id;
+                if (scan == TokenScan::UnterminatedQuote)
+                {
+                    token.Value = std::string_view(rawBegin, size_t(end - rawBegin));
+                    m_Status = Status::InvalidResponseFile;
+                    return false;
+                }
+            }
+            else if (m_Argv)
+            {
+                if (m_NextArg >= m_Argc)
+                    return false;
+
+                m_ArgIndex = m_NextArg++;
+                token.Value = m_Argv[m_ArgIndex];
+                token.Format = TokenFormat::Argv;
+                token.ArgIndex = m_ArgIndex;
+                token.File = nullptr;
+                token.FileOffset = 0;
+                token.ArgvElement = &m_Argv[m_ArgIndex];
+                token.RawBegin = nullptr;
+                token.RawEnd = nullptr;
+                token.Frame = 0;
+            }
+            else
+            {
+                const char *rawBegin;
+                if (ScanNulSeparatedToken(m_Cursor, m_BufferEnd, rawBegin, token.Value) == TokenScan::End)
+                    return false;
+
+                m_ArgIndex = m_NextArg++;
+                token.Format = TokenFormat::NulSeparated;
+                token.ArgIndex = m_ArgIndex;
+                token.File = nullptr;
+                token.FileOffset = 0;
+                token.ArgvElement = nullptr;
+                token.RawBegin = rawBegin;
+                token.RawEnd = rawBegin + token.Value.size();
+                token.Frame = 0;
+            }
+
+            token.Ordinal = m_Ordinal++;
+
+            if (!m_Separator.empty() && token.Value == m_Separator)
+            {
+                m_AtSeparator = true;
+                return false;
+            }
+
+            if (m_ResponseFileMaxDepth == 0 || token.Value.size() < 2 || token.Value[0] != '@')
+            {
+                IN_COMMAND_COUNT(Tokens, 1);
+                return true;
+            }
+
+            // Expand the response file in place of this token
+            if (m_Frames.size() == m_ResponseFileMaxDepth)
+            {
+                m_Status = Status::ResponseFileTooDeep;
+                return false;
+            }
+
+            std::shared_ptr<CMappedFile> file = CMappedFile::Open(std::string(token.Value.substr(1)));
+            if (!file)
+            {
+                m_Status = Status::InvalidResponseFile;
+                return false;
+            }
+
+            m_RetainedFiles.push_back(file);
+            m_Frames.push_back({ file, file->GetData(), ++m_FrameCount });
+            IN_COMMAND_COUNT(Allocations, 1);
+        }
+    }
+
+    //------------------------------------------------------------------------------------------------
+    Status CCommandReader::SetReadError(ReadErrorDesc &error, Status status, const ArgumentToken &token, size_t contextIndex)
+    {
+        error.ErrorStatus = status;
+        error.ArgIndex = token.ArgIndex;
+        error.ArgString = token.Value;
+        error.ContextIndex = uint32_t(contextIndex);
+        if (token.File)
+            error.FileName = token.File->GetPath();
+        else
+            error.FileName.clear();
+        error.FileOffset = token.FileOffset;
+        return status;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    size_t CCommandReader::AddVariableOrSwitchOption(
+        ArgumentType type,
+        CategoryHandle category,
+        const std::string &name,
+        char shortName,
+        const std::vector<std::string> &domain,
+        const std::string &description)
+    {
+        IN_COMMAND_TRACE_SPAN("DeclareOption");
+        size_t categoryIndex = HandleIndex(category);
+        if (categoryIndex >= GetCategoryCount())
+            throw Exception(Status::InvalidHandle);
+        IndexType optionIndex = CheckedIndex(GetOptionCount());
+
+        // Names declared by the base live in its own pool, so look those up in the base schema
+        if (categoryIndex < GetBaseCategoryCount())
+        {
+            const SchemaImage &base = *m_BaseSchema;
+            const SchemaImage::Category &baseCategory = base.GetCategory(categoryIndex);
+            const uint32_t *it = base.LowerBoundOption(baseCategory, name);
+            if (it != base.GetWords(baseCategory.SortedNames).end() && base.GetString(base.GetOption(*it).Name) == name &&
+                base.GetOption(*it).Category == categoryIndex)
+                throw Exception(Status::DuplicateOption);
+        }
+
+        // Interned names are unique, so the name offset identifies the name within the category
+        PooledString pooledName = Intern(name);
+        if (!m_DeclaredOptionNames.insert((uint64_t(categoryIndex) << 32) | pooledName.Offset).second)
+            throw Exception(Status::DuplicateOption);
+
+        auto &categoryDesc = GetCategoryDesc(categoryIndex);
+        m_OptionsDescs.emplace_back(type, pooledName, InternDescription(description));
+        OptionDesc &optionDesc = m_OptionsDescs.back();
+        if (type == ArgumentType::Variable)
+        {
+            for (const std::string &value : domain)
+                optionDesc.Domain.push_back(Intern(value));
+            std::sort(optionDesc.Domain.begin(), optionDesc.Domain.end(),
+                [this](PooledString a, PooledString b) { return GetString(a) < GetString(b); });
+            optionDesc.Domain.erase(std::unique(optionDesc.Domain.begin(), optionDesc.Domain.end()), optionDesc.Domain.end());
+        }
+
+        optionDesc.ShortName = shortName;
+        categoryDesc.OptionIds.push_back(optionIndex);
+
+        MixSchemaFingerprint(type, categoryIndex, name, shortName);
+        for (const std::string &value : domain)
+            MixSchemaFingerprint(ArgumentType::Variable, optionIndex, value, '=');
+
+        return optionIndex;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    uint32_t CCommandReader::NextGeneration()
+    {
+        // Generation 0 is reserved for handles compatible with every reader
+        static std::atomic<uint32_t> lastGeneration{ 0 };
+        uint32_t generation;
+        do
+        {
+            generation = lastGeneration.fetch_add(1, std::memory_order_relaxed) + 1;
+        } while (generation == 0);
+        return generation;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    CCommandReader::PooledString CCommandReader::Intern(std::string_view value)
+    {
+        // Append the value provisionally and drop it again if the pool already holds it
+        size_t baseSize = GetBaseStringsSize();
+        if (baseSize + m_StringPool.size() + value.size() > UINT32_MAX)
+            throw Exception(Status::OutOfRange);
+
+        PooledString pooled{ uint32_t(baseSize + m_StringPool.size()), uint32_t(value.size()) };
+        m_StringPool.append(value);
+        auto result = m_InternedStrings.insert(pooled);
+        if (!result.second)
+            m_StringPool.resize(pooled.Offset - baseSize);
+        return *result.first;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CCommandReader::SetDescriptionCatalog(const std::string &path)
+    {
+        std::lock_guard<std::mutex> lock(m_CatalogMutex);
+        m_Catalog = DescriptionCatalog();
+        m_Catalog.Path = path;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    std::string_view CCommandReader::GetDescription(std::string_view key) const
+    {
+        std::lock_guard<std::mutex> lock(m_CatalogMutex);
+        if (m_Catalog.Path.empty() || key.empty())
+            return key;
+
+        if (!m_Catalog.Loaded)
+        {
+            m_Catalog.Loaded = true;
+            m_Catalog.File = CMappedFile::Open(m_Catalog.Path);
+            if (m_Catalog.File)
+            {
+                std::string_view text(m_Catalog.File->GetData(), m_Catalog.File->GetSize());
+                while (!text.empty())
+                {
+                    size_t lineEnd = std::min(text.find('\n'), text.size());
+                    std::string_view line = text.substr(0, lineEnd);
+                    text.remove_prefix(std::min(lineEnd + 1, text.size()));
+                    if (!line.empty() && line.back() == '\r')
+                        line.remove_suffix(1);
+
+                    size_t separator = line.find('=');
+                    if (line.empty() || line[0] == '#' || separator == std::string_view::npos)
+                        continue;
+                    m_Catalog.Entries.emplace_back(line.substr(0, separator), line.substr(separator + 1));
+                }
+
+                // Stable, so the first entry for a key wins
+                std::stable_sort(m_Catalog.Entries.begin(), m_Catalog.Entries.end(),
+                    [](const auto &a, const auto &b) { return a.first < b.first; });
+            }
+        }
+
+        auto it = std::lower_bound(m_Catalog.Entries.begin(), m_Catalog.Entries.end(), key,
+            [](const auto &entry, std::string_view k) { return entry.first < k; });
+        if (it != m_Catalog.Entries.end() && it->first == key)
+            return it->second;
+        return key;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CCommandReader::SetOptionInherited(ArgumentType type, size_t optionIndex, bool inherited)
+    {
+        if (optionIndex < GetBaseOptionCount() || optionIndex >= GetOptionCount() || GetOptionDesc(optionIndex).Type != type)
+            throw Exception(Status::InvalidHandle);
+
+        GetOptionDesc(optionIndex).Inherited = inherited;
+        MixSchemaFingerprint(type, optionIndex, "", inherited ? '^' : '-');
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CCommandReader::CollectOptions(size_t categoryIndex, std::map<std::string_view, IndexType> &byName, std::map<char, IndexType> &byShortName) const
+    {
+        // emplace keeps the nearest declaration of a name
+        auto addOption = [&](IndexType optionIndex, PooledString name, char shortName)
+        {
+            byName.emplace(GetString(name), optionIndex);
+            if (shortName != '-')
+                byShortName.emplace(shortName, optionIndex);
+        };
+
+        bool inheritedOnly = false;
+        std::vector<uint32_t> baseOptionIds;
+        for (size_t index = categoryIndex; index != SchemaImage::NoIndex;)
+        {
+            size_t parentIndex = SchemaImage::NoIndex;
+            if (index < GetBaseCategoryCount())
+            {
+                // The base's own options of the category, which precede any added since, in
+                // declaration order
+                const SchemaImage::Category &baseCategory = m_BaseSchema->GetCategory(index);
+                baseOptionIds.clear();
+                for (uint32_t optionIndex : m_BaseSchema->GetWords(baseCategory.SortedNames))
+                {
+                    const SchemaImage::Option &option = m_BaseSchema->GetOption(optionIndex);
+                    if (option.Category == index && (!inheritedOnly || option.Inherited))
+                        baseOptionIds.push_back(optionIndex);
+                }
+                std::sort(baseOptionIds.begin(), baseOptionIds.end());
+                for (uint32_t optionIndex : baseOptionIds)
+                {
+                    const SchemaImage::Option &option = m_BaseSchema->GetOption(optionIndex);
+                    addOption(optionIndex, option.Name, option.ShortName);
+                }
+                parentIndex = baseCategory.Parent;
+            }
+
+            if (const CategoryDesc *categoryDesc = FindCategoryDesc(index))
+            {
+                for (size_t optionIndex : categoryDesc->OptionIds)
+                {
+                    const OptionDesc &optionDesc = GetOptionDesc(optionIndex);
+                    if (!inheritedOnly || optionDesc.Inherited)
+                        addOption(optionIndex, optionDesc.Name, optionDesc.ShortName);
+                }
+                if (index >= GetBaseCategoryCount() && categoryDesc->Parent != NullCategory)
+                    parentIndex = categoryDesc->Parent.m_Value;
+            }
+
+            inheritedOnly = true;
+            index = parentIndex;
+        }
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CCommandReader::BuildOptionTable(const std::map<std::string_view, IndexType> &byName, const std::map<char, IndexType> &byShortName, std::vector<uint32_t> &seeds, std::vector<uint32_t> &slots)
+    {
+        struct Key
+        {
+            uint64_t Hash;
+            IndexType OptionIndex;
+        };
+
+        std::vector<Key> keys;
+        std::string keyString;
+        for (const auto &entry : byName)
+        {
+            keyString = "--";
+            keyString += entry.first;
+            keys.push_back({ OptionKeyHash(keyString), entry.second });
+        }
+        for (const auto &entry : byShortName)
+        {
+            const char shortKey[] = { '-', entry.first };
+            keys.push_back({ OptionKeyHash(std::string_view(shortKey, 2)), entry.second });
+        }
+
+        seeds.clear();
+        slots.clear();
+        if (keys.empty())
+            return;
+
+        // Hash and displace: place the largest buckets first, searching for a seed per bucket
+        // that sends all of its keys to free slots. Grow the table if a bucket cannot be placed.
+        for (size_t slotCount = keys.size() + keys.size() / 4 + 1;; slotCount += slotCount / 2 + 1)
+        {
+            size_t bucketCount = keys.size() / 2 + 1;
+            std::vector<std::vector<const Key *>> buckets(bucketCount);
+            for (const Key &key : keys)
+                buckets[OptionBucket(key.Hash, bucketCount)].push_back(&key);
+
+            std::vector<size_t> bucketOrder(bucketCount);
+            for (size_t i = 0; i < bucketCount; ++i)
+                bucketOrder[i] = i;
+            std::stable_sort(bucketOrder.begin(), bucketOrder.end(), [&buckets](size_t a, size_t b) { return buckets[a].size() > buckets[b].size(); });
+
+            seeds.assign(bucketCount, 0);
+            slots.assign(slotCount, SchemaImage::NoIndex);
+            bool placed = true;
+            std::vector<size_t> bucketSlots;
+            for (size_t bucketIndex : bucketOrder)
+            {
+                const auto &bucket = buckets[bucketIndex];
+                if (bucket.empty())
+                    break;
+
+                placed = false;
+                for (uint32_t seed = 0; seed < 4096 && !placed; ++seed)
+                {
+                    bucketSlots.clear();
+                    placed = true;
+                    for (const Key *key : bucket)
+                    {
+                        size_t slot = OptionSlot(key->Hash, seed, slotCount);
+                        if (slots[slot] != SchemaImage::NoIndex || std::find(bucketSlots.begin(), bucketSlots.end(), slot) != bucketSlots.end())
+                        {
+                            placed = false;
+                            break;
+                        }
+                        bucketSlots.push_back(slot);
+                    }
+
+                    if (placed)
+                    {
+                        seeds[bucketIndex] = seed;
+                        for (size_t i = 0; i < bucket.size(); ++i)
+                            slots[bucketSlots[i]] = uint32_t(bucket[i]->OptionIndex);
+                    }
+                }
+
+                if (!placed)
+                    break;
+            }
+
+            if (placed)
+                return;
+        }
+    }
+
+    //------------------------------------------------------------------------------------------------
+    std::shared_ptr<const CCommandReader::SchemaImage> CCommandReader::CompileSchema() const
+    {
+        using Image = SchemaImage;
+        size_t baseCategoryCount = GetBaseCategoryCount();
+        size_t baseOptionCount = GetBaseOptionCount();
+        size_t baseWordCount = m_BaseSchema ? m_BaseSchema->GetWordCount() : 0;
+        size_t baseStringsSize = GetBaseStringsSize();
+
+        std::vector<uint32_t> words;
+        auto appendWords = [&words, baseWordCount](const auto &values)
+        {
+            Image::Range range{ uint32_t(baseWordCount + words.size()), uint32_t(values.size()) };
+            words.insert(words.end(), values.begin(), values.end());
+            return range;
+        };
+
+        std::vector<Image::Option> options(m_OptionsDescs.size());
+        for (size_t optionIndex = 0; optionIndex < m_OptionsDescs.size(); ++optionIndex)
+        {
+            const OptionDesc &optionDesc = m_OptionsDescs[optionIndex];
+            Image::Option &option = options[optionIndex];
+            option.Name = optionDesc.Name;
+            option.Description = optionDesc.Description;
+            option.Domain = { uint32_t(baseWordCount + words.size()), uint32_t(optionDesc.Domain.size() * 2) };
+            for (PooledString value : optionDesc.Domain)
+            {
+                words.push_back(value.Offset);
+                words.push_back(value.Length);
+            }
+            option.Type = uint8_t(optionDesc.Type);
+            option.ShortName = optionDesc.ShortName;
+            option.Inherited = optionDesc.Inherited ? 1 : 0;
+        }
+
+        auto setOptionCategory = [&options, baseOptionCount](size_t categoryIndex, const CategoryDesc &categoryDesc)
+        {
+            for (size_t optionIndex : categoryDesc.OptionIds)
+                options[optionIndex - baseOptionCount].Category = uint32_t(categoryIndex);
+            for (size_t optionIndex : categoryDesc.ParameterIds)
+                options[optionIndex - baseOptionCount].Category = uint32_t(categoryIndex);
+            if (categoryDesc.RestParameterId)
+                options[*categoryDesc.RestParameterId - baseOptionCount].Category = uint32_t(categoryIndex);
+        };
+
+        // A layered image overrides the base categories given declarations since, and every base
+        // descendant of one that gained an inherited option, as their visible options change too
+        std::vector<uint32_t> overrides;
+        std::vector<uint32_t> pending;
+        for (const auto &entry : m_BaseCategoryDeltas)
+        {
+            setOptionCategory(entry.first, entry.second);
+            overrides.push_back(uint32_t(entry.first));
+            if (std::any_of(entry.second.OptionIds.begin(), entry.second.OptionIds.end(),
+                [this](size_t optionIndex) { return GetOptionDesc(optionIndex).Inherited; }))
+                pending.push_back(uint32_t(entry.first));
+        }
+        while (!pending.empty())
+        {
+            uint32_t categoryIndex = pending.back();
+            pending.pop_back();
+            for (uint32_t subCategory : m_BaseSchema->GetWords(m_BaseSchema->GetCategory(categoryIndex).SubCategories))
+            {
+                overrides.push_back(subCategory);
+                pending.push_back(subCategory);
+            }
+        }
+        std::sort(overrides.begin(), overrides.end());
+        overrides.erase(std::unique(overrides.begin(), overrides.end()), overrides.end());
+
+        auto categoryName = [&](size_t categoryIndex)
+        {
+            return GetString(categoryIndex < baseCategoryCount ?
+                m_BaseSchema->GetCategory(categoryIndex).Name : m_CategoryDescs[categoryIndex - baseCategoryCount].Name);
+        };
+
+        std::vector<Image::Category> categories(m_CategoryDescs.size() + overrides.size());
+        std::map<std::string_view, IndexType> byName;
+        std::map<char, IndexType> byShortName;
+        std::vector<uint32_t> table;
+        std::vector<uint32_t> parameterIds;
+        std::vector<uint32_t> seeds;
+        std::vector<uint32_t> slots;
+        for (size_t recordIndex = 0; recordIndex < categories.size(); ++recordIndex)
+        {
+            Image::Category &category = categories[recordIndex];
+            size_t categoryIndex;
+            table.clear();
+            parameterIds.clear();
+            if (recordIndex < m_CategoryDescs.size())
+            {
+                const CategoryDesc &categoryDesc = m_CategoryDescs[recordIndex];
+                categoryIndex = baseCategoryCount + recordIndex;
+                setOptionCategory(categoryIndex, categoryDesc);
+                category.Parent = categoryDesc.Parent == NullCategory ? Image::NoIndex : uint32_t(categoryDesc.Parent.m_Value);
+                category.Name = categoryDesc.Name;
+                category.Description = categoryDesc.Description;
+                category.RestParameterId = Image::NoIndex;
+                category.Deferred = categoryDesc.Populator ? 1 : 0;
+            }
+            else
+            {
+                // Start from the base record, adding the declarations since
+                categoryIndex = overrides[recordIndex - m_CategoryDescs.size()];
+                category = m_BaseSchema->GetCategory(categoryIndex);
+                Image::Span<uint32_t> subCategories = m_BaseSchema->GetWords(category.SubCategories);
+                Image::Span<uint32_t> baseParameterIds = m_BaseSchema->GetWords(category.ParameterIds);
+                table.assign(subCategories.begin(), subCategories.end());
+                parameterIds.assign(baseParameterIds.begin(), baseParameterIds.end());
+            }
+
+            if (const CategoryDesc *categoryDesc = FindCategoryDesc(categoryIndex))
+            {
+                for (CategoryHandle subCategory : categoryDesc->SubCategories)
+                    table.push_back(uint32_t(subCategory.m_Value));
+                parameterIds.insert(parameterIds.end(), categoryDesc->ParameterIds.begin(), categoryDesc->ParameterIds.end());
+                if (categoryDesc->RestParameterId)
+                    category.RestParameterId = uint32_t(*categoryDesc->RestParameterId);
+            }
+
+            // Stable, so the first of several equally named sub-categories is found
+            std::stable_sort(table.begin(), table.end(), [&categoryName](uint32_t a, uint32_t b) { return categoryName(a) < categoryName(b); });
+            category.SubCategories = appendWords(table);
+            category.ParameterIds = appendWords(parameterIds);
+
+            byName.clear();
+            byShortName.clear();
+            CollectOptions(categoryIndex, byName, byShortName);
+            BuildOptionTable(byName, byShortName, seeds, slots);
+            category.Seeds = appendWords(seeds);
+            category.Slots = appendWords(slots);
+
+            table.clear();
+            for (const auto &entry : byName)
+                table.push_back(uint32_t(entry.second));
+            category.SortedNames = appendWords(table);
+        }
+
+        Image::Header header = {};
+        header.Magic = Image::Magic;
+        header.Version = Image::Version;
+        header.Fingerprint = m_SchemaFingerprint;
+        header.Generation = m_Generation;
+        header.CategoryCount = uint32_t(baseCategoryCount + m_CategoryDescs.size());
+        header.OptionCount = uint32_t(baseOptionCount + options.size());
+        header.WordCount = uint32_t(baseWordCount + words.size());
+        header.StringsSize = uint32_t(baseStringsSize + m_StringPool.size());
+        header.BaseCategoryCount = uint32_t(baseCategoryCount);
+        header.BaseOptionCount = uint32_t(baseOptionCount);
+        header.BaseWordCount = uint32_t(baseWordCount);
+        header.BaseStringsSize = uint32_t(baseStringsSize);
+        header.OverrideCount = uint32_t(overrides.size());
+
+        // Lay the sections out in a buffer of 64-bit words, which keeps every section aligned
+        auto buffer = std::make_shared<std::vector<uint64_t>>(Image::ImageSize(header) / sizeof(uint64_t));
+        char *data = reinterpret_cast<char *>(buffer->data());
+        auto appendSection = [&data](const void *section, size_t size)
+        {
+            if (size > 0)
+                std::memcpy(data, section, size);
+            data += Image::SectionSize(size);
+        };
+        appendSection(&header, sizeof(header));
+        appendSection(categories.data(), categories.size() * sizeof(Image::Category));
+        appendSection(overrides.data(), overrides.size() * sizeof(uint32_t));
+        appendSection(options.data(), options.size() * sizeof(Image::Option));
+        appendSection(words.data(), words.size() * sizeof(uint32_t));
+        appendSection(m_StringPool.data(), m_StringPool.size());
+
+        const char *imageData = reinterpret_cast<const char *>(buffer->data());
+        return std::make_shared<const Image>(std::move(buffer), imageData, m_BaseSchema);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CCommandReader::SchemaImage::CopyWords(uint32_t *words) const
+    {
+        if (m_Base)
+            m_Base->CopyWords(words);
+        std::copy(m_Words, m_Words + (m_Header->WordCount - m_BaseWordCount), words + m_BaseWordCount);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CCommandReader::SchemaImage::CopyStrings(char *strings) const
+    {
+        if (m_Base)
+            m_Base->CopyStrings(strings);
+        std::copy(m_Strings, m_Strings + (m_Header->StringsSize - m_BaseStringsSize), strings + m_BaseStringsSize);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    std::shared_ptr<const CCommandReader::SchemaImage> CCommandReader::SchemaImage::Flatten() const
+    {
+        // The index and offset spaces of a layered image already span its bases, so records carry
+        // over unchanged
+        Header header = *m_Header;
+        header.BaseCategoryCount = 0;
+        header.BaseOptionCount = 0;
+        header.BaseWordCount = 0;
+        header.BaseStringsSize = 0;
+        header.OverrideCount = 0;
+
+        auto buffer = std::make_shared<std::vector<uint64_t>>(ImageSize(header) / sizeof(uint64_t));
+        char *data = reinterpret_cast<char *>(buffer->data());
+        std::memcpy(data, &header, sizeof(header));
+        data += SectionSize(sizeof(Header));
+        for (size_t categoryIndex = 0; categoryIndex < header.CategoryCount; ++categoryIndex)
+            std::memcpy(data + categoryIndex * sizeof(Category), &GetCategory(categoryIndex), sizeof(Category));
+        data += SectionSize(size_t(header.CategoryCount) * sizeof(Category));
+        for (size_t optionIndex = 0; optionIndex < header.OptionCount; ++optionIndex)
+            std::memcpy(data + optionIndex * sizeof(Option), &GetOption(optionIndex), sizeof(Option));
+        data += SectionSize(size_t(header.OptionCount) * sizeof(Option));
+        CopyWords(reinterpret_cast<uint32_t *>(data));
+        data += SectionSize(size_t(header.WordCount) * sizeof(uint32_t));
+        CopyStrings(data);
+
+        const char *imageData = reinterpret_cast<const char *>(buffer->data());
+        return std::make_shared<const SchemaImage>(std::move(buffer), imageData);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    bool CCommandReader::SchemaImage::IsValid(const char *data, size_t size)
+    {
+        if (size < sizeof(Header))
+            return false;
+
+        // Only images without a base can be shared
+        const Header &header = *reinterpret_cast<const Header *>(data);
+        if (header.Magic != Magic || header.Version != Version ||
+            header.BaseCategoryCount != 0 || header.BaseOptionCount != 0 || header.BaseWordCount != 0 || header.BaseStringsSize != 0 ||
+            header.OverrideCount != 0 || ImageSize(header) != size)
+            return false;
+
+        SchemaImage image(nullptr, data);
+        auto validString = [&header](PooledString s) { return s.Offset <= header.StringsSize && s.Length <= header.StringsSize - s.Offset; };
+        auto validRange = [&header](Range range) { return range.Offset <= header.WordCount && range.Count <= header.WordCount - range.Offset; };
+        auto validIndices = [&](Range range, size_t first, size_t limit, bool allowNoIndex)
+        {
+            if (!validRange(range))
+                return false;
+            for (uint32_t index : image.GetWords(range))
+            {
+                if ((index < first || index >= limit) && !(allowNoIndex && index == NoIndex))
+                    return false;
+            }
+            return true;
+        };
+
+        // Parents precede their sub-categories, which rules out cycles in the category tree.
+        // Published images are fully populated, having no populators to run.
+        for (size_t categoryIndex = 0; categoryIndex < header.CategoryCount; ++categoryIndex)
+        {
+            const Category &category = image.GetCategory(categoryIndex);
+            bool validParent = categoryIndex == 0 ? category.Parent == NoIndex : category.Parent < categoryIndex;
+            if (!validParent || !validString(category.Name) || !validString(category.Description) ||
+                !validIndices(category.SubCategories, categoryIndex + 1, header.CategoryCount, false) ||
+                !validIndices(category.ParameterIds, 0, header.OptionCount, false) ||
+                (category.RestParameterId >= header.OptionCount && category.RestParameterId != NoIndex) ||
+                category.Deferred != 0 ||
+                !validRange(category.Seeds) || (category.Seeds.Count == 0) != (category.Slots.Count == 0) ||
+                !validIndices(category.Slots, 0, header.OptionCount, true) ||
+                !validIndices(category.SortedNames, 0, header.OptionCount, false))
+                return false;
+        }
+
+        for (size_t optionIndex = 0; optionIndex < header.OptionCount; ++optionIndex)
+        {
+            const Option &option = image.GetOption(optionIndex);
+            if (!validString(option.Name) || !validString(option.Description) || !validRange(option.Domain) || option.Domain.Count % 2 != 0 ||
+                option.Category >= header.CategoryCount ||
+                option.Type < uint8_t(ArgumentType::Variable) || option.Type > uint8_t(ArgumentType::Parameter))
+                return false;
+
+            Span<uint32_t> domain = image.GetWords(option.Domain);
+            for (size_t i = 0; i < domain.size(); i += 2)
+            {
+                if (!validString({ domain[i], domain[i + 1] }))
+                    return false;
+            }
+        }
+
+        return header.CategoryCount > 0;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CCommandReader::Freeze() const
+    {
+        std::lock_guard<std::mutex> lock(m_FreezeMutex);
+        if (m_Frozen.load(std::memory_order_relaxed))
+            return;
+
+        IN_COMMAND_TRACE_SPAN("Freeze");
+        IN_COMMAND_TIME_PHASE(FreezeNanoseconds);
+        m_Schema = CompileSchema();
+        GrowUsageCounters();
+        m_Frozen.store(true, std::memory_order_release);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CCommandReader::PopulateCategory(CategoryHandle category) const
+    {
+        CCommandReader &reader = const_cast<CCommandReader &>(*this);
+        CategoryDesc &categoryDesc = reader.GetCategoryDesc(category.m_Value);
+        CategoryPopulator populator = std::move(categoryDesc.Populator);
+        categoryDesc.Populator = nullptr;
+        {
+            IN_COMMAND_TRACE_SPAN("Populate");
+            IN_COMMAND_TIME_PHASE(PopulateNanoseconds);
+            populator(reader, category);
+        }
+        EnsureFrozen();
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CCommandReader::PopulatePending() const
+    {
+        // Categories declared by populators are appended, so this loop visits them too. Base
+        // categories of a layered reader were populated before it was copied.
+        for (size_t localIndex = 0; localIndex < m_CategoryDescs.size(); ++localIndex)
+        {
+            if (m_CategoryDescs[localIndex].Populator)
+                PopulateCategory(CategoryHandle(GetBaseCategoryCount() + localIndex, m_Generation));
+        }
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CCommandReader::GrowUsageCounters() const
+    {
+        // Declarations are not made while the reader is shared, so nothing is counting concurrently
+        if (m_CategoryUsage && m_CategoryUsage->GetSize() < GetCategoryCount())
+            m_CategoryUsage = std::make_unique<CUsageCounters>(GetCategoryCount(), m_CategoryUsage.get());
+        if (m_OptionUsage && m_OptionUsage->GetSize() < GetOptionCount())
+            m_OptionUsage = std::make_unique<CUsageCounters>(GetOptionCount(), m_OptionUsage.get());
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CCommandReader::EnableUsageCounters()
+    {
+        if (m_CategoryUsage)
+            return;
+        m_CategoryUsage = std::make_unique<CUsageCounters>(GetCategoryCount());
+        m_OptionUsage = std::make_unique<CUsageCounters>(GetOptionCount());
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CCommandReader::ResetUsageCounters()
+    {
+        if (m_CategoryUsage)
+        {
+            m_CategoryUsage->Reset();
+            m_OptionUsage->Reset();
+        }
+    }
+
+    //------------------------------------------------------------------------------------------------
+    std::vector<UsageCount> CCommandReader::GetUsageCounts() const
+    {
+        const SchemaImage &schema = EnsureFrozen();
+        auto count = [](const std::unique_ptr<CUsageCounters> &counters, size_t index)
+        {
+            return counters && index < counters->GetSize() ? counters->Get(index) : 0;
+        };
+
+        std::vector<std::string> categoryPaths(schema.GetCategoryCount());
+        std::vector<UsageCount> counts;
+        counts.reserve(schema.GetCategoryCount() + schema.GetOptionCount());
+        for (size_t index = 0; index < schema.GetCategoryCount(); ++index)
+        {
+            // Parents are declared before their sub-categories
+            const SchemaImage::Category &category = schema.GetCategory(index);
+            std::string &path = categoryPaths[index];
+            if (category.Parent != SchemaImage::NoIndex)
+                path = categoryPaths[category.Parent] + ' ';
+            path += schema.GetString(category.Name);
+            counts.push_back({ ArgumentType::Category, IndexType(index), path, count(m_CategoryUsage, index) });
+        }
+
+        for (size_t index = 0; index < schema.GetOptionCount(); ++index)
+        {
+            const SchemaImage::Option &option = schema.GetOption(index);
+            ArgumentType type = ArgumentType(option.Type);
+            std::string path = categoryPaths[option.Category];
+            path += type == ArgumentType::Parameter ? " <" : " --";
+            path += schema.GetString(option.Name);
+            if (type == ArgumentType::Parameter)
+                path += '>';
+            counts.push_back({ type, IndexType(index), path, count(m_OptionUsage, index) });
+        }
+        return counts;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CCommandReader::WriteUsageCounts(std::ostream &out) const
+    {
+        for (const UsageCount &usage : GetUsageCounts())
+            out << usage.Count << ' ' << usage.Path << '\n';
+    }
+
+    //------------------------------------------------------------------------------------------------
+    CCommandReader::CCommandReader(const CCommandReader &base) :
+        m_ResponseFileMaxDepth(base.m_ResponseFileMaxDepth),
+        m_PrefixMatching(base.m_PrefixMatching),
+        m_ParameterSinks(base.m_ParameterSinks),
+        m_ParseObserver(base.m_ParseObserver)
+    {
+        base.PopulatePending();
+        base.EnsureFrozen();
+        {
+            std::lock_guard<std::mutex> lock(base.m_FreezeMutex);
+            m_BaseSchema = base.m_Schema;
+        }
+        m_SchemaFingerprint = base.m_SchemaFingerprint;
+        m_Generation = base.m_Generation;
+
+        // Until something is declared the base schema serves as is
+        m_Schema = m_BaseSchema;
+        m_Frozen.store(true, std::memory_order_release);
+
+        std::lock_guard<std::mutex> lock(base.m_CatalogMutex);
+        m_Catalog.Path = base.m_Catalog.Path;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    CCommandReader::CCommandReader(CCommandReader &&other) noexcept
+    {
+        MoveFrom(other);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    CCommandReader &CCommandReader::operator=(CCommandReader &&other) noexcept
+    {
+        if (this != &other)
+            MoveFrom(other);
+        return *this;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CCommandReader::MoveFrom(CCommandReader &other)
+    {
+        // The interned string set hashes through its reader, so rebuild it once the strings it
+        // refers to have moved
+        m_StringPool = std::move(other.m_StringPool);
+        m_BaseSchema = std::move(other.m_BaseSchema);
+        m_InternedStrings = InternedStringSet(other.m_InternedStrings.bucket_count(), PooledStringHasher{ this }, PooledStringEqual{ this });
+        m_InternedStrings.insert(other.m_InternedStrings.begin(), other.m_InternedStrings.end());
+        other.m_InternedStrings.clear();
+
+        m_DeclaredOptionNames = std::move(other.m_DeclaredOptionNames);
+        m_BaseCategoryDeltas = std::move(other.m_BaseCategoryDeltas);
+        m_CategoryDescs = std::move(other.m_CategoryDescs);
+        m_OptionsDescs = std::move(other.m_OptionsDescs);
+        m_LastReadError = std::move(other.m_LastReadError);
+        m_ResponseFileMaxDepth = other.m_ResponseFileMaxDepth;
+        m_PrefixMatching = other.m_PrefixMatching;
+        m_SchemaFingerprint = other.m_SchemaFingerprint;
+        m_Generation = other.m_Generation;
+        m_Schema = std::move(other.m_Schema);
+        m_Frozen.store(other.m_Frozen.load(std::memory_order_acquire) && m_Schema, std::memory_order_release);
+        other.m_Frozen.store(false, std::memory_order_relaxed);
+        m_ParameterSinks = std::move(other.m_ParameterSinks);
+        m_ParseObserver = std::move(other.m_ParseObserver);
+        m_CategoryUsage = std::move(other.m_CategoryUsage);
+        m_OptionUsage = std::move(other.m_OptionUsage);
+        m_Catalog = std::move(other.m_Catalog);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    CCommandReader::CategoryDesc &CCommandReader::GetCategoryDesc(size_t categoryIndex)
+    {
+        size_t baseCount = GetBaseCategoryCount();
+        if (categoryIndex >= baseCount)
+            return m_CategoryDescs[categoryIndex - baseCount];
+
+        auto it = m_BaseCategoryDeltas.find(categoryIndex);
+        if (it == m_BaseCategoryDeltas.end())
+        {
+            const SchemaImage::Category &baseCategory = m_BaseSchema->GetCategory(categoryIndex);
+            CategoryHandle parent = baseCategory.Parent == SchemaImage::NoIndex ? NullCategory : CategoryHandle(baseCategory.Parent, m_Generation);
+            it = m_BaseCategoryDeltas.emplace(categoryIndex, CategoryDesc(parent, baseCategory.Name, baseCategory.Description)).first;
+        }
+        return it->second;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    Status CCommandReader::ReadCommandExpression(int argc, const char *argv[], CCommandExpression &commandExpression)
+    {
+        return ReadCommandExpression(argc, argv, commandExpression, m_LastReadError);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    Status CCommandReader::ReadCommandExpression(std::string_view nulSeparated, CCommandExpression &commandExpression, bool expandResponseFiles)
+    {
+        return ReadCommandExpression(nulSeparated, commandExpression, m_LastReadError, expandResponseFiles);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    Status CCommandReader::ReadCommandExpression(int argc, const char *argv[], CCommandExpression &commandExpression, ReadErrorDesc &error) const
+    {
+        ArgumentStream stream(argc, argv, m_ResponseFileMaxDepth, commandExpression.m_ResponseFiles);
+        return ReadArguments(stream, commandExpression, error);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    Status CCommandReader::ReadCommandExpression(std::string_view nulSeparated, CCommandExpression &commandExpression, ReadErrorDesc &error, bool expandResponseFiles) const
+    {
+        ArgumentStream stream(nulSeparated, NulSeparatedResponseFileDepth(expandResponseFiles), commandExpression.m_ResponseFiles);
+        return ReadArguments(stream, commandExpression, error);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    Status CCommandReader::ReadCommandSequence(int argc, const char *argv[], std::string_view separator, std::vector<CCommandExpression> &expressions)
+    {
+        return ReadCommandSequence(argc, argv, separator, expressions, m_LastReadError);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    Status CCommandReader::ReadCommandSequence(int argc, const char *argv[], std::string_view separator, std::vector<CCommandExpression> &expressions, ReadErrorDesc &error) const
+    {
+        expressions.clear();
+        std::vector<std::shared_ptr<const CMappedFile>> responseFiles;
+        ArgumentStream stream(argc, argv, m_ResponseFileMaxDepth, responseFiles);
+        stream.SetSeparator(separator);
+
+        Status status;
+        do
+        {
+            expressions.emplace_back();
+            status = ReadArguments(stream, expressions.back(), error);
+        } while (status == Status::Success && stream.ResumeAfterSeparator());
+
+        // Any expression's rest parameters may refer to the response files, including those of
+        // expressions left in place by an error
+        if (!responseFiles.empty())
+        {
+            for (auto &expression : expressions)
+                expression.m_ResponseFiles = responseFiles;
+        }
+
+        return status;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CCommandReader::ReadCommandExpressions(
+        const std::vector<std::string_view> &buffers,
+        std::vector<CCommandExpression> &expressions,
+        std::vector<ReadErrorDesc> &errors,
+        unsigned threadCount,
+        bool expandResponseFiles) const
+    {
+        expressions.clear();
+        expressions.resize(buffers.size());
+        errors.resize(buffers.size());
+
+        // Populators and schema compiles replace the schema the workers read through, so finish
+        // them before the workers start
+        PopulatePending();
+        EnsureFrozen();
+
+        if (threadCount == 0)
+            threadCount = std::max(1u, std::thread::hardware_concurrency());
+        threadCount = unsigned(std::min<size_t>(threadCount, buffers.size()));
+
+        // Workers claim buffers in small batches to keep the shared counter off the hot path
+        static const size_t batchSize = 16;
+        std::atomic<size_t> next{ 0 };
+        auto worker = [&]()
+        {
+            for (;;)
+            {
+                size_t first = next.fetch_add(batchSize, std::memory_order_relaxed);
+                if (first >= buffers.size())
+                    break;
+                size_t last = std::min(first + batchSize, buffers.size());
+                for (size_t i = first; i < last; ++i)
+                    ReadCommandExpression(buffers[i], expressions[i], errors[i], expandResponseFiles);
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (unsigned t = 1; t < threadCount; ++t)
+            threads.emplace_back(worker);
+        worker();
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+    //------------------------------------------------------------------------------------------------
+    struct CCommandReader::ExpressionBuilder
+    {
+        const CCommandReader &m_Reader;
+        CCommandExpression &m_Expression;
+        ReadErrorDesc &m_Error;
+
+        // Counts a new map node, plus the value's buffer when it is too long to store inline
+        static size_t ValueAllocations(bool inserted, std::string_view value)
+        {
+            static const size_t inlineCapacity = std::string().capacity();
+            return inserted ? 1 + (value.size() > inlineCapacity ? 1 : 0) : 0;
+        }
+
+        void OnCategory(CategoryHandle category)
+        {
+            CountUsage(m_Reader.m_CategoryUsage, category.m_Value);
+            [[maybe_unused]] size_t capacity = m_Expression.m_CategoryLevels.capacity();
+            m_Expression.AddCategoryLevel(category);
+            IN_COMMAND_COUNT(Allocations, m_Expression.m_CategoryLevels.capacity() != capacity);
+        }
+
+        void OnSwitch(SwitchHandle option)
+        {
+            CountUsage(m_Reader.m_OptionUsage, option.m_Value);
+            [[maybe_unused]] bool inserted = m_Expression.m_Switches.emplace(option).second;
+            IN_COMMAND_COUNT(Allocations, inserted);
+        }
+
+        void OnVariable(VariableHandle option, const ArgumentToken &value)
+        {
+            CountUsage(m_Reader.m_OptionUsage, option.m_Value);
+            [[maybe_unused]] bool inserted = m_Expression.m_VariableMap.emplace(option, value.Value).second;
+            IN_COMMAND_COUNT(Allocations, ValueAllocations(inserted, value.Value));
+        }
+
+        void OnParameter(ParameterHandle parameter, const ArgumentToken &value, bool isRest)
+        {
+            CountUsage(m_Reader.m_OptionUsage, parameter.m_Value);
+            const std::vector<ParameterSink> &sinks = m_Reader.m_ParameterSinks;
+            if (parameter.m_Value < sinks.size() && sinks[parameter.m_Value])
+                sinks[parameter.m_Value](value.Value);
+            else if (isRest)
+            {
+                [[maybe_unused]] size_t mapSize = m_Expression.m_RestParameterMap.size();
+                CParameterSpan &span = m_Expression.m_RestParameterMap[parameter];
+                [[maybe_unused]] size_t capacity = span.m_Segments.capacity();
+                span.Append(value.Format, value.ArgvElement, value.RawBegin, value.RawEnd, value.Frame, value.Ordinal);
+                IN_COMMAND_COUNT(Allocations, (m_Expression.m_RestParameterMap.size() != mapSize) + (span.m_Segments.capacity() != capacity));
+            }
+            else
+            {
+                [[maybe_unused]] bool inserted = m_Expression.m_ParameterMap.emplace(parameter, value.Value).second;
+                IN_COMMAND_COUNT(Allocations, ValueAllocations(inserted, value.Value));
+            }
+        }
+
+        Status OnError(Status status, const ArgumentToken &token, size_t contextIndex)
+        {
+            return SetReadError(m_Error, status, token, contextIndex);
+        }
+    };
+
+    //------------------------------------------------------------------------------------------------
+    struct CCommandReader::ValidationHandler
+    {
+        ValidationResult m_Result = { Status::Success, 0 };
+
+        void OnCategory(CategoryHandle) {}
+        void OnSwitch(SwitchHandle) {}
+        void OnVariable(VariableHandle, const ArgumentToken &) {}
+        void OnParameter(ParameterHandle, const ArgumentToken &, bool) {}
+
+        Status OnError(Status status, const ArgumentToken &token, size_t)
+        {
+            m_Result = { status, token.ArgIndex };
+            return status;
+        }
+    };
+
+    //------------------------------------------------------------------------------------------------
+    ValidationResult CCommandReader::Validate(int argc, const char *argv[]) const
+    {
+        std::vector<std::shared_ptr<const CMappedFile>> responseFiles;
+        ArgumentStream stream(argc, argv, m_ResponseFileMaxDepth, responseFiles);
+        ValidationHandler handler;
+        ReadTokens(stream, handler);
+        return handler.m_Result;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    ValidationResult CCommandReader::Validate(std::string_view nulSeparated, bool expandResponseFiles) const
+    {
+        std::vector<std::shared_ptr<const CMappedFile>> responseFiles;
+        ArgumentStream stream(nulSeparated, NulSeparatedResponseFileDepth(expandResponseFiles), responseFiles);
+        ValidationHandler handler;
+        ReadTokens(stream, handler);
+        return handler.m_Result;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    Status CCommandReader::ReadArguments(ArgumentStream &stream, CCommandExpression &commandExpression, ReadErrorDesc &error) const
+    {
+        error = { Status::Success, 0, "", ReadErrorDesc::NoContext, "", 0 };
+        commandExpression.m_Generation = m_Generation;
+        ExpressionBuilder builder{ *this, commandExpression, error };
+        return ReadTokens(stream, builder);
+    }
+
     //------------------------------------------------------------------------------------------------
-    static std::string StatusString(Status status)
+    static uint64_t HashBytes(uint64_t hash, const void *data, size_t size)
     {
-        switch (status)
+        // FNV-1a
+        const unsigned char *bytes = static_cast<const unsigned char *>(data);
+        for (size_t i = 0; i < size; ++i)
+            hash = (hash ^ bytes[i]) * 1099511628211ull;
+        return hash;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    static uint64_t MixHash(uint64_t hash)
+    {
+        // splitmix64 finalizer
+        hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ull;
+        hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebull;
+        return hash ^ (hash >> 31);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    static uint64_t HashOption(ArgumentType type, size_t handle)
+    {
+        uint64_t fields[2] = { uint64_t(type), uint64_t(handle) };
+        return HashBytes(14695981039346656037ull, fields, sizeof(fields));
+    }
+
+    //------------------------------------------------------------------------------------------------
+    static uint64_t HashValue(uint64_t hash, std::string_view value)
+    {
+        uint64_t size = value.size();
+        hash = HashBytes(hash, &size, sizeof(size));
+        return HashBytes(hash, value.data(), value.size());
+    }
+
+    //------------------------------------------------------------------------------------------------
+    uint64_t CCommandExpression::GetCanonicalHash() const
+    {
+        uint64_t pathHash = 14695981039346656037ull;
+        for (const auto &level : m_CategoryLevels)
         {
-        case Status::Success:
-            return "Success";
-        case Status::DuplicateCategory:
-            return "Duplicate category";
-        case Status::DuplicateOption:
-            return "Duplicate option";
-        case Status::UnexpectedArgument:
-            return "Unexpected argument";
-        case Status::UnknownOption:
-            return "Unknown option";
-        case Status::MissingVariableValue:
-            return "Missing variable value";
-        case Status::TooManyParameters:
-            return "Too many parameters";
-        case Status::InvalidValue:
-            return "Invalid value";
-        case Status::OutOfRange:
-            return "Out of range";
-        case Status::NotFound:
-            return "Not found";
-        case Status::InvalidHandle:
-            return "Invalid handle";
+            uint64_t category = HandleHasher<ArgumentType::Category>()(level.Category);
+            pathHash = HashBytes(pathHash, &category, sizeof(category));
         }
 
-        return "Unknown error";
+        // Options are combined with a sum of well-mixed per-option hashes, which does not depend on
+        // the order the unordered containers are iterated in
+        uint64_t optionsHash = 0;
+        for (SwitchHandle sh : m_Switches)
+            optionsHash += MixHash(HashOption(ArgumentType::Switch, HandleHasher<ArgumentType::Switch>()(sh)));
+        for (const auto &entry : m_VariableMap)
+            optionsHash += MixHash(HashValue(HashOption(ArgumentType::Variable, HandleHasher<ArgumentType::Variable>()(entry.first)), entry.second));
+        for (const auto &entry : m_ParameterMap)
+            optionsHash += MixHash(HashValue(HashOption(ArgumentType::Parameter, HandleHasher<ArgumentType::Parameter>()(entry.first)), entry.second));
+        for (const auto &entry : m_RestParameterMap)
+        {
+            // Rest parameter values keep their order
+            uint64_t hash = HashOption(ArgumentType::Parameter, HandleHasher<ArgumentType::Parameter>()(entry.first));
+            hash = HashBytes(hash, "*", 1);
+            for (std::string_view value : entry.second)
+                hash = HashValue(hash, value);
+            optionsHash += MixHash(hash);
+        }
+
+        return MixHash(pathHash ^ MixHash(optionsHash));
     }
-    
+
     //------------------------------------------------------------------------------------------------
-    size_t CCommandReader::AddVariableOrSwitchOption(
-        ArgumentType type,
-        CategoryHandle category,
-        const std::string &name,
-        char shortName,
-        const std::vector<std::string> &domain,
-        const std::string &description)
+    std::shared_ptr<const CCommandExpression> CExpressionCache::ReadCommandExpression(int argc, const char *argv[], ReadErrorDesc &error)
     {
-        if (category.m_Value >= m_CategoryDescs.size())
-            throw Exception(Status::InvalidHandle);
+        auto entry = std::make_shared<Entry>();
+        bool cacheable = m_Capacity > 0;
+        for (int i = 0; i < argc; ++i)
+        {
+            entry->Arguments.append(argv[i]);
+            entry->Arguments.push_back('\0');
+            if (i > 0 && argv[i][0] == '@' && m_Reader.GetResponseFileMaxDepth() > 0)
+                cacheable = false;
+        }
+
+        if (cacheable)
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            auto it = m_EntryMap.find(entry->Arguments);
+            if (it != m_EntryMap.end())
+            {
+                m_Entries.splice(m_Entries.begin(), m_Entries, it->second);
+                error = { Status::Success, 0, "", ReadErrorDesc::NoContext, "", 0 };
+                const std::shared_ptr<Entry> &cached = *it->second;
+                return std::shared_ptr<const CCommandExpression>(cached, &cached->Expression);
+            }
+        }
 
-        auto &categoryDesc = m_CategoryDescs[category.m_Value];
+        // Read outside the lock so misses on different threads proceed concurrently. The copy
+        // stands in for argv, so its response files expand as argv's would.
+        if (m_Reader.ReadCommandExpression(entry->Arguments, entry->Expression, error, m_Reader.GetResponseFileMaxDepth() > 0) != Status::Success)
+            return nullptr;
 
-        if (categoryDesc.OptionDescIndexByNameMap.find(name) != categoryDesc.OptionDescIndexByNameMap.end())
-            throw Exception(Status::DuplicateOption);
+        if (cacheable)
+        {
+            std::lock_guard<std::mutex> lock(m_Mutex);
+            if (m_EntryMap.find(entry->Arguments) == m_EntryMap.end())
+            {
+                m_Entries.push_front(entry);
+                m_EntryMap.emplace(entry->Arguments, m_Entries.begin());
+                if (m_Entries.size() > m_Capacity)
+                {
+                    m_EntryMap.erase(m_Entries.back()->Arguments);
+                    m_Entries.pop_back();
+                }
+            }
+        }
 
-        size_t optionIndex = m_OptionsDescs.size();
-        if(type == ArgumentType::Variable && domain.size() > 0)
-            m_OptionsDescs.emplace_back(ArgumentType::Variable, name, description, domain);
-        else
-            m_OptionsDescs.emplace_back(type, name, description);
+        return std::shared_ptr<const CCommandExpression>(entry, &entry->Expression);
+    }
 
-        categoryDesc.OptionDescIndexByNameMap.emplace(name, optionIndex);
-        if (shortName != '-')
-            categoryDesc.OptionDescIndexByShortNameMap.emplace(shortName, optionIndex);
+    //------------------------------------------------------------------------------------------------
+    CReloadableReader::CReloadableReader(std::unique_ptr<CCommandReader> reader) :
+        m_Current(nullptr)
+    {
+        Publish(std::move(reader));
+    }
 
-        return optionIndex;
+    //------------------------------------------------------------------------------------------------
+    CReloadableReader::~CReloadableReader()
+    {
+        // Pinned readers still holding the current version destroy it when released
+        Retire(m_Current.load(std::memory_order_acquire));
     }
 
     //------------------------------------------------------------------------------------------------
-    Status CCommandReader::ReadCommandExpression(int argc, const char *argv[], CCommandExpression &commandExpression)
+    std::unique_ptr<CCommandReader> CReloadableReader::CreateVersion(const std::string &appName)
+    {
+        auto reader = std::make_unique<CCommandReader>(appName);
+        reader->m_Generation = CCommandReader::NextGeneration();
+        return reader;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CReloadableReader::Publish(std::unique_ptr<CCommandReader> reader)
+    {
+        // Versions are read from several threads at once, so nothing may be left to do on first use
+        reader->PopulateAll();
+        reader->Freeze();
+
+        Version *version = new Version;
+        version->Reader = std::move(reader);
+
+        std::lock_guard<std::mutex> lock(m_PublishMutex);
+        Version *previous = m_Current.exchange(version, std::memory_order_seq_cst);
+        if (!previous)
+            return;
+
+        // Grace period: once no Acquire is between loading m_Current and pinning, every read that
+        // loaded the previous version has pinned it. New acquires count themselves on the current
+        // parity, so draining the other parity and then flipping and draining this one only waits
+        // for acquires already in progress, however busy the readers are.
+        size_t parity = m_Parity.load(std::memory_order_relaxed);
+        WaitForAcquires(parity ^ 1);
+        m_Parity.store(parity ^ 1, std::memory_order_seq_cst);
+        WaitForAcquires(parity);
+        Retire(previous);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CReloadableReader::WaitForAcquires(size_t parity) const
     {
-        m_LastReadError = { Status::Success, 0, "", "" };
-        bool ignoreSwitchesAndVariables = false;
-        size_t categoryIndex = 0;
-        size_t levelIndex = commandExpression.AddCategoryLevel(RootCategory);
-        // Assume the first argument is the app name so select the root category
-        for (int i = 1; i < argc; ++i)
+        for (AcquireStripe &stripe : m_Acquiring)
         {
-            auto &categoryLevel = commandExpression.m_CategoryLevels[levelIndex];
+            while (stripe.Count[parity].load(std::memory_order_seq_cst) != 0)
+                std::this_thread::yield();
+        }
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CReloadableReader::Retire(Version *version)
+    {
+        // No read pins the version any more, so only releases change its stripes from here on
+        intptr_t pins = 0;
+        for (PinStripe &stripe : version->Pins)
+            pins += stripe.Count.exchange(FoldedStripe, std::memory_order_acq_rel);
+        if (version->Folded.fetch_add(pins - FoldBias, std::memory_order_acq_rel) == FoldBias - pins)
+            delete version;
+    }
 
-            std::string arg(argv[i]);
-            CategoryDesc &categoryDesc = m_CategoryDescs[categoryIndex];
+    //------------------------------------------------------------------------------------------------
+    Status CReloadableReader::ReadCommandExpression(int argc, const char *argv[], CCommandExpression &commandExpression, std::string &errorString) const
+    {
+        CPinnedReader reader = Acquire();
+        ReadErrorDesc error;
+        errorString.clear();
+        Status status = reader->ReadCommandExpression(argc, argv, commandExpression, error);
+        reader->FormatReadError(error, errorString);
+        return status;
+    }
 
-            // Is this a variable or switch?
-            if (!ignoreSwitchesAndVariables && arg[0] == '-')
-            {
-                size_t optionIndex;
+    //------------------------------------------------------------------------------------------------
+    Status CReloadableReader::ReadCommandExpression(std::string_view nulSeparated, CCommandExpression &commandExpression, std::string &errorString, bool expandResponseFiles) const
+    {
+        CPinnedReader reader = Acquire();
+        ReadErrorDesc error;
+        errorString.clear();
+        Status status = reader->ReadCommandExpression(nulSeparated, commandExpression, error, expandResponseFiles);
+        reader->FormatReadError(error, errorString);
+        return status;
+    }
 
-                // Is this a short or long name
-                if (arg[1] == '-')
-                {
-                    // Long name
-                    std::string name(arg.substr(2));
-                    if (name.empty())
-                    {
-                        ignoreSwitchesAndVariables = true;
-                        continue;
-                    }
-                    
-                    auto it = categoryDesc.OptionDescIndexByNameMap.find(name);
-                    if (it == categoryDesc.OptionDescIndexByNameMap.end())
-                        return SetLastReadError(Status::UnknownOption, i, argv, nullptr);
-                    
-                    optionIndex = it->second;
-                }
-                else
-                {
-                    // Short name
-                    if (arg[1] == '\0' || arg[2] != '\0')
-                        return SetLastReadError(Status::UnexpectedArgument, i, argv, nullptr);
-                    
-                    auto it = categoryDesc.OptionDescIndexByShortNameMap.find(arg[1]);
-                    if (it == categoryDesc.OptionDescIndexByShortNameMap.end())
-                        return SetLastReadError(Status::UnknownOption, i, argv, nullptr);
-
-                    optionIndex = it->second;
-                }
+    //------------------------------------------------------------------------------------------------
+    static void AppendU32(std::string &blob, size_t value)
+    {
+        uint32_t u32 = uint32_t(value);
+        blob.append(reinterpret_cast<const char *>(&u32), sizeof(u32));
+    }
 
-                const OptionDesc &optionDesc = m_OptionsDescs.at(optionIndex);
+    //------------------------------------------------------------------------------------------------
+    template<typename Map>
+    static void AppendSortedValues(std::string &blob, const Map &map)
+    {
+        // Sort by handle so equal expressions serialize identically
+        std::vector<std::pair<size_t, std::string_view>> entries;
+        for (const auto &entry : map)
+            entries.emplace_back(typename Map::hasher()(entry.first), entry.second);
+        std::sort(entries.begin(), entries.end());
 
-                if (optionDesc.Type == ArgumentType::Variable)
-                {
-                    // Read the value
-                    ++i;
-                    if (i == argc)
-                        return SetLastReadError(Status::MissingVariableValue, i - 1, argv, &optionDesc);
-                    
-                    std::string value(argv[i]);
+        AppendU32(blob, entries.size());
+        for (const auto &entry : entries)
+        {
+            AppendU32(blob, entry.first);
+            AppendU32(blob, entry.second.size());
+            blob.append(entry.second);
+        }
+    }
 
-                    if(value[0] == '-')
-                        return SetLastReadError(Status::MissingVariableValue, i - 1, argv, &optionDesc);
+    //------------------------------------------------------------------------------------------------
+    void CCommandReader::SerializeExpression(const CCommandExpression &commandExpression, std::string &blob) const
+    {
+        blob.clear();
+        AppendU32(blob, CSerializedExpression::Magic);
+        AppendU32(blob, CSerializedExpression::Version);
+        blob.append(reinterpret_cast<const char *>(&m_SchemaFingerprint), sizeof(m_SchemaFingerprint));
 
-                    if (optionDesc.Domain.size() > 0)
-                    {
-                        // Verify the value is in the declared domain
-                        auto dit = optionDesc.Domain.find(value);
+        AppendU32(blob, commandExpression.m_CategoryLevels.size());
+        for (const auto &level : commandExpression.m_CategoryLevels)
+            AppendU32(blob, level.Category.m_Value);
 
-                        if (dit == optionDesc.Domain.end())
-                            return SetLastReadError(Status::InvalidValue, i, argv, &optionDesc);
-                    }
-                    
-                    commandExpression.m_VariableMap.emplace(VariableHandle(optionIndex), value);
-                }
-                else
-                {
-                    commandExpression.m_Switches.emplace(SwitchHandle(optionIndex));
-                }
+        std::vector<uint64_t> switchBits;
+        for (SwitchHandle sh : commandExpression.m_Switches)
+        {
+            if (sh.m_Value / 64 >= switchBits.size())
+                switchBits.resize(sh.m_Value / 64 + 1);
+            switchBits[sh.m_Value / 64] |= uint64_t(1) << (sh.m_Value % 64);
+        }
+        AppendU32(blob, switchBits.size());
+        blob.append(reinterpret_cast<const char *>(switchBits.data()), switchBits.size() * sizeof(uint64_t));
+
+        AppendSortedValues(blob, commandExpression.m_VariableMap);
+        AppendSortedValues(blob, commandExpression.m_ParameterMap);
+
+        std::vector<std::pair<size_t, const CParameterSpan *>> restEntries;
+        for (const auto &entry : commandExpression.m_RestParameterMap)
+            restEntries.emplace_back(entry.first.m_Value, &entry.second);
+        std::sort(restEntries.begin(), restEntries.end());
+
+        AppendU32(blob, restEntries.size());
+        for (const auto &entry : restEntries)
+        {
+            AppendU32(blob, entry.first);
+            AppendU32(blob, entry.second->size());
+            size_t lengthOffset = blob.size();
+            AppendU32(blob, 0);
+            size_t valuesOffset = blob.size();
+            for (std::string_view value : *entry.second)
+            {
+                blob.append(value);
+                blob.push_back('\0');
             }
-            else
+            uint32_t length = uint32_t(blob.size() - valuesOffset);
+            std::memcpy(&blob[lengthOffset], &length, sizeof(length));
+        }
+    }
+
+    //------------------------------------------------------------------------------------------------
+    Status CSerializedExpression::Open(const CCommandReader &reader, std::string_view blob)
+    {
+        m_Blob = std::string_view();
+        size_t offset = 0;
+        auto read = [&](size_t size, const char *&p)
+        {
+            if (blob.size() - offset < size)
+                return false;
+            p = blob.data() + offset;
+            offset += size;
+            return true;
+        };
+
+        const char *p;
+        if (!read(16, p) || ReadU32(p) != Magic || ReadU32(p + 4) != Version)
+            return Status::InvalidFormat;
+
+        uint64_t fingerprint;
+        std::memcpy(&fingerprint, p + 8, sizeof(fingerprint));
+        if (fingerprint != reader.GetSchemaFingerprint())
+            return Status::SchemaMismatch;
+
+        m_CategoryOffset = offset;
+        if (!read(4, p) || ReadU32(p) == 0 || !read(size_t(ReadU32(p)) * 4, p))
+            return Status::InvalidFormat;
+
+        m_SwitchOffset = offset;
+        if (!read(4, p) || !read(size_t(ReadU32(p)) * 8, p))
+            return Status::InvalidFormat;
+
+        size_t *valueSections[] = { &m_VariableOffset, &m_ParameterOffset };
+        for (size_t *sectionOffset : valueSections)
+        {
+            *sectionOffset = offset;
+            if (!read(4, p))
+                return Status::InvalidFormat;
+            for (uint32_t count = ReadU32(p); count > 0; --count)
             {
-                // Is this a sub-category?
-                auto it = categoryDesc.SubCategoryMap.find(argv[i]);
-                if (it != categoryDesc.SubCategoryMap.end())
-                {
-                    levelIndex = commandExpression.AddCategoryLevel(it->second);
-                    categoryIndex = it->second.m_Value;
-                }
-                else
-                {
-                    if (categoryLevel.ParameterCount == categoryDesc.ParameterIds.size())
-                    {
-                        return SetLastReadError(Status::UnexpectedArgument, i, argv, argv[i]);
-                    }
-                    else
-                    {
-                        ParameterHandle parameter = ParameterHandle(categoryDesc.ParameterIds[categoryLevel.ParameterCount]);
-                        commandExpression.m_ParameterMap.emplace(parameter, argv[i]);
-                        categoryLevel.ParameterCount++;
-                    }
-                }
+                if (!read(8, p) || !read(ReadU32(p + 4), p))
+                    return Status::InvalidFormat;
             }
         }
 
+        m_RestOffset = offset;
+        if (!read(4, p))
+            return Status::InvalidFormat;
+        for (uint32_t count = ReadU32(p); count > 0; --count)
+        {
+            if (!read(12, p))
+                return Status::InvalidFormat;
+            uint32_t valueCount = ReadU32(p + 4);
+            uint32_t length = ReadU32(p + 8);
+            const char *values;
+            if (!read(length, values) || size_t(std::count(values, values + length, '\0')) != valueCount)
+                return Status::InvalidFormat;
+        }
+
+        if (offset != blob.size())
+            return Status::InvalidFormat;
+
+        m_Blob = blob;
         return Status::Success;
     }
 
     //------------------------------------------------------------------------------------------------
     std::string CCommandReader::SimpleUsageString(CategoryHandle category) const
     {
+        IN_COMMAND_TRACE_SPAN("SimpleUsageString");
+        size_t categoryIndex = HandleIndex(category);
+        if (EnsureFrozen().GetCategory(categoryIndex).Deferred)
+            PopulateCategory(category);
         std::ostringstream s;
-        const CategoryDesc &catDesc = m_CategoryDescs[category.m_Value];
 
-        for (auto it = catDesc.SubCategoryMap.begin(); it != catDesc.SubCategoryMap.end(); ++it)
+        // Held, since sub-category populators replace the compiled schema
+        std::shared_ptr<const SchemaImage> schema = m_Schema;
+        for (uint32_t subCategory : schema->GetWords(schema->GetCategory(categoryIndex).SubCategories))
         {
-            s << SimpleUsageString(it->second);
+            s << SimpleUsageString(CategoryHandle(subCategory, m_Generation));
         }
 
-        std::stack<CategoryHandle> categoryStack;
-        for (CategoryHandle ch = category; ch != NullCategory; ch = m_CategoryDescs[ch.m_Value].Parent)
+        schema = m_Schema;
+        const SchemaImage::Category &catDesc = schema->GetCategory(categoryIndex);
+
+        std::stack<size_t> categoryStack;
+        for (size_t ch = categoryIndex; ch != SchemaImage::NoIndex; ch = schema->GetCategory(ch).Parent)
         {
             categoryStack.push(ch);
         }
 
         while (!categoryStack.empty())
         {
-            s << m_CategoryDescs[categoryStack.top().m_Value].Name;
+            s << schema->GetString(schema->GetCategory(categoryStack.top()).Name);
             categoryStack.pop();
             s << " ";
         }
 
         // Parameters
-        for (auto it = catDesc.ParameterIds.begin(); it != catDesc.ParameterIds.end(); ++it)
+        for (uint32_t parameterId : schema->GetWords(catDesc.ParameterIds))
         {
-            const OptionDesc &parameterDesc = m_OptionsDescs[*it];
-            s << "[<" << parameterDesc.Name << ">]";
+            const SchemaImage::Option &parameterDesc = schema->GetOption(parameterId);
+            s << "[<" << schema->GetString(parameterDesc.Name) << ">]";
             s << " ";
         }
 
-        // Switches and Variables
-        for (auto it = catDesc.OptionDescIndexByNameMap.begin(); it != catDesc.OptionDescIndexByNameMap.end(); ++it)
+        if (catDesc.RestParameterId != SchemaImage::NoIndex)
+            s << "[<" << schema->GetString(schema->GetOption(catDesc.RestParameterId).Name) << ">...] ";
+
+        // Switches and Variables, including inherited options
+        for (uint32_t optionId : schema->GetWords(catDesc.SortedNames))
         {
-            const OptionDesc &desc = m_OptionsDescs[it->second];
-            s << "[--" << desc.Name;
-            if (desc.Type == ArgumentType::Variable)
+            const SchemaImage::Option &desc = schema->GetOption(optionId);
+            s << "[--" << schema->GetString(desc.Name);
+            if (ArgumentType(desc.Type) == ArgumentType::Variable)
                 s << " <value>";
             s << "] ";
         }
@@ -225,36 +1922,50 @@ namespace InCommand
 
     std::string CCommandReader::OptionDetailsString(CategoryHandle category) const
     {
+        IN_COMMAND_TRACE_SPAN("OptionDetailsString");
+        size_t categoryIndex = HandleIndex(category);
+        if (EnsureFrozen().GetCategory(categoryIndex).Deferred)
+            PopulateCategory(category);
         std::ostringstream s;
-        const CategoryDesc &catDesc = m_CategoryDescs[category.m_Value];
+        std::shared_ptr<const SchemaImage> schema = m_Schema;
+        const SchemaImage::Category &catDesc = schema->GetCategory(categoryIndex);
         static const int colwidth = 30;
 
         // For the given category level, list out all options with
         // a non-empty description.
 
         // Parameters
-        for (auto it = catDesc.ParameterIds.begin(); it != catDesc.ParameterIds.end(); ++it)
+        for (uint32_t parameterId : schema->GetWords(catDesc.ParameterIds))
+        {
+            const SchemaImage::Option &parameterDesc = schema->GetOption(parameterId);
+            if (parameterDesc.Description.Length > 0)
+            {
+                s << std::setw(colwidth) << std::left << "  " + std::string(schema->GetString(parameterDesc.Name)) << GetDescription(schema->GetString(parameterDesc.Description)) << std::endl;
+            }
+        }
+
+        if (catDesc.RestParameterId != SchemaImage::NoIndex)
         {
-            const OptionDesc &parameterDesc = m_OptionsDescs[*it];
-            if (!parameterDesc.Description.empty())
+            const SchemaImage::Option &parameterDesc = schema->GetOption(catDesc.RestParameterId);
+            if (parameterDesc.Description.Length > 0)
             {
-                s << std::setw(colwidth) << std::left << "  " + parameterDesc.Name << parameterDesc.Description << std::endl;
+                s << std::setw(colwidth) << std::left << "  " + std::string(schema->GetString(parameterDesc.Name)) + "..." << GetDescription(schema->GetString(parameterDesc.Description)) << std::endl;
             }
         }
 
-        // Switches and Variables
-        for (auto it = catDesc.OptionDescIndexByNameMap.begin(); it != catDesc.OptionDescIndexByNameMap.end(); ++it)
+        // Switches and Variables, including inherited options
+        for (uint32_t optionId : schema->GetWords(catDesc.SortedNames))
         {
-            const OptionDesc &desc = m_OptionsDescs[it->second];
-            if (!desc.Description.empty())
+            const SchemaImage::Option &desc = schema->GetOption(optionId);
+            if (desc.Description.Length > 0)
             {
-                s << std::setw(colwidth) << std::left << "  --" + desc.Name;
-                if (desc.Name.length() + 4 > colwidth)
+                s << std::setw(colwidth) << std::left << "  --" + std::string(schema->GetString(desc.Name));
+                if (desc.Name.Length + 4 > colwidth)
                 {
                     s << std::endl;
                     s << std::setw(colwidth) << ' ';
                 }
-                s << desc.Description << std::endl;
+                s << GetDescription(schema->GetString(desc.Description)) << std::endl;
             }
         }
 
@@ -263,23 +1974,177 @@ namespace InCommand
         return s.str();
     }
 
+    //------------------------------------------------------------------------------------------------
+    // Levenshtein distance from a pattern of up to 64 characters to text, using the bit-parallel
+    // algorithm of Myers in Hyyro's formulation. peq holds the pattern positions of each character.
+    // Stops early and returns maxDistance + 1 once the distance cannot fall back to maxDistance.
+    static size_t EditDistance(const uint64_t (&peq)[256], size_t patternLength, std::string_view text, size_t maxDistance)
+    {
+        uint64_t pv = ~uint64_t(0);
+        uint64_t mv = 0;
+        uint64_t lastBit = uint64_t(1) << (patternLength - 1);
+        size_t distance = patternLength;
+        for (size_t i = 0; i < text.size(); ++i)
+        {
+            uint64_t eq = peq[uint8_t(text[i])];
+            uint64_t xv = eq | mv;
+            uint64_t xh = (((eq & pv) + pv) ^ pv) | eq;
+            uint64_t ph = mv | ~(xh | pv);
+            uint64_t mh = pv & xh;
+            if (ph & lastBit)
+                ++distance;
+            else if (mh & lastBit)
+                --distance;
+
+            // Each remaining character lowers the distance by at most one
+            if (distance > maxDistance + (text.size() - i - 1))
+                return maxDistance + 1;
+
+            ph = (ph << 1) | 1;
+            mh <<= 1;
+            pv = mh | ~(xv | ph);
+            mv = ph & xv;
+        }
+        return distance;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    // Finds the candidate names nearest to a mistyped token. Only names within about a third of the
+    // token's length in edits are suggested, and only those at the smallest distance found.
+    class SuggestionFinder
+    {
+        uint64_t m_Peq[256] = {};
+        size_t m_PatternLength;
+        size_t m_MaxDistance;
+        std::vector<std::string_view> m_Names;
+
+    public:
+        explicit SuggestionFinder(std::string_view token) :
+            m_PatternLength(token.size()),
+            m_MaxDistance(std::min<size_t>((token.size() + 2) / 3, 4))
+        {
+            if (m_PatternLength > 64)
+                m_PatternLength = 0; // Too long to be a typo of a declared name
+
+            for (size_t i = 0; i < m_PatternLength; ++i)
+                m_Peq[uint8_t(token[i])] |= uint64_t(1) << i;
+        }
+
+        void Consider(std::string_view name)
+        {
+            if (m_PatternLength == 0)
+                return;
+
+            size_t lengthDifference = name.size() > m_PatternLength ? name.size() - m_PatternLength : m_PatternLength - name.size();
+            if (lengthDifference > m_MaxDistance)
+                return;
+
+            size_t distance = EditDistance(m_Peq, m_PatternLength, name, m_MaxDistance);
+            if (distance > m_MaxDistance)
+                return;
+
+            // Only keep the nearest names
+            if (distance < m_MaxDistance || m_Names.empty())
+            {
+                m_MaxDistance = distance;
+                m_Names.clear();
+            }
+            m_Names.push_back(name);
+        }
+
+        void Append(std::string &errorString, std::string_view prefix) const
+        {
+            if (m_Names.empty())
+                return;
+
+            if (m_Names.size() == 1)
+            {
+                errorString += "\nDid you mean '";
+                errorString += prefix;
+                errorString += m_Names[0];
+                errorString += "'?";
+                return;
+            }
+
+            std::vector<std::string_view> names(m_Names);
+            std::sort(names.begin(), names.end());
+            errorString += "\nDid you mean one of these?";
+            for (std::string_view name : names)
+            {
+                errorString += "\n  ";
+                errorString += prefix;
+                errorString += name;
+            }
+        }
+    };
+
+    //------------------------------------------------------------------------------------------------
+    void CCommandReader::AppendSuggestions(const ReadErrorDesc &error, std::string &errorString) const
+    {
+        const SchemaImage &schema = EnsureFrozen();
+        if (error.ContextIndex >= schema.GetCategoryCount())
+            return;
+        const SchemaImage::Category *categoryDesc = &schema.GetCategory(error.ContextIndex);
+
+        std::string_view arg = error.ArgString;
+        if (!arg.empty() && arg[0] == '-')
+        {
+            // Mistyped long option, or a long option written with a single dash
+            size_t nameBegin = arg.find_first_not_of('-');
+            if (nameBegin == std::string_view::npos || arg.size() - nameBegin < 2)
+                return;
+
+            SuggestionFinder finder(arg.substr(nameBegin));
+            for (uint32_t optionIndex : schema.GetWords(categoryDesc->SortedNames))
+                finder.Consider(schema.GetString(schema.GetOption(optionIndex).Name));
+            finder.Append(errorString, "--");
+        }
+        else
+        {
+            SuggestionFinder finder(arg);
+            for (uint32_t subCategory : schema.GetWords(categoryDesc->SubCategories))
+                finder.Consider(schema.GetString(schema.GetCategory(subCategory).Name));
+            finder.Append(errorString, "");
+        }
+    }
+
+    //------------------------------------------------------------------------------------------------
     Status CCommandReader::GetLastReadError(std::string &errorString) const
     {
-        switch (m_LastReadError.ErrorStatus)
+        return FormatReadError(m_LastReadError, errorString);
+    }
+
+    Status CCommandReader::FormatReadError(const ReadErrorDesc &error, std::string &errorString) const
+    {
+        IN_COMMAND_TRACE_SPAN("FormatReadError");
+        IN_COMMAND_TIME_PHASE(FormatNanoseconds);
+        switch (error.ErrorStatus)
         {
         case Status::Success:
             return Status::Success;
 
         case Status::InvalidValue: {
             std::ostringstream oss;
-            const OptionDesc *optionDescPtr = reinterpret_cast<const OptionDesc *>(m_LastReadError.ContextPtr);
-            oss << "Invalid value '" << m_LastReadError.ArgString << "' for variable '--" << optionDescPtr->Name << "'" << std::endl;
+            const SchemaImage &schema = EnsureFrozen();
+            if (error.ContextIndex >= schema.GetOptionCount())
+            {
+                errorString = StatusString(error.ErrorStatus) + " '" + error.ArgString + "'";
+                break;
+            }
+            const SchemaImage::Option *optionDescPtr = &schema.GetOption(error.ContextIndex);
+            size_t domainSize = optionDescPtr->Domain.Count / 2;
+            std::string firstLines = "Invalid value '" + error.ArgString + "' for variable '--" + std::string(schema.GetString(optionDescPtr->Name)) + "'";
+            SuggestionFinder finder(error.ArgString);
+            for (size_t i = 0; i < domainSize; ++i)
+                finder.Consider(schema.GetDomainValue(*optionDescPtr, i));
+            finder.Append(firstLines, "");
+            oss << firstLines << std::endl;
             oss << "Expected one of the following:" << std::endl;
-            for (auto it = optionDescPtr->Domain.begin(); it != optionDescPtr->Domain.end();)
+            for (size_t i = 0; i < domainSize;)
             {
-                oss << "  " << *it;
-                ++it;
-                if (it != optionDescPtr->Domain.end())
+                oss << "  " << schema.GetDomainValue(*optionDescPtr, i);
+                ++i;
+                if (i != domainSize)
                     oss << std::endl;
             }
             errorString = oss.str();
@@ -287,14 +2152,135 @@ namespace InCommand
         }
 
         case Status::MissingVariableValue:
-            errorString = "Missing value after '" + m_LastReadError.ArgString + "'";
+            errorString = "Missing value after '" + error.ArgString + "'";
+            break;
+
+        case Status::AmbiguousArgument: {
+            std::ostringstream oss;
+            const SchemaImage &schema = EnsureFrozen();
+            if (error.ContextIndex >= schema.GetCategoryCount())
+            {
+                errorString = StatusString(error.ErrorStatus) + " '" + error.ArgString + "'";
+                break;
+            }
+            const SchemaImage::Category &categoryDesc = schema.GetCategory(error.ContextIndex);
+            std::string_view arg = error.ArgString;
+            oss << "Ambiguous argument '" << arg << "' could be any of the following:";
+            if (arg.substr(0, 2) == "--")
+            {
+                std::string_view prefix = arg.substr(2);
+                for (const uint32_t *it = schema.LowerBoundOption(categoryDesc, prefix);
+                    it != schema.GetWords(categoryDesc.SortedNames).end() && schema.GetString(schema.GetOption(*it).Name).substr(0, prefix.size()) == prefix; ++it)
+                    oss << std::endl << "  --" << schema.GetString(schema.GetOption(*it).Name);
+            }
+            else
+            {
+                for (const uint32_t *it = schema.LowerBoundSubCategory(categoryDesc, arg);
+                    it != schema.GetWords(categoryDesc.SubCategories).end() && schema.GetString(schema.GetCategory(*it).Name).substr(0, arg.size()) == arg; ++it)
+                    oss << std::endl << "  " << schema.GetString(schema.GetCategory(*it).Name);
+            }
+            errorString = oss.str();
             break;
+        }
 
         default:
-            errorString = StatusString(m_LastReadError.ErrorStatus) + " '" + m_LastReadError.ArgString + "'";
+            errorString = StatusString(error.ErrorStatus) + " '" + error.ArgString + "'";
             break;
         }
 
-        return m_LastReadError.ErrorStatus;
+        if (!error.FileName.empty())
+            errorString += " (" + error.FileName + ", offset " + std::to_string(error.FileOffset) + ")";
+
+        if (error.ErrorStatus == Status::UnknownOption || error.ErrorStatus == Status::UnexpectedArgument)
+            AppendSuggestions(error, errorString);
+
+        return error.ErrorStatus;
+    }
+
+#if !defined(_WIN32)
+    //------------------------------------------------------------------------------------------------
+    Status CCommandReader::PublishSchema(const std::string &name)
+    {
+        PopulateAll();
+
+        // A layered schema is published whole, merged with its bases
+        std::shared_ptr<const SchemaImage> flattened = EnsureFrozen().IsLayered() ? EnsureFrozen().Flatten() : nullptr;
+        const SchemaImage &schema = flattened ? *flattened : EnsureFrozen();
+
+        // Replace rather than overwrite any earlier object, which attached processes keep mapped
+        shm_unlink(name.c_str());
+        int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+        if (fd < 0)
+            return Status::SharedMemoryError;
+
+        size_t size = schema.GetSize();
+        void *data = ftruncate(fd, off_t(size)) == 0 ? mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (data == MAP_FAILED)
+        {
+            shm_unlink(name.c_str());
+            return Status::SharedMemoryError;
+        }
+
+        // The magic number goes in last, with a release store that AttachSchema's acquire load
+        // pairs with, so a process attaching mid-publish finds an invalid image rather than a
+        // partial one
+        char *image = static_cast<char *>(data);
+        std::memcpy(image + sizeof(uint32_t), schema.GetData() + sizeof(uint32_t), size - sizeof(uint32_t));
+        uint32_t magic;
+        std::memcpy(&magic, schema.GetData(), sizeof(magic));
+        __atomic_store_n(reinterpret_cast<uint32_t *>(image), magic, __ATOMIC_RELEASE);
+        munmap(data, size);
+        return Status::Success;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    Status CCommandReader::AttachSchema(const std::string &name)
+    {
+        int fd = shm_open(name.c_str(), O_RDONLY, 0);
+        if (fd < 0)
+            return errno == ENOENT ? Status::NotFound : Status::SharedMemoryError;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            close(fd);
+            return Status::SharedMemoryError;
+        }
+
+        size_t size = size_t(st.st_size);
+        void *data = size >= sizeof(SchemaImage::Header) ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (data == MAP_FAILED)
+            return size >= sizeof(SchemaImage::Header) ? Status::SharedMemoryError : Status::InvalidFormat;
+
+        // Pairs with PublishSchema's release store of the magic number, which it writes last
+        std::shared_ptr<const void> mapping(data, [size](const void *p) { munmap(const_cast<void *>(p), size); });
+        if (__atomic_load_n(static_cast<const uint32_t *>(data), __ATOMIC_ACQUIRE) != SchemaImage::Magic ||
+            !SchemaImage::IsValid(static_cast<const char *>(data), size))
+            return Status::InvalidFormat;
+
+        // The declarations are no longer needed; the mapped image stands in for them
+        std::lock_guard<std::mutex> lock(m_FreezeMutex);
+        m_Schema = std::make_shared<const SchemaImage>(std::move(mapping), static_cast<const char *>(data));
+        m_SchemaFingerprint = m_Schema->GetFingerprint();
+        m_Generation = m_Schema->GetGeneration();
+        m_CategoryDescs = std::vector<CategoryDesc>();
+        m_OptionsDescs = std::vector<OptionDesc>();
+        m_BaseCategoryDeltas.clear();
+        m_DeclaredOptionNames.clear();
+        m_InternedStrings.clear();
+        m_StringPool = std::string();
+        m_BaseSchema = nullptr;
+        m_ParameterSinks.clear();
+        m_Frozen.store(true, std::memory_order_release);
+        return Status::Success;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    Status CCommandReader::UnpublishSchema(const std::string &name)
+    {
+        return shm_unlink(name.c_str()) == 0 ? Status::Success : Status::NotFound;
     }
+#endif
 }
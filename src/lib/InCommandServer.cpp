@@ -0,0 +1,362 @@
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <cstdint>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "InCommandServer.h"
+
+namespace InCommand
+{
+    using Clock = std::chrono::steady_clock;
+
+    // Requests larger than this are rejected and the connection is closed
+    static const uint32_t MaxRequestSize = 64 * 1024 * 1024;
+
+    // A client that takes longer than this to send a request, once it has started, or to receive
+    // a reply is disconnected
+    static const std::chrono::seconds TransferTimeout(5);
+
+    //------------------------------------------------------------------------------------------------
+    // A connection accepted by Run, with what has arrived of its next request
+    struct CCommandServer::Connection
+    {
+        std::string Received;
+        Clock::time_point Deadline; // For the request begun in Received to arrive in full
+    };
+
+    //------------------------------------------------------------------------------------------------
+    // Writes data, waiting for a non-blocking socket to drain until deadline
+    static bool WriteAll(int socket, const void *data, size_t size, Clock::time_point deadline = Clock::time_point::max())
+    {
+        const char *bytes = static_cast<const char *>(data);
+        while (size > 0)
+        {
+#if defined(MSG_NOSIGNAL)
+            ssize_t written = send(socket, bytes, size, MSG_NOSIGNAL);
+#else
+            ssize_t written = send(socket, bytes, size, 0);
+#endif
+            if (written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now());
+                pollfd writable = { socket, POLLOUT, 0 };
+                if (remaining.count() <= 0 || poll(&writable, 1, int(remaining.count())) <= 0)
+                    return false;
+                continue;
+            }
+            if (written < 0 && errno == EINTR)
+                continue;
+            if (written <= 0)
+                return false;
+            bytes += written;
+            size -= size_t(written);
+        }
+        return true;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    static bool ReadAll(int socket, void *data, size_t size)
+    {
+        char *bytes = static_cast<char *>(data);
+        while (size > 0)
+        {
+            ssize_t bytesRead = recv(socket, bytes, size, 0);
+            if (bytesRead <= 0)
+                return false;
+            bytes += bytesRead;
+            size -= size_t(bytesRead);
+        }
+        return true;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    // Only processes running as the server's user may issue requests
+    static bool IsPeerTrusted(int socket)
+    {
+#if defined(SO_PEERCRED)
+        ucred credentials;
+        socklen_t size = sizeof(credentials);
+        return getsockopt(socket, SOL_SOCKET, SO_PEERCRED, &credentials, &size) == 0 && credentials.uid == geteuid();
+#else
+        uid_t uid;
+        gid_t gid;
+        return getpeereid(socket, &uid, &gid) == 0 && uid == geteuid();
+#endif
+    }
+
+    //------------------------------------------------------------------------------------------------
+    static bool MakeSocketAddress(const std::string &socketPath, sockaddr_un &address)
+    {
+        std::memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (socketPath.size() >= sizeof(address.sun_path))
+            return false;
+        std::memcpy(address.sun_path, socketPath.c_str(), socketPath.size() + 1);
+        return true;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    CCommandServer::~CCommandServer()
+    {
+        if (m_ListenSocket >= 0)
+        {
+            close(m_ListenSocket);
+            unlink(m_SocketPath.c_str());
+        }
+    }
+
+    //------------------------------------------------------------------------------------------------
+    Status CCommandServer::Listen(const std::string &socketPath)
+    {
+        sockaddr_un address;
+        if (m_ListenSocket >= 0 || !MakeSocketAddress(socketPath, address))
+            return Status::ConnectionError;
+
+        int listenSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenSocket < 0)
+            return Status::ConnectionError;
+
+        // Restrict the socket to the server's user before anyone can connect to it
+        unlink(socketPath.c_str());
+        if (bind(listenSocket, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 ||
+            chmod(socketPath.c_str(), S_IRUSR | S_IWUSR) != 0 ||
+            listen(listenSocket, SOMAXCONN) != 0)
+        {
+            close(listenSocket);
+            return Status::ConnectionError;
+        }
+
+        // Non-blocking so concurrent Run threads woken for the same connection don't block in accept
+        fcntl(listenSocket, F_SETFL, fcntl(listenSocket, F_GETFL) | O_NONBLOCK);
+
+        m_ListenSocket = listenSocket;
+        m_SocketPath = socketPath;
+
+        // Run may serve requests from several threads, so run populators and compile the schema
+        // now rather than from whichever request first needs them
+        m_Reader.PopulatePending();
+        m_Reader.EnsureFrozen();
+        return Status::Success;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    void CCommandServer::Run()
+    {
+        // The listening socket first, followed by the connections this call accepted. Connections
+        // are non-blocking and read as data arrives, so no client holds up the others.
+        std::vector<pollfd> sockets = { { m_ListenSocket, POLLIN, 0 } };
+        std::vector<Connection> connections(1); // Parallel to sockets
+        while (!m_Stopping.load())
+        {
+            // Poll with a timeout so Stop and deadlines are noticed without closing the socket
+            // under other threads
+            int ready = poll(sockets.data(), sockets.size(), 100);
+            Clock::time_point now = Clock::now();
+
+            for (size_t i = sockets.size() - 1; i > 0; --i)
+            {
+                bool open = true;
+                if (ready > 0 && sockets[i].revents != 0)
+                    open = (sockets[i].revents & POLLIN) != 0 && Receive(sockets[i].fd, connections[i]);
+                if (open && !connections[i].Received.empty() && now > connections[i].Deadline)
+                    open = false;
+                if (!open)
+                {
+                    close(sockets[i].fd);
+                    sockets.erase(sockets.begin() + i);
+                    connections.erase(connections.begin() + i);
+                }
+            }
+
+            if (ready > 0 && (sockets[0].revents & POLLIN))
+            {
+                int connection = accept(m_ListenSocket, nullptr, nullptr);
+                if (connection >= 0 && !IsPeerTrusted(connection))
+                {
+                    close(connection);
+                }
+                else if (connection >= 0)
+                {
+                    fcntl(connection, F_SETFL, fcntl(connection, F_GETFL) | O_NONBLOCK);
+                    sockets.push_back({ connection, POLLIN, 0 });
+                    connections.emplace_back();
+                }
+            }
+        }
+
+        for (size_t i = 1; i < sockets.size(); ++i)
+            close(sockets[i].fd);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    bool CCommandServer::Receive(int socket, Connection &connection) const
+    {
+        // One read per wakeup, so a client streaming requests does not starve the others
+        char chunk[64 * 1024];
+        ssize_t bytesRead = recv(socket, chunk, sizeof(chunk), 0);
+        if (bytesRead < 0)
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        if (bytesRead == 0)
+            return false;
+
+        if (connection.Received.empty())
+            connection.Deadline = Clock::now() + TransferTimeout;
+        connection.Received.append(chunk, size_t(bytesRead));
+
+        // The buffer grows only as request bytes arrive, whatever size the header claims
+        while (connection.Received.size() >= sizeof(uint32_t))
+        {
+            uint32_t requestSize;
+            std::memcpy(&requestSize, connection.Received.data(), sizeof(requestSize));
+            if (requestSize > MaxRequestSize)
+                return false;
+            if (connection.Received.size() - sizeof(requestSize) < requestSize)
+                break;
+
+            if (!ServeRequest(socket, std::string_view(connection.Received).substr(sizeof(requestSize), requestSize)))
+                return false;
+            connection.Received.erase(0, sizeof(requestSize) + requestSize);
+            connection.Deadline = Clock::now() + TransferTimeout;
+        }
+        return true;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    bool CCommandServer::ServeRequest(int socket, std::string_view request) const
+    {
+        // Requests come from other processes, so never let them name files for the server to read
+        CCommandExpression expression;
+        ReadErrorDesc error;
+        int32_t status = int32_t(m_Reader.ReadCommandExpression(request, expression, error, false));
+        int32_t dispatchStatus = int32_t(Status::Success);
+        int32_t exitCode = -1;
+        std::string output;
+
+        if (status != int32_t(Status::Success))
+        {
+            m_Reader.FormatReadError(error, output);
+        }
+        else if (!m_Dispatcher)
+        {
+            m_Reader.SerializeExpression(expression, output);
+            exitCode = 0;
+        }
+        else if (!m_Dispatcher->HasHandler(expression.GetCategory()))
+        {
+            dispatchStatus = int32_t(Status::NotFound);
+            output = "No handler for the command";
+        }
+        else
+        {
+            // A failing handler fails its request only; the server keeps serving
+            try
+            {
+                std::ostringstream out;
+                exitCode = m_Dispatcher->Dispatch(expression, static_cast<std::ostream &>(out));
+                output = out.str();
+            }
+            catch (const Exception &e)
+            {
+                dispatchStatus = int32_t(e.GetStatus());
+                output = e.GetMessage().empty() ? "Handler failed" : e.GetMessage();
+            }
+            catch (const std::exception &e)
+            {
+                dispatchStatus = int32_t(Status::HandlerError);
+                output = e.what();
+            }
+            catch (...)
+            {
+                dispatchStatus = int32_t(Status::HandlerError);
+                output = "Handler failed";
+            }
+        }
+
+        uint32_t replySize = uint32_t(3 * sizeof(int32_t) + output.size());
+        std::string reply;
+        reply.reserve(sizeof(replySize) + replySize);
+        reply.append(reinterpret_cast<const char *>(&replySize), sizeof(replySize));
+        reply.append(reinterpret_cast<const char *>(&status), sizeof(status));
+        reply.append(reinterpret_cast<const char *>(&dispatchStatus), sizeof(dispatchStatus));
+        reply.append(reinterpret_cast<const char *>(&exitCode), sizeof(exitCode));
+        reply += output;
+        return WriteAll(socket, reply.data(), reply.size(), Clock::now() + TransferTimeout);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    CCommandClient::~CCommandClient()
+    {
+        if (m_Socket >= 0)
+            close(m_Socket);
+    }
+
+    //------------------------------------------------------------------------------------------------
+    Status CCommandClient::Connect(const std::string &socketPath)
+    {
+        sockaddr_un address;
+        if (m_Socket >= 0 || !MakeSocketAddress(socketPath, address))
+            return Status::ConnectionError;
+
+        int clientSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (clientSocket < 0)
+            return Status::ConnectionError;
+
+        if (connect(clientSocket, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0)
+        {
+            close(clientSocket);
+            return Status::ConnectionError;
+        }
+
+        m_Socket = clientSocket;
+        return Status::Success;
+    }
+
+    //------------------------------------------------------------------------------------------------
+    Status CCommandClient::Send(int argc, const char *argv[], ServerReply &reply)
+    {
+        if (m_Socket < 0)
+            return Status::ConnectionError;
+
+        std::string request;
+        for (int i = 0; i < argc; ++i)
+        {
+            request += argv[i];
+            request += '\0';
+        }
+
+        uint32_t requestSize = uint32_t(request.size());
+        if (!WriteAll(m_Socket, &requestSize, sizeof(requestSize)) ||
+            !WriteAll(m_Socket, request.data(), request.size()))
+            return Status::ConnectionError;
+
+        uint32_t replySize;
+        int32_t status;
+        int32_t dispatchStatus;
+        int32_t exitCode;
+        if (!ReadAll(m_Socket, &replySize, sizeof(replySize)) ||
+            replySize < 3 * sizeof(int32_t) ||
+            !ReadAll(m_Socket, &status, sizeof(status)) ||
+            !ReadAll(m_Socket, &dispatchStatus, sizeof(dispatchStatus)) ||
+            !ReadAll(m_Socket, &exitCode, sizeof(exitCode)))
+            return Status::ConnectionError;
+
+        reply.ReadStatus = Status(status);
+        reply.DispatchStatus = Status(dispatchStatus);
+        reply.ExitCode = exitCode;
+        reply.Output.resize(replySize - 3 * sizeof(int32_t));
+        if (!ReadAll(m_Socket, reply.Output.data(), reply.Output.size()))
+            return Status::ConnectionError;
+
+        return Status::Success;
+    }
+}
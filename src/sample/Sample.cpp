@@ -14,13 +14,12 @@ int main(int argc, const char *argv[])
     auto cat_Roshambo = cmdReader.DeclareCategory("roshambo", "Play Roshambo");
 
     auto switch_Help = cmdReader.DeclareSwitch("help", 'h');
+    cmdReader.SetOptionInherited(switch_Help);
 
-    auto switch_Add_Help = cmdReader.DeclareSwitch(cat_Add, "help", 'h');
     auto param_Add_Val1 = cmdReader.DeclareParameter(cat_Add, "value1", "First add value");
     auto param_Add_Val2 = cmdReader.DeclareParameter(cat_Add, "value2", "Second add value");
     auto var_Add_Message = cmdReader.DeclareVariable(cat_Add, "message", 'm', "Print <message> N-times where N = value1 + value2");
 
-    auto switch_Mul_Help = cmdReader.DeclareSwitch(cat_Mul, "help", 'h');
     auto param_Mul_Val1 = cmdReader.DeclareParameter(cat_Mul, "value1", "First multiply value");
     auto param_Mul_Val2 = cmdReader.DeclareParameter(cat_Mul, "value2", "Second multiply value");
     auto var_Mul_Message = cmdReader.DeclareVariable(cat_Mul, "message", 'm', "Print <message> N-times where N = value1 * value2");
@@ -40,9 +39,7 @@ int main(int argc, const char *argv[])
         return -1;
     }
 
-    if (cmdExp.GetSwitchIsSet(switch_Help) ||
-        cmdExp.GetSwitchIsSet(switch_Add_Help) ||
-        cmdExp.GetSwitchIsSet(switch_Mul_Help))
+    if (cmdExp.GetSwitchIsSet(switch_Help))
     {
         std::cout << std::endl;
         std::string helpString = cmdReader.SimpleUsageString(cmdExp.GetCategory());
@@ -50,15 +47,14 @@ int main(int argc, const char *argv[])
         return 0;
     }
 
+    InCommand::CCommandDispatcher<> dispatcher;
     int result = 0;
-    int val1;
-    int val2;
     std::string message;
 
-    if (cat_Add == cmdExp.GetCategory())
+    dispatcher.SetHandler(cat_Add, [&](const InCommand::CCommandExpression &exp)
     { // Add
-        auto val1string = cmdExp.GetParameterValue(param_Add_Val1, std::string());
-        auto val2string = cmdExp.GetParameterValue(param_Add_Val2, std::string());
+        auto val1string = exp.GetParameterValue(param_Add_Val1, std::string());
+        auto val2string = exp.GetParameterValue(param_Add_Val2, std::string());
 
         if (val1string.empty() || val2string.empty())
         {
@@ -67,17 +63,19 @@ int main(int argc, const char *argv[])
             return -1;
         }
         
-        val1 = std::stoi(val1string);
-        val2 = std::stoi(val2string);
+        int val1 = std::stoi(val1string);
+        int val2 = std::stoi(val2string);
 
-        message = cmdExp.GetVariableValue(var_Add_Message, std::string());
+        message = exp.GetVariableValue(var_Add_Message, std::string());
         result = val1 + val2;
         std::cout << val1 << " + " << val2 << " = " << result << std::endl;
-    }
-    else if (cat_Mul == cmdExp.GetCategory())
+        return 0;
+    });
+
+    dispatcher.SetHandler(cat_Mul, [&](const InCommand::CCommandExpression &exp)
     { // Multiply
-        auto val1string = cmdExp.GetParameterValue(param_Mul_Val1, std::string());
-        auto val2string = cmdExp.GetParameterValue(param_Mul_Val2, std::string());
+        auto val1string = exp.GetParameterValue(param_Mul_Val1, std::string());
+        auto val2string = exp.GetParameterValue(param_Mul_Val2, std::string());
 
         if (val1string.empty() || val2string.empty())
         {
@@ -86,14 +84,16 @@ int main(int argc, const char *argv[])
             return -1;
         }
         
-        val1 = std::stoi(val1string);
-        val2 = std::stoi(val2string);
+        int val1 = std::stoi(val1string);
+        int val2 = std::stoi(val2string);
         
-        message = cmdExp.GetVariableValue(var_Mul_Message, std::string());
+        message = exp.GetVariableValue(var_Mul_Message, std::string());
         result = val1 * val2;
         std::cout << val1 << " * " << val2 << " = " << result << std::endl;
-    }
-    else if (cat_Roshambo == cmdExp.GetCategory())
+        return 0;
+    });
+
+    dispatcher.SetHandler(cat_Roshambo, [&](const InCommand::CCommandExpression &exp)
     {
         // Seed the random number generator
         std::random_device rd;
@@ -103,7 +103,7 @@ int main(int argc, const char *argv[])
         std::uniform_int_distribution<> distrib(1, 3);
         int randomInt = distrib(gen); // Generate random integer
 
-        std::string playerMove = cmdExp.GetVariableValue(var_Roshambo_Move, "");
+        std::string playerMove = exp.GetVariableValue(var_Roshambo_Move, "");
 
         std::string computerMove;
         switch (randomInt)
@@ -138,11 +138,15 @@ int main(int argc, const char *argv[])
         {
             std::cout << "I Win! :)" << std::endl;
         }
-    }
-    else
-    {
+        return 0;
+    });
+
+    if (!dispatcher.HasHandler(cmdExp.GetCategory()))
         return -1;
-    }
+
+    int status = dispatcher.Dispatch(cmdExp);
+    if (status != 0)
+        return status;
 
     if (!message.empty())
     {
@@ -151,4 +155,4 @@ int main(int argc, const char *argv[])
     }
 
     return 0;
-}
\ No newline at end of file
+}
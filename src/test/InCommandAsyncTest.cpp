@@ -0,0 +1,100 @@
+#include <gtest/gtest.h>
+
+#include "InCommandAsync.h"
+
+static InCommand::CTask<int> Yield(InCommand::CExecutor &executor, int value)
+{
+    // Stands in for an I/O wait: suspend and resume later on the executor
+    co_await executor.Schedule();
+    co_return value;
+}
+
+TEST(InCommandAsync, ManualExecutor)
+{
+    InCommand::CCommandReader CmdReader("app");
+    auto fetchHandle = CmdReader.DeclareCategory("fetch");
+    auto countHandle = CmdReader.DeclareVariable(fetchHandle, "count");
+    auto failHandle = CmdReader.DeclareCategory("fail");
+
+    InCommand::CManualExecutor executor;
+    std::vector<std::string> trace;
+
+    InCommand::CAsyncCommandDispatcher dispatcher;
+    dispatcher.SetHandler(fetchHandle, [&](const InCommand::CCommandExpression &exp) -> InCommand::CTask<int>
+        {
+            int count = std::stoi(exp.GetVariableValue(countHandle, "1"));
+            int total = 0;
+            for (int i = 0; i < count; ++i)
+            {
+                trace.push_back("fetch " + std::to_string(count) + " step " + std::to_string(i));
+                total += co_await Yield(executor, i + 1);
+            }
+            co_return total;
+        });
+    dispatcher.SetHandler(failHandle, [&](const InCommand::CCommandExpression &) -> InCommand::CTask<int>
+        {
+            co_await executor.Schedule();
+            throw InCommand::Exception(InCommand::Status::InvalidValue);
+        });
+
+    InCommand::CAsyncCommandRunner runner(dispatcher, executor);
+
+    const char *argv1[] = { "app", "fetch", "--count", "2" };
+    const char *argv2[] = { "app", "fetch", "--count", "3" };
+    const char *argv3[] = { "app", "fail" };
+    const char *argv4[] = { "app" };
+    InCommand::CCommandExpression exp1, exp2, exp3, exp4;
+    ASSERT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(4, argv1, exp1));
+    ASSERT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(4, argv2, exp2));
+    ASSERT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(2, argv3, exp3));
+    ASSERT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(1, argv4, exp4));
+
+    std::future<int> result1 = runner.Run(exp1);
+    std::future<int> result2 = runner.Run(exp2);
+    std::future<int> result3 = runner.Run(exp3);
+    std::future<int> result4 = runner.Run(exp4);
+
+    // Nothing runs until the executor is driven
+    EXPECT_TRUE(trace.empty());
+    executor.RunUntilIdle();
+
+    EXPECT_EQ(result1.get(), 3);
+    EXPECT_EQ(result2.get(), 6);
+    EXPECT_THROW(result3.get(), InCommand::Exception);
+    EXPECT_THROW(result4.get(), InCommand::Exception);
+
+    // The two fetch commands were interleaved
+    std::vector<std::string> expected = { "fetch 2 step 0", "fetch 3 step 0", "fetch 2 step 1", "fetch 3 step 1", "fetch 3 step 2" };
+    EXPECT_EQ(trace, expected);
+}
+
+TEST(InCommandAsync, ThreadPoolExecutor)
+{
+    InCommand::CCommandReader CmdReader("app");
+    auto squareHandle = CmdReader.DeclareCategory("square");
+    auto valueHandle = CmdReader.DeclareParameter(squareHandle, "value");
+
+    InCommand::CThreadPoolExecutor executor(2);
+    InCommand::CAsyncCommandDispatcher dispatcher;
+    dispatcher.SetHandler(squareHandle, [&](const InCommand::CCommandExpression &exp) -> InCommand::CTask<int>
+        {
+            int value = co_await Yield(executor, std::stoi(exp.GetParameterValue(valueHandle, "0")));
+            co_return value * value;
+        });
+
+    InCommand::CAsyncCommandRunner runner(dispatcher, executor);
+    std::vector<std::string> values;
+    std::vector<std::future<int>> results;
+    for (int i = 0; i < 64; ++i)
+        values.push_back(std::to_string(i));
+    for (int i = 0; i < 64; ++i)
+    {
+        const char *argv[] = { "app", "square", values[i].c_str() };
+        InCommand::CCommandExpression exp;
+        ASSERT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(3, argv, exp));
+        results.push_back(runner.Run(std::move(exp)));
+    }
+
+    for (int i = 0; i < 64; ++i)
+        EXPECT_EQ(results[i].get(), i * i);
+}
@@ -1,6 +1,22 @@
 #include <gtest/gtest.h>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
 
 #include "InCommand.h"
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <sys/syscall.h>
+#endif
+#include "InCommandServer.h"
+#endif
 
 TEST(InCommand, BasicOptions)
 {
@@ -397,3 +413,1806 @@ TEST(InCommand, Errors)
         EXPECT_EQ(InCommand::Status::InvalidValue, CmdReader.ReadCommandExpression(argc, argv, cmdExp));
     }
 }
+
+static std::string WriteTestFile(const std::string &name, const std::string &content)
+{
+    std::filesystem::path path = std::filesystem::temp_directory_path() / name;
+    std::ofstream(path, std::ios::binary) << content;
+    return path.string();
+}
+
+TEST(InCommand, ResponseFiles)
+{
+    InCommand::CCommandReader CmdReader("app");
+    CmdReader.SetResponseFileMaxDepth(2);
+    auto copyHandle = CmdReader.DeclareCategory("copy");
+    auto sourceHandle = CmdReader.DeclareParameter(copyHandle, "source");
+    auto destHandle = CmdReader.DeclareParameter(copyHandle, "dest");
+    auto modeHandle = CmdReader.DeclareVariable(copyHandle, "mode", std::vector<std::string>{ "fast", "safe" });
+    auto verboseHandle = CmdReader.DeclareSwitch(copyHandle, "verbose");
+
+    std::string innerFile = WriteTestFile("incommand_inner.rsp", "--verbose\n");
+    std::string outerFile = WriteTestFile("incommand_outer.rsp", "--mode  safe\r\n\"my file.txt\"\t@" + innerFile + "\n");
+    std::string selfFile = WriteTestFile("incommand_self.rsp", "");
+    selfFile = WriteTestFile("incommand_self.rsp", "@" + selfFile);
+    std::string quoteFile = WriteTestFile("incommand_quote.rsp", "a.txt \"b.txt");
+
+    {
+        std::string outerArg = "@" + outerFile;
+        const char *argv[] = { "app", "copy", outerArg.c_str(), "dest.txt" };
+        const int argc = sizeof(argv) / sizeof(argv[0]);
+
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(argc, argv, cmdExp));
+        EXPECT_EQ(cmdExp.GetVariableValue(modeHandle, ""), "safe");
+        EXPECT_EQ(cmdExp.GetParameterValue(sourceHandle, ""), "my file.txt");
+        EXPECT_EQ(cmdExp.GetParameterValue(destHandle, ""), "dest.txt");
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(verboseHandle));
+    }
+
+    {
+        std::string selfArg = "@" + selfFile;
+        const char *argv[] = { "app", selfArg.c_str() };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::ResponseFileTooDeep, CmdReader.ReadCommandExpression(2, argv, cmdExp));
+    }
+
+    {
+        const char *argv[] = { "app", "copy", "@incommand_does_not_exist.rsp" };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::InvalidResponseFile, CmdReader.ReadCommandExpression(3, argv, cmdExp));
+    }
+
+    {
+        std::string quoteArg = "@" + quoteFile;
+        const char *argv[] = { "app", "copy", quoteArg.c_str() };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::InvalidResponseFile, CmdReader.ReadCommandExpression(3, argv, cmdExp));
+
+        std::string errorString;
+        CmdReader.GetLastReadError(errorString);
+        EXPECT_NE(errorString.find(quoteFile + ", offset 6"), std::string::npos);
+    }
+
+    {
+        // Expansion is disabled by default
+        InCommand::CCommandReader PlainReader("app");
+        auto paramHandle = PlainReader.DeclareParameter("param");
+        const char *argv[] = { "app", "@user" };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, PlainReader.ReadCommandExpression(2, argv, cmdExp));
+        EXPECT_EQ(cmdExp.GetParameterValue(paramHandle, ""), "@user");
+    }
+
+    for (const std::string &file : { innerFile, outerFile, selfFile, quoteFile })
+        std::filesystem::remove(file);
+}
+
+TEST(InCommand, RestParameters)
+{
+    InCommand::CCommandReader CmdReader("app");
+    CmdReader.SetResponseFileMaxDepth(1);
+    auto targetHandle = CmdReader.DeclareParameter("target");
+    auto filesHandle = CmdReader.DeclareRestParameter("files");
+    auto verboseHandle = CmdReader.DeclareSwitch("verbose");
+
+    std::string listFile = WriteTestFile("incommand_list.rsp", "c.txt \"d e.txt\"\nf.txt");
+    std::string listArg = "@" + listFile;
+    const char *argv[] = { "app", "out", "a.txt", "b.txt", "--verbose", listArg.c_str(), "g.txt" };
+    const int argc = sizeof(argv) / sizeof(argv[0]);
+
+    InCommand::CCommandExpression cmdExp;
+    EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(argc, argv, cmdExp));
+    EXPECT_EQ(cmdExp.GetParameterValue(targetHandle, ""), "out");
+    EXPECT_TRUE(cmdExp.GetSwitchIsSet(verboseHandle));
+    EXPECT_TRUE(cmdExp.GetParameterIsSet(filesHandle));
+
+    const InCommand::CParameterSpan &files = cmdExp.GetRestParameterValues(filesHandle);
+    std::vector<std::string_view> values(files.begin(), files.end());
+    std::vector<std::string_view> expected = { "a.txt", "b.txt", "c.txt", "d e.txt", "f.txt", "g.txt" };
+    EXPECT_EQ(values, expected);
+    EXPECT_EQ(files.size(), expected.size());
+    EXPECT_EQ(files.GetSegmentCount(), 3u);
+    EXPECT_EQ(files.begin()->data(), argv[2]);
+
+    InCommand::CCommandExpression emptyExp;
+    const char *argvEmpty[] = { "app" };
+    EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(1, argvEmpty, emptyExp));
+    EXPECT_TRUE(emptyExp.GetRestParameterValues(filesHandle).empty());
+    EXPECT_FALSE(emptyExp.GetParameterIsSet(filesHandle));
+
+    std::filesystem::remove(listFile);
+}
+
+TEST(InCommand, ParameterSinks)
+{
+    InCommand::CCommandReader CmdReader("app");
+    auto modeHandle = CmdReader.DeclareParameter("mode");
+    auto filesHandle = CmdReader.DeclareRestParameter("files");
+
+    const char *argv[] = { "app", "scan", "a.txt", "b.txt", "c.txt" };
+    const int argc = sizeof(argv) / sizeof(argv[0]);
+
+    {
+        std::vector<std::string_view> files;
+        CmdReader.SetParameterSink(filesHandle, [&files](std::string_view value) { files.push_back(value); });
+
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(argc, argv, cmdExp));
+        EXPECT_EQ(cmdExp.GetParameterValue(modeHandle, ""), "scan");
+        EXPECT_FALSE(cmdExp.GetParameterIsSet(filesHandle));
+        EXPECT_EQ(files, std::vector<std::string_view>({ "a.txt", "b.txt", "c.txt" }));
+    }
+
+    {
+        // Consume the values on another thread through a queue smaller than the value count
+        InCommand::CParameterQueue queue(2);
+        CmdReader.SetParameterSink(filesHandle, queue.GetSink());
+
+        std::vector<std::string_view> files;
+        std::thread consumer([&]()
+            {
+                std::string_view value;
+                while (queue.Pop(value))
+                    files.push_back(value);
+            });
+
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(argc, argv, cmdExp));
+        queue.Close();
+        consumer.join();
+        EXPECT_EQ(files, std::vector<std::string_view>({ "a.txt", "b.txt", "c.txt" }));
+    }
+
+    {
+        // Values before a failing argument have already reached the sink
+        std::vector<std::string_view> files;
+        CmdReader.SetParameterSink(filesHandle, [&files](std::string_view value) { files.push_back(value); });
+
+        const char *badArgv[] = { "app", "scan", "a.txt", "--bogus", "c.txt" };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::UnknownOption, CmdReader.ReadCommandExpression(int(std::size(badArgv)), badArgv, cmdExp));
+        EXPECT_EQ(files, std::vector<std::string_view>({ "a.txt" }));
+    }
+
+    CmdReader.SetParameterSink(filesHandle, nullptr);
+    InCommand::CCommandExpression cmdExp;
+    EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(argc, argv, cmdExp));
+    EXPECT_EQ(cmdExp.GetRestParameterValues(filesHandle).size(), 3u);
+
+    EXPECT_THROW(CmdReader.SetParameterSink(InCommand::ParameterHandle(1000), nullptr), InCommand::Exception);
+}
+
+TEST(InCommand, NulSeparatedBuffers)
+{
+    InCommand::CCommandReader CmdReader("app");
+    auto runHandle = CmdReader.DeclareCategory("run");
+    auto jobsHandle = CmdReader.DeclareVariable(runHandle, "jobs", 'j');
+    auto targetsHandle = CmdReader.DeclareRestParameter(runHandle, "targets");
+
+    {
+        static const char cmdline[] = "/usr/bin/app\0run\0-j\0" "8\0all\0\0install";
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(std::string_view(cmdline, sizeof(cmdline)), cmdExp));
+        EXPECT_EQ(cmdExp.GetCategory(), runHandle);
+        EXPECT_EQ(cmdExp.GetVariableValue(jobsHandle, ""), "8");
+
+        const InCommand::CParameterSpan &targets = cmdExp.GetRestParameterValues(targetsHandle);
+        EXPECT_EQ(std::vector<std::string_view>(targets.begin(), targets.end()), std::vector<std::string_view>({ "all", "", "install" }));
+        EXPECT_EQ(targets.GetSegmentCount(), 1u);
+    }
+
+    {
+        std::vector<std::string> cmdlines;
+        for (int i = 0; i < 200; ++i)
+        {
+            if (i % 10 == 0)
+                cmdlines.push_back(std::string("app\0bogus", 9)); // No trailing NUL
+            else
+                cmdlines.push_back(std::string("app\0run\0--jobs\0", 15) + std::to_string(i) + std::string(1, '\0'));
+        }
+        std::vector<std::string_view> buffers(cmdlines.begin(), cmdlines.end());
+
+        std::vector<InCommand::CCommandExpression> expressions;
+        std::vector<InCommand::ReadErrorDesc> errors;
+        CmdReader.ReadCommandExpressions(buffers, expressions, errors, 4);
+        ASSERT_EQ(expressions.size(), buffers.size());
+        ASSERT_EQ(errors.size(), buffers.size());
+        for (int i = 0; i < 200; ++i)
+        {
+            if (i % 10 == 0)
+            {
+                EXPECT_EQ(errors[i].ErrorStatus, InCommand::Status::UnexpectedArgument);
+                EXPECT_EQ(errors[i].ArgString, "bogus");
+                EXPECT_EQ(errors[i].ArgIndex, 1);
+            }
+            else
+            {
+                EXPECT_EQ(errors[i].ErrorStatus, InCommand::Status::Success);
+                EXPECT_EQ(expressions[i].GetVariableValue(jobsHandle, ""), std::to_string(i));
+            }
+        }
+    }
+
+    {
+        // @file in a NUL-separated buffer is literal unless the caller opts in to expansion
+        CmdReader.SetResponseFileMaxDepth(1);
+        std::string rspFile = WriteTestFile("incommand_cmdline.rsp", "-j 4");
+        std::string cmdline = std::string("app\0run\0@", 9) + rspFile + std::string(1, '\0');
+
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(std::string_view(cmdline), cmdExp));
+        EXPECT_FALSE(cmdExp.GetVariableIsSet(jobsHandle));
+        EXPECT_EQ(cmdExp.GetRestParameterValues(targetsHandle).size(), 1u);
+
+        InCommand::CCommandExpression expandedExp;
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(std::string_view(cmdline), expandedExp, true));
+        EXPECT_EQ(expandedExp.GetVariableValue(jobsHandle, ""), "4");
+        std::filesystem::remove(rspFile);
+    }
+}
+
+TEST(InCommand, Visitor)
+{
+    InCommand::CCommandReader CmdReader("app");
+    auto buildHandle = CmdReader.DeclareCategory("build");
+    auto cleanHandle = CmdReader.DeclareSwitch(buildHandle, "clean");
+    auto configHandle = CmdReader.DeclareVariable(buildHandle, "config", std::vector<std::string>{ "debug", "release" });
+    auto targetHandle = CmdReader.DeclareParameter(buildHandle, "target");
+    auto extraHandle = CmdReader.DeclareRestParameter(buildHandle, "extra");
+
+    struct RecordingVisitor
+    {
+        std::vector<std::string> Events;
+
+        void OnCategory(InCommand::CategoryHandle) { Events.push_back("category"); }
+        void OnSwitch(InCommand::SwitchHandle) { Events.push_back("switch"); }
+        void OnVariable(InCommand::VariableHandle, std::string_view value) { Events.push_back("variable " + std::string(value)); }
+        void OnParameter(InCommand::ParameterHandle, std::string_view value) { Events.push_back("parameter " + std::string(value)); }
+        void OnError(const InCommand::ReadErrorDesc &error) { Events.push_back("error " + error.ArgString); }
+    };
+
+    {
+        const char *argv[] = { "app", "build", "--clean", "lib", "--config", "release", "a", "b" };
+        const int argc = sizeof(argv) / sizeof(argv[0]);
+
+        RecordingVisitor visitor;
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.VisitCommandExpression(argc, argv, visitor));
+        std::vector<std::string> expected = { "category", "category", "switch", "parameter lib", "variable release", "parameter a", "parameter b" };
+        EXPECT_EQ(visitor.Events, expected);
+
+        // The visitor sees the same arguments ReadCommandExpression stores
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(argc, argv, cmdExp));
+        EXPECT_EQ(cmdExp.GetCategory(), buildHandle);
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(cleanHandle));
+        EXPECT_EQ(cmdExp.GetVariableValue(configHandle, ""), "release");
+        EXPECT_EQ(cmdExp.GetParameterValue(targetHandle, ""), "lib");
+        EXPECT_EQ(cmdExp.GetRestParameterValues(extraHandle).size(), 2u);
+    }
+
+    {
+        const char *argv[] = { "app", "build", "--config", "fast" };
+        const int argc = sizeof(argv) / sizeof(argv[0]);
+
+        RecordingVisitor visitor;
+        EXPECT_EQ(InCommand::Status::InvalidValue, CmdReader.VisitCommandExpression(argc, argv, visitor));
+        EXPECT_EQ(visitor.Events.back(), "error fast");
+    }
+}
+
+TEST(InCommand, Validate)
+{
+    InCommand::CCommandReader CmdReader("app");
+    auto submitHandle = CmdReader.DeclareCategory("submit");
+    CmdReader.DeclareVariable(submitHandle, "queue", 'q', std::vector<std::string>{ "batch", "interactive" });
+    CmdReader.DeclareSwitch(submitHandle, "wait");
+    auto scriptHandle = CmdReader.DeclareParameter(submitHandle, "script");
+
+    bool sinkCalled = false;
+    CmdReader.SetParameterSink(scriptHandle, [&sinkCalled](std::string_view) { sinkCalled = true; });
+
+    struct Case
+    {
+        std::vector<const char *> Args;
+        InCommand::Status ExpectedStatus;
+        int ExpectedArgIndex;
+    };
+
+    const Case cases[] =
+    {
+        { { "app", "submit", "-q", "batch", "--wait", "job.sh" }, InCommand::Status::Success, 0 },
+        { { "app", "submit", "--priority", "high" }, InCommand::Status::UnknownOption, 2 },
+        { { "app", "submit", "--queue", "gpu" }, InCommand::Status::InvalidValue, 3 },
+        { { "app", "submit", "job.sh", "extra.sh" }, InCommand::Status::UnexpectedArgument, 3 },
+        { { "app", "submit", "--wait", "--queue" }, InCommand::Status::MissingVariableValue, 3 },
+    };
+
+    for (const Case &c : cases)
+    {
+        InCommand::ValidationResult result = CmdReader.Validate(int(c.Args.size()), const_cast<const char **>(c.Args.data()));
+        EXPECT_EQ(result.ErrorStatus, c.ExpectedStatus);
+        EXPECT_EQ(result.ArgIndex, c.ExpectedArgIndex);
+
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(CmdReader.ReadCommandExpression(int(c.Args.size()), const_cast<const char **>(c.Args.data()), cmdExp), c.ExpectedStatus);
+    }
+
+    sinkCalled = false;
+    static const char cmdline[] = "app\0submit\0job.sh";
+    EXPECT_EQ(CmdReader.Validate(std::string_view(cmdline, sizeof(cmdline))).ErrorStatus, InCommand::Status::Success);
+    EXPECT_FALSE(sinkCalled);
+}
+
+TEST(InCommand, Dispatch)
+{
+    InCommand::CCommandReader CmdReader("app");
+    auto startHandle = CmdReader.DeclareCategory("start");
+    auto stopHandle = CmdReader.DeclareCategory("stop");
+    auto forceHandle = CmdReader.DeclareSwitch(stopHandle, "force");
+    auto statusHandle = CmdReader.DeclareCategory("status");
+
+    InCommand::CCommandDispatcher<> dispatcher;
+    dispatcher.SetHandler(startHandle, [](const InCommand::CCommandExpression &) { return 1; });
+    dispatcher.SetHandler(stopHandle, [&](const InCommand::CCommandExpression &exp) { return exp.GetSwitchIsSet(forceHandle) ? 3 : 2; });
+
+    {
+        const char *argv[] = { "app", "stop", "--force" };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(3, argv, cmdExp));
+        EXPECT_EQ(dispatcher.Dispatch(cmdExp), 3);
+    }
+
+    {
+        const char *argv[] = { "app", "status" };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(2, argv, cmdExp));
+        EXPECT_FALSE(dispatcher.HasHandler(statusHandle));
+        EXPECT_THROW(dispatcher.Dispatch(cmdExp), InCommand::Exception);
+    }
+
+    {
+        // A concrete callable type with extra dispatch arguments
+        struct Handler
+        {
+            int Code;
+            int operator()(const InCommand::CCommandExpression &, int offset) const { return Code + offset; }
+        };
+
+        InCommand::CCommandDispatcher<Handler> typedDispatcher;
+        typedDispatcher.SetHandler(startHandle, Handler{ 10 });
+        typedDispatcher.SetHandler(InCommand::RootCategory, Handler{ 20 });
+
+        const char *argv[] = { "app", "start" };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(2, argv, cmdExp));
+        EXPECT_EQ(typedDispatcher.Dispatch(cmdExp, 5), 15);
+    }
+}
+
+TEST(InCommand, CommandSequences)
+{
+    InCommand::CCommandReader CmdReader("app");
+    auto addHandle = CmdReader.DeclareCategory("add");
+    auto valuesHandle = CmdReader.DeclareRestParameter(addHandle, "values");
+    auto negateHandle = CmdReader.DeclareSwitch(addHandle, "negate");
+    auto echoHandle = CmdReader.DeclareCategory("echo");
+    auto textHandle = CmdReader.DeclareParameter(echoHandle, "text");
+
+    const char *argv[] = { "app", "add", "1", "2", "--then", "echo", "hi", "--then", "add", "--negate", "3", "4", "5" };
+    const int argc = sizeof(argv) / sizeof(argv[0]);
+
+    std::vector<InCommand::CCommandExpression> expressions;
+    ASSERT_EQ(InCommand::Status::Success, CmdReader.ReadCommandSequence(argc, argv, "--then", expressions));
+    ASSERT_EQ(expressions.size(), 3u);
+    EXPECT_EQ(expressions[0].GetCategory(), addHandle);
+    EXPECT_EQ(expressions[0].GetRestParameterValues(valuesHandle).size(), 2u);
+    EXPECT_EQ(expressions[1].GetParameterValue(textHandle, ""), "hi");
+    EXPECT_TRUE(expressions[2].GetSwitchIsSet(negateHandle));
+    EXPECT_FALSE(expressions[0].GetSwitchIsSet(negateHandle));
+
+    InCommand::CCommandDispatcher<> dispatcher;
+    dispatcher.SetHandler(addHandle, [&](const InCommand::CCommandExpression &exp)
+        {
+            int sum = 0;
+            for (std::string_view value : exp.GetRestParameterValues(valuesHandle))
+                sum += std::stoi(std::string(value));
+            return exp.GetSwitchIsSet(negateHandle) ? -sum : sum;
+        });
+    dispatcher.SetHandler(echoHandle, [&](const InCommand::CCommandExpression &exp) { return int(exp.GetParameterValue(textHandle, "").size()); });
+
+    EXPECT_EQ(dispatcher.DispatchAll(expressions, 1), std::vector<int>({ 3, 2, -12 }));
+    EXPECT_EQ(dispatcher.DispatchAll(expressions, 3), std::vector<int>({ 3, 2, -12 }));
+
+    // Errors report the index within the full argument list
+    const char *badArgv[] = { "app", "echo", "a", ";", "echo", "--loud" };
+    InCommand::ReadErrorDesc error;
+    EXPECT_EQ(InCommand::Status::UnknownOption, CmdReader.ReadCommandSequence(6, badArgv, ";", expressions, error));
+    EXPECT_EQ(error.ArgIndex, 5);
+
+    // Expressions read before an error keep their response file values
+    CmdReader.SetResponseFileMaxDepth(1);
+    std::string rspFile = WriteTestFile("incommand_sequence.rsp", "7 8");
+    std::string rspArg = "@" + rspFile;
+    const char *rspArgv[] = { "app", "add", rspArg.c_str(), ";", "echo", "--loud" };
+    EXPECT_EQ(InCommand::Status::UnknownOption, CmdReader.ReadCommandSequence(6, rspArgv, ";", expressions, error));
+    ASSERT_EQ(expressions.size(), 2u);
+    std::vector<std::string> values;
+    for (std::string_view value : expressions[0].GetRestParameterValues(valuesHandle))
+        values.emplace_back(value);
+    EXPECT_EQ(values, std::vector<std::string>({ "7", "8" }));
+    expressions.clear();
+    std::filesystem::remove(rspFile);
+
+    // Handlers returning void
+    InCommand::CCommandDispatcher<std::function<void(const InCommand::CCommandExpression &)>> voidDispatcher;
+    std::atomic<int> dispatched{ 0 };
+    voidDispatcher.SetHandler(echoHandle, [&](const InCommand::CCommandExpression &) { ++dispatched; });
+    const char *echoArgv[] = { "app", "echo", "a", ";", "echo", "b" };
+    ASSERT_EQ(InCommand::Status::Success, CmdReader.ReadCommandSequence(6, echoArgv, ";", expressions));
+    voidDispatcher.DispatchAll(expressions, 2);
+    EXPECT_EQ(dispatched.load(), 2);
+
+    // Handler exceptions propagate from DispatchAll
+    const char *rootArgv[] = { "app", ";", "echo", "x" };
+    ASSERT_EQ(InCommand::Status::Success, CmdReader.ReadCommandSequence(4, rootArgv, ";", expressions));
+    EXPECT_THROW(dispatcher.DispatchAll(expressions, 2), InCommand::Exception);
+}
+
+#if !defined(_WIN32)
+TEST(InCommand, CommandServer)
+{
+    InCommand::CCommandReader CmdReader("app");
+    auto greetHandle = CmdReader.DeclareCategory("greet");
+    auto nameHandle = CmdReader.DeclareParameter(greetHandle, "name");
+    CmdReader.DeclareCategory("idle");
+    auto failHandle = CmdReader.DeclareCategory("fail");
+    CmdReader.SetResponseFileMaxDepth(1);
+
+    InCommand::CServerCommandDispatcher dispatcher;
+    dispatcher.SetHandler(failHandle, [](const InCommand::CCommandExpression &, std::ostream &) -> int
+        {
+            throw std::out_of_range("bad index");
+        });
+    dispatcher.SetHandler(greetHandle, [&](const InCommand::CCommandExpression &exp, std::ostream &out)
+        {
+            out << "hello " << exp.GetParameterValue(nameHandle, "world");
+            return 7;
+        });
+
+    std::string socketPath = (std::filesystem::temp_directory_path() / "incommand_test.sock").string();
+    InCommand::CCommandServer server(CmdReader, dispatcher);
+    ASSERT_EQ(InCommand::Status::Success, server.Listen(socketPath));
+    std::thread serverThread([&server]() { server.Run(); });
+
+    // Only the server's user may connect
+    struct stat socketStat;
+    ASSERT_EQ(stat(socketPath.c_str(), &socketStat), 0);
+    EXPECT_EQ(socketStat.st_mode & 0777, 0600u);
+
+    // Connects without the client, to send partial or malformed requests
+    auto connectRaw = [&socketPath]()
+    {
+        int rawSocket = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        std::strncpy(address.sun_path, socketPath.c_str(), sizeof(address.sun_path) - 1);
+        EXPECT_EQ(connect(rawSocket, reinterpret_cast<sockaddr *>(&address), sizeof(address)), 0);
+        return rawSocket;
+    };
+
+    {
+        InCommand::CCommandClient client;
+        ASSERT_EQ(InCommand::Status::Success, client.Connect(socketPath));
+
+        InCommand::ServerReply reply;
+        const char *argv[] = { "app", "greet", "anna" };
+        ASSERT_EQ(InCommand::Status::Success, client.Send(3, argv, reply));
+        EXPECT_EQ(reply.ReadStatus, InCommand::Status::Success);
+        EXPECT_EQ(reply.DispatchStatus, InCommand::Status::Success);
+        EXPECT_EQ(reply.ExitCode, 7);
+        EXPECT_EQ(reply.Output, "hello anna");
+
+        // A second client is served while the first one's connection sits idle
+        InCommand::CCommandClient otherClient;
+        ASSERT_EQ(InCommand::Status::Success, otherClient.Connect(socketPath));
+        ASSERT_EQ(InCommand::Status::Success, otherClient.Send(3, argv, reply));
+        EXPECT_EQ(reply.ExitCode, 7);
+
+        // A client trickling in a request does not hold up others
+        int tricklingSocket = connectRaw();
+        uint32_t trickledSize = 100;
+        ASSERT_EQ(send(tricklingSocket, &trickledSize, sizeof(trickledSize), 0), ssize_t(sizeof(trickledSize)));
+        ASSERT_EQ(send(tricklingSocket, "a", 1, 0), 1);
+        auto sendStart = std::chrono::steady_clock::now();
+        ASSERT_EQ(InCommand::Status::Success, otherClient.Send(3, argv, reply));
+        EXPECT_EQ(reply.ExitCode, 7);
+        EXPECT_LT(std::chrono::steady_clock::now() - sendStart, std::chrono::seconds(2));
+        close(tricklingSocket);
+
+        // An oversized request closes the connection without waiting for its body
+        int oversizedSocket = connectRaw();
+        uint32_t oversizedSize = 0x7fffffff;
+        ASSERT_EQ(send(oversizedSocket, &oversizedSize, sizeof(oversizedSize), 0), ssize_t(sizeof(oversizedSize)));
+        char byte;
+        EXPECT_EQ(recv(oversizedSocket, &byte, 1, 0), 0);
+        close(oversizedSocket);
+
+        // @file arguments from clients are literal
+        std::string rspFile = WriteTestFile("incommand_server.rsp", "secret");
+        std::string rspArg = "@" + rspFile;
+        const char *rspArgv[] = { "app", "greet", rspArg.c_str() };
+        ASSERT_EQ(InCommand::Status::Success, client.Send(3, rspArgv, reply));
+        EXPECT_EQ(reply.Output, "hello " + rspArg);
+        std::filesystem::remove(rspFile);
+
+        // Several requests share one connection
+        const char *badArgv[] = { "app", "greet", "--loud" };
+        ASSERT_EQ(InCommand::Status::Success, client.Send(3, badArgv, reply));
+        EXPECT_EQ(reply.ReadStatus, InCommand::Status::UnknownOption);
+        EXPECT_EQ(reply.Output, "Unknown option '--loud'");
+
+        const char *idleArgv[] = { "app", "idle" };
+        ASSERT_EQ(InCommand::Status::Success, client.Send(2, idleArgv, reply));
+        EXPECT_EQ(reply.ReadStatus, InCommand::Status::Success);
+        EXPECT_EQ(reply.DispatchStatus, InCommand::Status::NotFound);
+        EXPECT_EQ(reply.ExitCode, -1);
+        EXPECT_FALSE(reply.Output.empty());
+
+        // Any exception from a handler fails only its request
+        const char *failArgv[] = { "app", "fail" };
+        ASSERT_EQ(InCommand::Status::Success, client.Send(2, failArgv, reply));
+        EXPECT_EQ(reply.ReadStatus, InCommand::Status::Success);
+        EXPECT_EQ(reply.DispatchStatus, InCommand::Status::HandlerError);
+        EXPECT_EQ(reply.Output, "bad index");
+        ASSERT_EQ(InCommand::Status::Success, client.Send(3, argv, reply));
+        EXPECT_EQ(reply.ExitCode, 7);
+
+        // Stop returns while clients are still connected
+        server.Stop();
+        serverThread.join();
+    }
+
+    // Without a dispatcher the server replies with the serialized expression
+    InCommand::CCommandServer parseServer(CmdReader);
+    ASSERT_EQ(InCommand::Status::Success, parseServer.Listen(socketPath));
+    std::thread parseServerThread([&parseServer]() { parseServer.Run(); });
+
+    {
+        InCommand::CCommandClient client;
+        ASSERT_EQ(InCommand::Status::Success, client.Connect(socketPath));
+
+        InCommand::ServerReply reply;
+        const char *argv[] = { "app", "greet", "anna" };
+        ASSERT_EQ(InCommand::Status::Success, client.Send(3, argv, reply));
+        EXPECT_EQ(reply.ReadStatus, InCommand::Status::Success);
+
+        InCommand::CSerializedExpression serialized;
+        ASSERT_EQ(InCommand::Status::Success, serialized.Open(CmdReader, reply.Output));
+        EXPECT_EQ(serialized.GetCategory(), greetHandle);
+        EXPECT_EQ(serialized.GetParameterValue(nameHandle, "world"), "anna");
+    }
+
+    parseServer.Stop();
+    parseServerThread.join();
+
+    InCommand::CCommandClient client;
+    EXPECT_EQ(InCommand::Status::ConnectionError, client.Connect(socketPath + ".missing"));
+}
+#endif
+
+TEST(InCommand, SerializedExpressions)
+{
+    struct Schema
+    {
+        InCommand::SwitchHandle Verbose = InCommand::SwitchHandle(0);
+        InCommand::SwitchHandle Flag3 = InCommand::SwitchHandle(0);
+        InCommand::SwitchHandle Flag69 = InCommand::SwitchHandle(0);
+        InCommand::VariableHandle Mode = InCommand::VariableHandle(0);
+        InCommand::ParameterHandle Source = InCommand::ParameterHandle(0);
+        InCommand::ParameterHandle Files = InCommand::ParameterHandle(0);
+    };
+
+    auto declareSchema = [](InCommand::CCommandReader &reader)
+    {
+        Schema schema;
+        auto copyHandle = reader.DeclareCategory("copy");
+        schema.Verbose = reader.DeclareSwitch(copyHandle, "verbose", 'v');
+        for (int i = 0; i < 70; ++i)
+        {
+            auto flagHandle = reader.DeclareSwitch(copyHandle, "flag" + std::to_string(i));
+            if (i == 3)
+                schema.Flag3 = flagHandle;
+            else if (i == 69)
+                schema.Flag69 = flagHandle;
+        }
+        schema.Mode = reader.DeclareVariable(copyHandle, "mode", std::vector<std::string>{ "fast", "safe" });
+        schema.Source = reader.DeclareParameter(copyHandle, "source");
+        schema.Files = reader.DeclareRestParameter(copyHandle, "files");
+        return schema;
+    };
+
+    // Front-end and worker build the same schema independently
+    InCommand::CCommandReader frontEnd("app");
+    Schema schema = declareSchema(frontEnd);
+    InCommand::CCommandReader worker("app");
+    declareSchema(worker);
+    EXPECT_EQ(frontEnd.GetSchemaFingerprint(), worker.GetSchemaFingerprint());
+
+    const char *argv[] = { "app", "copy", "--verbose", "--flag69", "src", "--mode", "safe", "a", "b", "c" };
+    const int argc = sizeof(argv) / sizeof(argv[0]);
+    InCommand::CCommandExpression cmdExp;
+    ASSERT_EQ(InCommand::Status::Success, frontEnd.ReadCommandExpression(argc, argv, cmdExp));
+    EXPECT_TRUE(cmdExp.GetSwitchIsSet(schema.Flag69));
+
+    std::string blob;
+    frontEnd.SerializeExpression(cmdExp, blob);
+
+    InCommand::CSerializedExpression serialized;
+    ASSERT_EQ(InCommand::Status::Success, serialized.Open(worker, blob));
+    EXPECT_EQ(serialized.GetCategory(), cmdExp.GetCategory());
+    EXPECT_TRUE(serialized.GetSwitchIsSet(schema.Verbose));
+    EXPECT_TRUE(serialized.GetSwitchIsSet(schema.Flag69));
+    EXPECT_FALSE(serialized.GetSwitchIsSet(schema.Flag3));
+    EXPECT_EQ(serialized.GetVariableValue(schema.Mode, "fast"), "safe");
+    EXPECT_EQ(serialized.GetParameterValue(schema.Source, ""), "src");
+    EXPECT_TRUE(serialized.GetParameterIsSet(schema.Files));
+
+    InCommand::CParameterSpan files = serialized.GetRestParameterValues(schema.Files);
+    EXPECT_EQ(std::vector<std::string_view>(files.begin(), files.end()), std::vector<std::string_view>({ "a", "b", "c" }));
+    EXPECT_GE(serialized.GetVariableValue(schema.Mode, "").data(), blob.data());
+    EXPECT_LT(serialized.GetVariableValue(schema.Mode, "").data(), blob.data() + blob.size());
+
+    // A worker with a different schema rejects the blob
+    InCommand::CCommandReader otherWorker("app");
+    declareSchema(otherWorker);
+    otherWorker.DeclareSwitch("extra");
+    EXPECT_EQ(InCommand::Status::SchemaMismatch, serialized.Open(otherWorker, blob));
+
+    // Truncated blobs are rejected
+    EXPECT_EQ(InCommand::Status::InvalidFormat, serialized.Open(worker, std::string_view(blob.data(), blob.size() - 1)));
+    EXPECT_EQ(InCommand::Status::InvalidFormat, serialized.Open(worker, std::string_view(blob.data(), 10)));
+
+    // A failed Open leaves nothing to read; getters return defaults and GetCategory throws
+    EXPECT_FALSE(serialized.IsOpen());
+    EXPECT_FALSE(serialized.GetSwitchIsSet(schema.Verbose));
+    EXPECT_EQ(serialized.GetVariableValue(schema.Mode, "fast"), "fast");
+    EXPECT_FALSE(serialized.GetParameterIsSet(schema.Files));
+    EXPECT_TRUE(serialized.GetRestParameterValues(schema.Files).empty());
+    EXPECT_THROW(serialized.GetCategory(), InCommand::Exception);
+
+    InCommand::CSerializedExpression unopened;
+    EXPECT_FALSE(unopened.IsOpen());
+    EXPECT_EQ(unopened.GetParameterValue(schema.Source, "none"), "none");
+    EXPECT_THROW(unopened.GetCategory(), InCommand::Exception);
+}
+
+TEST(InCommand, CanonicalHashAndCache)
+{
+    InCommand::CCommandReader CmdReader("app");
+    auto buildHandle = CmdReader.DeclareCategory("build");
+    CmdReader.DeclareSwitch(buildHandle, "verbose", 'v');
+    CmdReader.DeclareVariable(buildHandle, "config", 'c');
+    CmdReader.DeclareParameter(buildHandle, "target");
+    auto sourcesHandle = CmdReader.DeclareRestParameter(buildHandle, "sources");
+
+    auto hashOf = [&](std::vector<const char *> args)
+    {
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(int(args.size()), args.data(), cmdExp));
+        return cmdExp.GetCanonicalHash();
+    };
+
+    // Option order and spelling do not matter
+    uint64_t hash = hashOf({ "app", "build", "--verbose", "--config", "release", "all", "a.c", "b.c" });
+    EXPECT_EQ(hash, hashOf({ "app", "build", "-c", "release", "-v", "all", "a.c", "b.c" }));
+    EXPECT_EQ(hash, hashOf({ "app", "build", "all", "a.c", "--config", "release", "b.c", "-v" }));
+
+    // Values, switches and rest parameter order do
+    EXPECT_NE(hash, hashOf({ "app", "build", "--verbose", "--config", "debug", "all", "a.c", "b.c" }));
+    EXPECT_NE(hash, hashOf({ "app", "build", "--config", "release", "all", "a.c", "b.c" }));
+    EXPECT_NE(hash, hashOf({ "app", "build", "--verbose", "--config", "release", "all", "b.c", "a.c" }));
+    EXPECT_NE(hash, hashOf({ "app", "build", "--verbose", "--config", "release", "all" }));
+
+    InCommand::CExpressionCache cache(CmdReader, 2);
+    InCommand::ReadErrorDesc error;
+
+    std::string target = "all";
+    const char *argv1[] = { "app", "build", "-v", target.c_str(), "a.c" };
+    auto exp1 = cache.ReadCommandExpression(5, argv1, error);
+    ASSERT_NE(exp1, nullptr);
+    EXPECT_EQ(error.ErrorStatus, InCommand::Status::Success);
+    target = "none";
+
+    // Cached values do not refer to the caller's arguments
+    const char *argv1Copy[] = { "app", "build", "-v", "all", "a.c" };
+    EXPECT_EQ(exp1, cache.ReadCommandExpression(5, argv1Copy, error));
+    EXPECT_EQ(*exp1->GetRestParameterValues(sourcesHandle).begin(), "a.c");
+
+    const char *argv2[] = { "app", "build", "all" };
+    auto exp2 = cache.ReadCommandExpression(3, argv2, error);
+    ASSERT_NE(exp2, nullptr);
+    EXPECT_NE(exp1, exp2);
+    EXPECT_EQ(cache.GetSize(), 2u);
+
+    // argv1 was used more recently than argv2, so argv2 is evicted
+    EXPECT_EQ(exp1, cache.ReadCommandExpression(5, argv1Copy, error));
+    const char *argv3[] = { "app", "build", "lib" };
+    ASSERT_NE(cache.ReadCommandExpression(3, argv3, error), nullptr);
+    EXPECT_EQ(cache.GetSize(), 2u);
+    EXPECT_EQ(exp1, cache.ReadCommandExpression(5, argv1Copy, error));
+    auto exp2Again = cache.ReadCommandExpression(3, argv2, error);
+    EXPECT_NE(exp2, exp2Again);
+    EXPECT_EQ(exp2->GetCanonicalHash(), exp2Again->GetCanonicalHash());
+
+    // Errors are reported and not cached
+    const char *badArgv[] = { "app", "build", "--fast" };
+    EXPECT_EQ(cache.ReadCommandExpression(3, badArgv, error), nullptr);
+    EXPECT_EQ(error.ErrorStatus, InCommand::Status::UnknownOption);
+    EXPECT_EQ(error.ArgIndex, 2);
+    EXPECT_EQ(error.ArgString, "--fast");
+
+    // Response files expand as in a direct read, and are read again every time
+    CmdReader.SetResponseFileMaxDepth(4);
+    std::string rspFile = WriteTestFile("incommand_cache.rsp", "a.c b.c c.c");
+    std::string rspArg = "@" + rspFile;
+    const char *rspArgv[] = { "app", "build", "all", rspArg.c_str() };
+    InCommand::CCommandExpression direct;
+    ASSERT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(4, rspArgv, direct));
+    auto cached = cache.ReadCommandExpression(4, rspArgv, error);
+    ASSERT_NE(cached, nullptr);
+    EXPECT_EQ(cached->GetRestParameterValues(sourcesHandle).size(), 3u);
+    EXPECT_EQ(cached->GetCanonicalHash(), direct.GetCanonicalHash());
+    EXPECT_NE(cached, cache.ReadCommandExpression(4, rspArgv, error));
+    std::filesystem::remove(rspFile);
+
+    cache.Clear();
+    EXPECT_EQ(cache.GetSize(), 0u);
+}
+
+TEST(InCommand, InheritedOptions)
+{
+    InCommand::CCommandReader CmdReader("app");
+    auto remoteHandle = CmdReader.DeclareCategory("remote");
+    auto addHandle = CmdReader.DeclareCategory(remoteHandle, "add");
+    auto helpHandle = CmdReader.DeclareSwitch("help", 'h');
+    auto colorHandle = CmdReader.DeclareVariable("color", std::vector<std::string>{ "always", "never" });
+    auto rootOnlyHandle = CmdReader.DeclareSwitch("version");
+    CmdReader.SetOptionInherited(helpHandle);
+    CmdReader.SetOptionInherited(colorHandle);
+
+    // A descendant's own declaration shadows the inherited one
+    auto addColorHandle = CmdReader.DeclareSwitch(addHandle, "color");
+
+    {
+        const char *argv[] = { "app", "remote", "add", "-h" };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(4, argv, cmdExp));
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(helpHandle));
+    }
+
+    {
+        const char *argv[] = { "app", "remote", "--color", "never", "add", "--color", "--help" };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(7, argv, cmdExp));
+        EXPECT_EQ(cmdExp.GetVariableValue(colorHandle, ""), "never");
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(addColorHandle));
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(helpHandle));
+    }
+
+    {
+        const char *argv[] = { "app", "remote", "--version" };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::UnknownOption, CmdReader.ReadCommandExpression(3, argv, cmdExp));
+        EXPECT_TRUE(CmdReader.Validate(2, argv).ErrorStatus == InCommand::Status::Success);
+    }
+
+    {
+        const char *argv[] = { "app", "--version", "remote" };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(3, argv, cmdExp));
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(rootOnlyHandle));
+    }
+
+    // Declarations after a read take effect on the next read
+    uint64_t fingerprint = CmdReader.GetSchemaFingerprint();
+    auto quietHandle = CmdReader.DeclareSwitch(remoteHandle, "quiet", 'q');
+    CmdReader.SetOptionInherited(quietHandle);
+    EXPECT_NE(fingerprint, CmdReader.GetSchemaFingerprint());
+    {
+        const char *argv[] = { "app", "remote", "add", "-q" };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(4, argv, cmdExp));
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(quietHandle));
+    }
+
+    EXPECT_NE(CmdReader.SimpleUsageString(addHandle).find("[--help]"), std::string::npos);
+    EXPECT_EQ(CmdReader.SimpleUsageString(addHandle).find("--version"), std::string::npos);
+    EXPECT_THROW(CmdReader.SetOptionInherited(InCommand::SwitchHandle(9999)), InCommand::Exception);
+}
+
+TEST(InCommand, ManyOptions)
+{
+    // Every declared option is found through the frozen lookup tables, and near misses are not
+    InCommand::CCommandReader CmdReader("app");
+    std::vector<InCommand::SwitchHandle> switches;
+    std::vector<std::string> names;
+    for (int i = 0; i < 2000; ++i)
+    {
+        names.push_back("option" + std::to_string(i));
+        switches.push_back(CmdReader.DeclareSwitch(names.back(), char(i < 26 ? 'a' + i : '-')));
+    }
+    CmdReader.Freeze();
+
+    for (size_t i = 0; i < names.size(); ++i)
+    {
+        std::string arg = "--" + names[i];
+        const char *argv[] = { "app", arg.c_str() };
+        InCommand::CCommandExpression cmdExp;
+        ASSERT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(2, argv, cmdExp));
+        ASSERT_TRUE(cmdExp.GetSwitchIsSet(switches[i]));
+
+        std::string missArg = arg + "x";
+        const char *missArgv[] = { "app", missArg.c_str() };
+        ASSERT_EQ(InCommand::Status::UnknownOption, CmdReader.ReadCommandExpression(2, missArgv, cmdExp));
+    }
+
+    const char *argv[] = { "app", "-z", "-c" };
+    InCommand::CCommandExpression cmdExp;
+    EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(3, argv, cmdExp));
+    EXPECT_TRUE(cmdExp.GetSwitchIsSet(switches[25]));
+    EXPECT_TRUE(cmdExp.GetSwitchIsSet(switches[2]));
+    const char *badArgv[] = { "app", "-Z" };
+    EXPECT_EQ(InCommand::Status::UnknownOption, CmdReader.ReadCommandExpression(2, badArgv, cmdExp));
+}
+
+TEST(InCommand, PrefixMatching)
+{
+    InCommand::CCommandReader CmdReader("app");
+    auto configHandle = CmdReader.DeclareCategory("config");
+    CmdReader.DeclareCategory("connect");
+    auto cloneHandle = CmdReader.DeclareCategory("clone");
+    auto verboseHandle = CmdReader.DeclareSwitch("verbose");
+    CmdReader.DeclareSwitch("verbatim");
+    auto depthHandle = CmdReader.DeclareVariable(cloneHandle, "depth");
+    auto dryRunHandle = CmdReader.DeclareSwitch(cloneHandle, "dry-run");
+    auto urlHandle = CmdReader.DeclareParameter(cloneHandle, "url");
+    CmdReader.SetOptionInherited(verboseHandle);
+
+    const char *argv[] = { "app", "conf", "--verbo" };
+
+    // Disabled by default
+    InCommand::CCommandExpression cmdExp;
+    EXPECT_EQ(InCommand::Status::UnexpectedArgument, CmdReader.ReadCommandExpression(3, argv, cmdExp));
+
+    CmdReader.SetPrefixMatching(true);
+    EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(3, argv, cmdExp));
+    EXPECT_EQ(cmdExp.GetCategory(), configHandle);
+    EXPECT_TRUE(cmdExp.GetSwitchIsSet(verboseHandle));
+
+    // Parameters take precedence over sub-category prefixes; options may be abbreviated anywhere
+    const char *cloneArgv[] = { "app", "cl", "--dep", "1", "--dr", "co" };
+    EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(6, cloneArgv, cmdExp));
+    EXPECT_EQ(cmdExp.GetCategory(), cloneHandle);
+    EXPECT_EQ(cmdExp.GetVariableValue(depthHandle, ""), "1");
+    EXPECT_TRUE(cmdExp.GetSwitchIsSet(dryRunHandle));
+    EXPECT_EQ(cmdExp.GetParameterValue(urlHandle, ""), "co");
+
+    std::string errorString;
+    const char *ambiguousOptionArgv[] = { "app", "--verb" };
+    EXPECT_EQ(InCommand::Status::AmbiguousArgument, CmdReader.ReadCommandExpression(2, ambiguousOptionArgv, cmdExp));
+    CmdReader.GetLastReadError(errorString);
+    EXPECT_EQ(errorString, "Ambiguous argument '--verb' could be any of the following:\n  --verbatim\n  --verbose");
+
+    const char *ambiguousCategoryArgv[] = { "app", "con" };
+    EXPECT_EQ(InCommand::Status::AmbiguousArgument, CmdReader.ReadCommandExpression(2, ambiguousCategoryArgv, cmdExp));
+    CmdReader.GetLastReadError(errorString);
+    EXPECT_EQ(errorString, "Ambiguous argument 'con' could be any of the following:\n  config\n  connect");
+
+    const char *unknownArgv[] = { "app", "--x" };
+    EXPECT_EQ(InCommand::Status::UnknownOption, CmdReader.ReadCommandExpression(2, unknownArgv, cmdExp));
+    EXPECT_EQ(InCommand::Status::AmbiguousArgument, CmdReader.Validate(2, ambiguousOptionArgv).ErrorStatus);
+}
+
+TEST(InCommand, Suggestions)
+{
+    InCommand::CCommandReader CmdReader("app");
+    auto remoteHandle = CmdReader.DeclareCategory("remote");
+    CmdReader.DeclareCategory("rebase");
+    CmdReader.DeclareCategory("reset");
+    CmdReader.DeclareSwitch("verbose");
+    CmdReader.DeclareSwitch("version");
+    CmdReader.DeclareSwitch("cat");
+    CmdReader.DeclareSwitch("car");
+    CmdReader.DeclareVariable(remoteHandle, "protocol", std::vector<std::string>{ "https", "ssh", "git" });
+
+    auto formatError = [&](std::vector<const char *> args)
+    {
+        InCommand::CCommandExpression cmdExp;
+        std::string errorString;
+        CmdReader.ReadCommandExpression(int(args.size()), args.data(), cmdExp);
+        CmdReader.GetLastReadError(errorString);
+        return errorString;
+    };
+
+    EXPECT_EQ(formatError({ "app", "--verbsoe" }), "Unknown option '--verbsoe'\nDid you mean '--verbose'?");
+    EXPECT_EQ(formatError({ "app", "-verbose" }), "Unexpected argument '-verbose'\nDid you mean '--verbose'?");
+    EXPECT_EQ(formatError({ "app", "--versoin" }), "Unknown option '--versoin'\nDid you mean '--version'?");
+    EXPECT_EQ(formatError({ "app", "--cax" }), "Unknown option '--cax'\nDid you mean one of these?\n  --car\n  --cat");
+    EXPECT_EQ(formatError({ "app", "remtoe" }), "Unexpected argument 'remtoe'\nDid you mean 'remote'?");
+    EXPECT_EQ(formatError({ "app", "rest" }), "Unexpected argument 'rest'\nDid you mean 'reset'?");
+    EXPECT_EQ(formatError({ "app", "fetch" }), "Unexpected argument 'fetch'");
+    EXPECT_EQ(formatError({ "app", "--quiet" }), "Unknown option '--quiet'");
+    EXPECT_EQ(formatError({ "app", "remote", "--protocol", "htps" }),
+        "Invalid value 'htps' for variable '--protocol'\nDid you mean 'https'?\nExpected one of the following:\n  git\n  https\n  ssh");
+
+    // Errors stay describable after later declarations recompile the schema
+    {
+        InCommand::CCommandExpression cmdExp;
+        const char *invalidArgv[] = { "app", "remote", "--protocol", "htps" };
+        EXPECT_EQ(InCommand::Status::InvalidValue, CmdReader.ReadCommandExpression(4, invalidArgv, cmdExp));
+        CmdReader.DeclareSwitch(remoteHandle, "prune");
+        std::string errorString;
+        CmdReader.GetLastReadError(errorString);
+        EXPECT_EQ(errorString.find("Invalid value 'htps' for variable '--protocol'"), 0u);
+
+        const char *unknownArgv[] = { "app", "--verbsoe" };
+        EXPECT_EQ(InCommand::Status::UnknownOption, CmdReader.ReadCommandExpression(2, unknownArgv, cmdExp));
+        CmdReader.DeclareSwitch("verbosity");
+        CmdReader.GetLastReadError(errorString);
+        EXPECT_EQ(errorString, "Unknown option '--verbsoe'\nDid you mean '--verbose'?");
+    }
+
+    // Large schemas stay responsive
+    InCommand::CCommandReader LargeReader("app");
+    for (int i = 0; i < 50000; ++i)
+        LargeReader.DeclareSwitch("option-" + std::to_string(i));
+    const char *argv[] = { "app", "--optoin-4242" };
+    InCommand::CCommandExpression cmdExp;
+    EXPECT_EQ(InCommand::Status::UnknownOption, LargeReader.ReadCommandExpression(2, argv, cmdExp));
+    std::string errorString;
+    auto start = std::chrono::steady_clock::now();
+    LargeReader.GetLastReadError(errorString);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    EXPECT_NE(errorString.find("--option-4242"), std::string::npos);
+    EXPECT_LT(elapsed, std::chrono::milliseconds(500));
+}
+
+TEST(InCommand, SchemaStrings)
+{
+    // Names shared between categories are stored once but remain independent declarations
+    InCommand::CCommandReader CmdReader("app");
+    auto pushHandle = CmdReader.DeclareCategory("push", "Upload");
+    auto pullHandle = CmdReader.DeclareCategory("pull", "Download");
+    auto pushForceHandle = CmdReader.DeclareSwitch(pushHandle, "force", "Overwrite");
+    auto pullForceHandle = CmdReader.DeclareSwitch(pullHandle, "force", "Overwrite");
+    CmdReader.DeclareVariable(pullHandle, "mode", std::vector<std::string>{ "merge", "rebase", "merge" });
+    EXPECT_NE(pushForceHandle, pullForceHandle);
+
+    try
+    {
+        CmdReader.DeclareSwitch(pushHandle, "force");
+        ADD_FAILURE() << "Duplicate switch not detected";
+    }
+    catch (const InCommand::Exception &e)
+    {
+        EXPECT_EQ(e.GetStatus(), InCommand::Status::DuplicateOption);
+    }
+
+    const char *argv[] = { "app", "pull", "--force", "--mode", "rebase" };
+    InCommand::CCommandExpression cmdExp;
+    EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(5, argv, cmdExp));
+    EXPECT_TRUE(cmdExp.GetSwitchIsSet(pullForceHandle));
+    EXPECT_FALSE(cmdExp.GetSwitchIsSet(pushForceHandle));
+
+    EXPECT_EQ(CmdReader.SimpleUsageString(InCommand::RootCategory), "app pull [--force] [--mode <value>] \napp push [--force] \napp \n");
+#if !defined(IN_COMMAND_NO_DESCRIPTIONS)
+    EXPECT_EQ(CmdReader.OptionDetailsString(pushHandle), std::string("  --force                     Overwrite\n\n"));
+#endif
+
+    const char *badArgv[] = { "app", "pull", "--mode", "fetch" };
+    EXPECT_EQ(InCommand::Status::InvalidValue, CmdReader.ReadCommandExpression(4, badArgv, cmdExp));
+    std::string errorString;
+    CmdReader.GetLastReadError(errorString);
+    EXPECT_EQ(errorString, "Invalid value 'fetch' for variable '--mode'\nExpected one of the following:\n  merge\n  rebase");
+}
+
+#if !defined(IN_COMMAND_NO_DESCRIPTIONS)
+TEST(InCommand, DescriptionCatalog)
+{
+    InCommand::CCommandReader CmdReader("app");
+    auto sendHandle = CmdReader.DeclareCategory("send", "send.help");
+    CmdReader.DeclareParameter(sendHandle, "to", "send.to");
+    CmdReader.DeclareSwitch(sendHandle, "urgent", "send.urgent");
+    CmdReader.DeclareVariable(sendHandle, "via", "Delivery method");
+
+    // The catalog is not read until help is rendered
+    std::string catalogPath = (std::filesystem::temp_directory_path() / "incommand_catalog.txt").string();
+    std::filesystem::remove(catalogPath);
+    CmdReader.SetDescriptionCatalog(catalogPath);
+    WriteTestFile("incommand_catalog.txt", "# Help text\r\nsend.to=Recipient address\r\nsend.urgent=Deliver immediately\r\n\r\nsend.urgent=Ignored duplicate\r\n");
+
+    auto row = [](std::string name, const std::string &description)
+    {
+        name.resize(30, ' ');
+        return name + description + "\n";
+    };
+
+    EXPECT_EQ(CmdReader.OptionDetailsString(sendHandle),
+        row("  to", "Recipient address") + row("  --urgent", "Deliver immediately") + row("  --via", "Delivery method") + "\n");
+
+    CmdReader.SetDescriptionCatalog("");
+    EXPECT_EQ(CmdReader.OptionDetailsString(sendHandle),
+        row("  to", "send.to") + row("  --urgent", "send.urgent") + row("  --via", "Delivery method") + "\n");
+
+    std::filesystem::remove(catalogPath);
+}
+#endif
+
+TEST(InCommand, DeferredCategories)
+{
+    InCommand::CCommandReader CmdReader("app");
+    auto helpHandle = CmdReader.DeclareSwitch("help", 'h');
+    CmdReader.SetOptionInherited(helpHandle);
+
+    int gitPopulated = 0;
+    int dockerPopulated = 0;
+    int remotePopulated = 0;
+    std::optional<InCommand::SwitchHandle> verboseHandle;
+    std::optional<InCommand::ParameterHandle> nameHandle;
+
+    CmdReader.DeclareCategory("git", [&](InCommand::CCommandReader &reader, InCommand::CategoryHandle category)
+        {
+            ++gitPopulated;
+            verboseHandle = reader.DeclareSwitch(category, "verbose", 'v');
+            reader.DeclareCategory(category, "remote", [&](InCommand::CCommandReader &reader, InCommand::CategoryHandle category)
+                {
+                    ++remotePopulated;
+                    nameHandle = reader.DeclareParameter(category, "name");
+                });
+        }, "Version control");
+    auto dockerHandle = CmdReader.DeclareCategory("docker", [&](InCommand::CCommandReader &reader, InCommand::CategoryHandle category)
+        {
+            ++dockerPopulated;
+            reader.DeclareSwitch(category, "detach", 'd');
+        });
+
+    {
+        const char *argv[] = { "app", "git", "-v", "remote", "origin", "--help" };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(6, argv, cmdExp));
+        ASSERT_TRUE(verboseHandle && nameHandle);
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(*verboseHandle));
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(helpHandle));
+        EXPECT_EQ(cmdExp.GetParameterValue(*nameHandle, ""), "origin");
+    }
+    EXPECT_EQ(gitPopulated, 1);
+    EXPECT_EQ(remotePopulated, 1);
+    EXPECT_EQ(dockerPopulated, 0);
+
+    // Populators only run once
+    {
+        const char *argv[] = { "app", "git", "remote" };
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.Validate(3, argv).ErrorStatus);
+    }
+    EXPECT_EQ(gitPopulated, 1);
+    EXPECT_EQ(remotePopulated, 1);
+
+    // Usage strings enter the category too
+    EXPECT_EQ(CmdReader.SimpleUsageString(dockerHandle), "app docker [--detach] [--help] \n");
+    EXPECT_EQ(dockerPopulated, 1);
+
+    InCommand::CCommandReader OtherReader("app");
+    int populated = 0;
+    OtherReader.DeclareCategory("a", [&](InCommand::CCommandReader &reader, InCommand::CategoryHandle category)
+        {
+            ++populated;
+            reader.DeclareCategory(category, "b", [&](InCommand::CCommandReader &, InCommand::CategoryHandle) { ++populated; });
+        });
+    OtherReader.PopulateAll();
+    EXPECT_EQ(populated, 2);
+
+    // Batch reads populate up front instead of from their worker threads
+    InCommand::CCommandReader BatchReader("app");
+    std::optional<InCommand::SwitchHandle> forceHandle;
+    BatchReader.DeclareCategory("clean", [&](InCommand::CCommandReader &reader, InCommand::CategoryHandle category)
+        {
+            forceHandle = reader.DeclareSwitch(category, "force", 'f');
+        });
+    std::vector<std::string> cmdlines(64, std::string("app\0clean\0-f\0", 13));
+    std::vector<std::string_view> buffers(cmdlines.begin(), cmdlines.end());
+    std::vector<InCommand::CCommandExpression> expressions;
+    std::vector<InCommand::ReadErrorDesc> errors;
+    BatchReader.ReadCommandExpressions(buffers, expressions, errors, 4);
+    ASSERT_TRUE(forceHandle);
+    for (size_t i = 0; i < buffers.size(); ++i)
+    {
+        EXPECT_EQ(errors[i].ErrorStatus, InCommand::Status::Success);
+        EXPECT_TRUE(expressions[i].GetSwitchIsSet(*forceHandle));
+    }
+
+    // So do expression caches, whose misses read concurrently
+    InCommand::CCommandReader CachedReader("app");
+    std::optional<InCommand::SwitchHandle> dryRunHandle;
+    CachedReader.DeclareCategory("deploy", [&](InCommand::CCommandReader &reader, InCommand::CategoryHandle category)
+        {
+            dryRunHandle = reader.DeclareSwitch(category, "dry-run");
+        });
+    InCommand::CExpressionCache cache(CachedReader, 0);
+    ASSERT_TRUE(dryRunHandle);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back([&cache, &dryRunHandle]()
+        {
+            const char *argv[] = { "app", "deploy", "--dry-run" };
+            InCommand::ReadErrorDesc error;
+            auto cmdExp = cache.ReadCommandExpression(3, argv, error);
+            ASSERT_NE(cmdExp, nullptr);
+            EXPECT_TRUE(cmdExp->GetSwitchIsSet(*dryRunHandle));
+        });
+    for (std::thread &thread : threads)
+        thread.join();
+}
+
+#if !defined(_WIN32)
+TEST(InCommand, SharedSchema)
+{
+    InCommand::CCommandReader CmdReader("app");
+    auto helpHandle = CmdReader.DeclareSwitch("help", 'h', "Show help");
+    CmdReader.SetOptionInherited(helpHandle);
+    auto buildHandle = CmdReader.DeclareCategory("build", "Build targets");
+    auto configHandle = CmdReader.DeclareVariable(buildHandle, "config", 'c', { "debug", "release" }, "Configuration");
+    auto targetHandle = CmdReader.DeclareParameter(buildHandle, "target", "Target to build");
+    auto filesHandle = CmdReader.DeclareRestParameter(buildHandle, "files");
+    std::optional<InCommand::SwitchHandle> forceHandle;
+    auto cleanHandle = CmdReader.DeclareCategory("clean", [&](InCommand::CCommandReader &reader, InCommand::CategoryHandle category)
+        {
+            forceHandle = reader.DeclareSwitch(category, "force", 'f');
+        });
+
+    std::string name = "/incommand-test-" + std::to_string(getpid());
+    ASSERT_EQ(InCommand::Status::Success, CmdReader.PublishSchema(name));
+    ASSERT_TRUE(forceHandle);
+
+    InCommand::CCommandReader Attached("other");
+    ASSERT_EQ(InCommand::Status::Success, Attached.AttachSchema(name));
+    EXPECT_EQ(Attached.GetSchemaFingerprint(), CmdReader.GetSchemaFingerprint());
+
+    {
+        const char *argv[] = { "app", "build", "-c", "release", "all", "a.cpp", "b.cpp", "--help" };
+        InCommand::CCommandExpression cmdExp;
+        ASSERT_EQ(InCommand::Status::Success, Attached.ReadCommandExpression(8, argv, cmdExp));
+        EXPECT_EQ(cmdExp.GetCategory(), buildHandle);
+        EXPECT_EQ(cmdExp.GetVariableValue(configHandle, ""), "release");
+        EXPECT_EQ(cmdExp.GetParameterValue(targetHandle, ""), "all");
+        EXPECT_EQ(cmdExp.GetRestParameterValues(filesHandle).size(), 2u);
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(helpHandle));
+
+        // Expressions pass between the readers
+        std::string blob;
+        Attached.SerializeExpression(cmdExp, blob);
+        InCommand::CSerializedExpression serialized;
+        ASSERT_EQ(InCommand::Status::Success, serialized.Open(CmdReader, blob));
+        EXPECT_EQ(serialized.GetVariableValue(configHandle, ""), "release");
+    }
+
+    {
+        const char *argv[] = { "app", "clean", "-f" };
+        InCommand::CCommandExpression cmdExp;
+        ASSERT_EQ(InCommand::Status::Success, Attached.ReadCommandExpression(3, argv, cmdExp));
+        EXPECT_EQ(cmdExp.GetCategory(), cleanHandle);
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(*forceHandle));
+    }
+
+    // Errors, usage strings and sinks match the publishing reader
+    for (InCommand::CCommandReader *reader : { &CmdReader, &Attached })
+    {
+        const char *argv[] = { "app", "build", "--config", "relase" };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::InvalidValue, reader->ReadCommandExpression(4, argv, cmdExp));
+    }
+    std::string publishedError;
+    std::string attachedError;
+    CmdReader.GetLastReadError(publishedError);
+    Attached.GetLastReadError(attachedError);
+    EXPECT_EQ(attachedError, publishedError);
+    EXPECT_EQ(Attached.SimpleUsageString(InCommand::RootCategory), CmdReader.SimpleUsageString(InCommand::RootCategory));
+    EXPECT_EQ(Attached.OptionDetailsString(buildHandle), CmdReader.OptionDetailsString(buildHandle));
+
+    std::vector<std::string> targets;
+    Attached.SetParameterSink(targetHandle, [&targets](std::string_view value) { targets.emplace_back(value); });
+    {
+        const char *argv[] = { "app", "build", "docs" };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, Attached.ReadCommandExpression(3, argv, cmdExp));
+        EXPECT_EQ(targets, std::vector<std::string>{ "docs" });
+    }
+
+    // The attached reader takes no declarations
+    EXPECT_THROW(Attached.DeclareSwitch("quiet"), InCommand::Exception);
+
+    // Another process maps the same schema
+    pid_t child = fork();
+    ASSERT_NE(child, -1);
+    if (child == 0)
+    {
+        InCommand::CCommandReader ChildReader("child");
+        const char *argv[] = { "app", "build", "--config", "debug", "all" };
+        InCommand::CCommandExpression cmdExp;
+        bool ok = ChildReader.AttachSchema(name) == InCommand::Status::Success &&
+            ChildReader.ReadCommandExpression(5, argv, cmdExp) == InCommand::Status::Success &&
+            cmdExp.GetVariableValue(configHandle, "") == "debug";
+        _exit(ok ? 0 : 1);
+    }
+    int childStatus = 0;
+    ASSERT_EQ(waitpid(child, &childStatus, 0), child);
+    EXPECT_TRUE(WIFEXITED(childStatus) && WEXITSTATUS(childStatus) == 0);
+
+    // Attached readers keep their mapping once the object is removed
+    EXPECT_EQ(InCommand::Status::Success, InCommand::CCommandReader::UnpublishSchema(name));
+    {
+        const char *argv[] = { "app", "build", "all" };
+        EXPECT_EQ(InCommand::Status::Success, Attached.Validate(3, argv).ErrorStatus);
+    }
+
+    InCommand::CCommandReader Missing("app");
+    EXPECT_EQ(InCommand::Status::NotFound, Missing.AttachSchema(name));
+    EXPECT_EQ(InCommand::Status::NotFound, InCommand::CCommandReader::UnpublishSchema(name));
+
+    // Objects not holding a complete schema are rejected
+    int fd = shm_open(name.c_str(), O_CREAT | O_RDWR, 0600);
+    ASSERT_GE(fd, 0);
+    const char garbage[64] = "not a schema";
+    EXPECT_EQ(write(fd, garbage, sizeof(garbage)), ssize_t(sizeof(garbage)));
+    close(fd);
+    EXPECT_EQ(InCommand::Status::InvalidFormat, Missing.AttachSchema(name));
+    InCommand::CCommandReader::UnpublishSchema(name);
+}
+#endif
+
+TEST(InCommand, ReloadableReader)
+{
+    // Sinks keep a token alive for as long as their version exists
+    auto token = std::make_shared<int>(1);
+    std::weak_ptr<int> firstVersionAlive = token;
+
+    auto first = InCommand::CReloadableReader::CreateVersion("app");
+    auto buildHandle = first->DeclareCategory("build");
+    auto targetHandle = first->DeclareParameter(buildHandle, "target");
+    first->SetParameterSink(targetHandle, [token](std::string_view) {});
+    token.reset();
+
+    InCommand::CReloadableReader reader(std::move(first));
+    uint32_t firstGeneration = reader.GetGeneration();
+    EXPECT_NE(firstGeneration, 0u);
+    EXPECT_EQ(buildHandle.GetGeneration(), firstGeneration);
+
+    const char *buildArgv[] = { "app", "build", "all" };
+    const char *deployArgv[] = { "app", "deploy", "--force" };
+    InCommand::CCommandExpression cmdExp;
+    std::string errorString;
+    EXPECT_EQ(InCommand::Status::Success, reader.ReadCommandExpression(3, buildArgv, cmdExp, errorString));
+    EXPECT_EQ(cmdExp.GetCategory(), buildHandle);
+
+    InCommand::CCommandDispatcher<> dispatcher;
+    dispatcher.SetHandler(buildHandle, [](const InCommand::CCommandExpression &) { return 0; });
+
+    // A read in progress keeps the first version while a second is published
+    InCommand::CReloadableReader::CPinnedReader pinned = reader.Acquire();
+
+    auto second = InCommand::CReloadableReader::CreateVersion("app");
+    auto deployHandle = second->DeclareCategory("deploy");
+    auto forceHandle = second->DeclareSwitch(deployHandle, "force");
+    reader.Publish(std::move(second));
+    EXPECT_NE(reader.GetGeneration(), firstGeneration);
+
+    {
+        InCommand::CCommandExpression oldExp;
+        InCommand::ReadErrorDesc error;
+        EXPECT_EQ(InCommand::Status::Success, pinned->ReadCommandExpression(3, buildArgv, oldExp, error));
+    }
+
+    EXPECT_EQ(InCommand::Status::UnexpectedArgument, reader.ReadCommandExpression(3, buildArgv, cmdExp, errorString));
+    EXPECT_EQ(errorString, "Unexpected argument 'build'");
+    ASSERT_EQ(InCommand::Status::Success, reader.ReadCommandExpression(3, deployArgv, cmdExp, errorString));
+    EXPECT_TRUE(errorString.empty());
+    EXPECT_TRUE(cmdExp.GetSwitchIsSet(forceHandle));
+
+    // Handles and dispatchers of the first version are stale
+    EXPECT_THROW(cmdExp.GetParameterValue(targetHandle, ""), InCommand::Exception);
+    EXPECT_THROW(dispatcher.Dispatch(cmdExp), InCommand::Exception);
+
+    // The first version goes once its last read finishes
+    EXPECT_FALSE(firstVersionAlive.expired());
+    pinned = reader.Acquire();
+    EXPECT_TRUE(firstVersionAlive.expired());
+
+    // A pin taken on one thread may be released on another
+    {
+        auto versionToken = std::make_shared<int>(2);
+        std::weak_ptr<int> versionAlive = versionToken;
+        auto sinkVersion = InCommand::CReloadableReader::CreateVersion("app");
+        auto sinkDeploy = sinkVersion->DeclareCategory("deploy");
+        sinkVersion->DeclareSwitch(sinkDeploy, "force");
+        sinkVersion->SetParameterSink(sinkVersion->DeclareParameter(sinkDeploy, "target"), [versionToken](std::string_view) {});
+        versionToken.reset();
+        reader.Publish(std::move(sinkVersion));
+
+        std::optional<InCommand::CReloadableReader::CPinnedReader> otherThreadPin;
+        std::thread([&]() { otherThreadPin.emplace(reader.Acquire()); }).join();
+        auto next = InCommand::CReloadableReader::CreateVersion("app");
+        next->DeclareSwitch(next->DeclareCategory("deploy"), "force");
+        reader.Publish(std::move(next));
+        EXPECT_FALSE(versionAlive.expired());
+        otherThreadPin.reset();
+        EXPECT_TRUE(versionAlive.expired());
+    }
+
+    // Reads on other threads never see a version disappear underneath them
+    std::atomic<bool> stop{ false };
+    std::atomic<int> failures{ 0 };
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 3; ++t)
+    {
+        threads.emplace_back([&]()
+            {
+                while (!stop.load())
+                {
+                    InCommand::CCommandExpression exp;
+                    std::string error;
+                    if (reader.ReadCommandExpression(3, deployArgv, exp, error) != InCommand::Status::Success)
+                        ++failures;
+                }
+            });
+    }
+    for (int i = 0; i < 200; ++i)
+    {
+        auto next = InCommand::CReloadableReader::CreateVersion("app");
+        next->DeclareSwitch(next->DeclareCategory("deploy"), "force");
+        reader.Publish(std::move(next));
+    }
+    stop.store(true);
+    for (auto &thread : threads)
+        thread.join();
+    EXPECT_EQ(failures.load(), 0);
+}
+
+TEST(InCommand, LayeredReader)
+{
+    // A flat reader declaring the same things in the same order serves as the reference
+    InCommand::CCommandReader Base("app");
+    InCommand::CCommandReader Flat("app");
+    InCommand::SwitchHandle helpHandle(0);
+    InCommand::CategoryHandle buildHandle(0);
+    InCommand::VariableHandle configHandle(0);
+    InCommand::ParameterHandle targetHandle(0);
+    InCommand::CategoryHandle cleanHandle(0);
+    InCommand::SwitchHandle forceHandle(0);
+    for (InCommand::CCommandReader *reader : { &Base, &Flat })
+    {
+        helpHandle = reader->DeclareSwitch("help", 'h', "Show help");
+        reader->SetOptionInherited(helpHandle);
+        buildHandle = reader->DeclareCategory("build", "Build targets");
+        configHandle = reader->DeclareVariable(buildHandle, "config", 'c', { "debug", "release" }, "Configuration");
+        targetHandle = reader->DeclareParameter(buildHandle, "target", "Target to build");
+        cleanHandle = reader->DeclareCategory("clean");
+        forceHandle = reader->DeclareSwitch(cleanHandle, "force", 'f');
+    }
+
+    InCommand::CCommandReader Tenant(Base);
+    InCommand::SwitchHandle verboseHandle(0);
+    InCommand::CategoryHandle deployHandle(0);
+    InCommand::ParameterHandle environmentHandle(0);
+    InCommand::SwitchHandle traceHandle(0);
+    for (InCommand::CCommandReader *reader : { &Tenant, &Flat })
+    {
+        verboseHandle = reader->DeclareSwitch(buildHandle, "verbose", 'v', "Verbose output");
+        deployHandle = reader->DeclareCategory("deploy", "Deploy targets");
+        environmentHandle = reader->DeclareParameter(deployHandle, "environment");
+        traceHandle = reader->DeclareSwitch("trace");
+        reader->SetOptionInherited(traceHandle);
+    }
+    EXPECT_EQ(Tenant.GetSchemaFingerprint(), Flat.GetSchemaFingerprint());
+    EXPECT_NE(Tenant.GetSchemaFingerprint(), Base.GetSchemaFingerprint());
+
+    // Base declarations and the tenant's own are both visible, through handles of either reader
+    const char *buildArgv[] = { "app", "build", "-c", "release", "all", "-v", "--trace", "-h" };
+    {
+        InCommand::CCommandExpression cmdExp;
+        ASSERT_EQ(InCommand::Status::Success, Tenant.ReadCommandExpression(8, buildArgv, cmdExp));
+        EXPECT_EQ(cmdExp.GetCategory(), buildHandle);
+        EXPECT_EQ(cmdExp.GetVariableValue(configHandle, ""), "release");
+        EXPECT_EQ(cmdExp.GetParameterValue(targetHandle, ""), "all");
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(verboseHandle));
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(traceHandle));
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(helpHandle));
+
+        // Expressions pass between the tenant and the flat reader
+        std::string blob;
+        Tenant.SerializeExpression(cmdExp, blob);
+        InCommand::CSerializedExpression serialized;
+        ASSERT_EQ(InCommand::Status::Success, serialized.Open(Flat, blob));
+        EXPECT_TRUE(serialized.GetSwitchIsSet(verboseHandle));
+    }
+    {
+        const char *argv[] = { "app", "clean", "--trace", "-f" };
+        InCommand::CCommandExpression cmdExp;
+        ASSERT_EQ(InCommand::Status::Success, Tenant.ReadCommandExpression(4, argv, cmdExp));
+        EXPECT_EQ(cmdExp.GetCategory(), cleanHandle);
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(forceHandle));
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(traceHandle));
+    }
+    {
+        const char *argv[] = { "app", "deploy", "prod" };
+        InCommand::CCommandExpression cmdExp;
+        ASSERT_EQ(InCommand::Status::Success, Tenant.ReadCommandExpression(3, argv, cmdExp));
+        EXPECT_EQ(cmdExp.GetCategory(), deployHandle);
+        EXPECT_EQ(cmdExp.GetParameterValue(environmentHandle, ""), "prod");
+    }
+    EXPECT_EQ(Tenant.SimpleUsageString(InCommand::RootCategory), Flat.SimpleUsageString(InCommand::RootCategory));
+    EXPECT_EQ(Tenant.OptionDetailsString(buildHandle), Flat.OptionDetailsString(buildHandle));
+    EXPECT_EQ(Tenant.OptionDetailsString(cleanHandle), Flat.OptionDetailsString(cleanHandle));
+
+    // The base is unchanged
+    {
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::UnknownOption, Base.ReadCommandExpression(8, buildArgv, cmdExp));
+        const char *argv[] = { "app", "deploy" };
+        EXPECT_EQ(InCommand::Status::UnexpectedArgument, Base.ReadCommandExpression(2, argv, cmdExp));
+    }
+
+    // Names are checked against the base, whose options stay as declared
+    EXPECT_THROW(Tenant.DeclareVariable(buildHandle, "config"), InCommand::Exception);
+    EXPECT_THROW(Tenant.DeclareSwitch("help"), InCommand::Exception);
+    EXPECT_THROW(Tenant.SetOptionInherited(forceHandle), InCommand::Exception);
+    EXPECT_NO_THROW(Tenant.DeclareSwitch(cleanHandle, "help"));
+
+    // Later base declarations are not seen by the tenant
+    Base.DeclareSwitch("late");
+    {
+        const char *argv[] = { "app", "--late" };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, Base.ReadCommandExpression(2, argv, cmdExp));
+        EXPECT_EQ(InCommand::Status::UnknownOption, Tenant.ReadCommandExpression(2, argv, cmdExp));
+    }
+
+    // Copies layer on copies, and many variants of one base each keep only their own additions
+    InCommand::CCommandReader SubTenant(Tenant);
+    auto dryRunHandle = SubTenant.DeclareSwitch(deployHandle, "dry-run");
+    {
+        const char *argv[] = { "app", "deploy", "--dry-run", "--trace", "prod" };
+        InCommand::CCommandExpression cmdExp;
+        ASSERT_EQ(InCommand::Status::Success, SubTenant.ReadCommandExpression(5, argv, cmdExp));
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(dryRunHandle));
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(traceHandle));
+        EXPECT_EQ(InCommand::Status::UnknownOption, Tenant.ReadCommandExpression(5, argv, cmdExp));
+    }
+
+    std::vector<std::unique_ptr<InCommand::CCommandReader>> variants;
+    for (int i = 0; i < 100; ++i)
+    {
+        variants.push_back(std::make_unique<InCommand::CCommandReader>(Tenant));
+        variants.back()->DeclareSwitch(buildHandle, "variant-" + std::to_string(i));
+    }
+    for (int i = 0; i < 100; i += 33)
+    {
+        std::string option = "--variant-" + std::to_string(i);
+        const char *argv[] = { "app", "build", "all", option.c_str() };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, variants[i]->ReadCommandExpression(4, argv, cmdExp));
+        EXPECT_EQ(InCommand::Status::UnknownOption, variants[(i + 1) % 100]->ReadCommandExpression(4, argv, cmdExp));
+    }
+
+    // Pending populators of the source run before copying; the copy may declare its own
+    InCommand::CCommandReader Lazy("app");
+    Lazy.DeclareCategory("tools", [](InCommand::CCommandReader &reader, InCommand::CategoryHandle category) { reader.DeclareSwitch(category, "all"); });
+    InCommand::CCommandReader LazyCopy(Lazy);
+    LazyCopy.DeclareCategory("extra", [](InCommand::CCommandReader &reader, InCommand::CategoryHandle category) { reader.DeclareSwitch(category, "more"); });
+    {
+        const char *toolsArgv[] = { "app", "tools", "--all" };
+        const char *extraArgv[] = { "app", "extra", "--more" };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_EQ(InCommand::Status::Success, LazyCopy.ReadCommandExpression(3, toolsArgv, cmdExp));
+        EXPECT_EQ(InCommand::Status::Success, LazyCopy.ReadCommandExpression(3, extraArgv, cmdExp));
+        EXPECT_EQ(InCommand::Status::UnexpectedArgument, Lazy.ReadCommandExpression(3, extraArgv, cmdExp));
+    }
+
+#if !defined(_WIN32)
+    // Published layered schemas are merged with their bases
+    std::string name = "/incommand-layered-" + std::to_string(getpid());
+    ASSERT_EQ(InCommand::Status::Success, SubTenant.PublishSchema(name));
+    InCommand::CCommandReader Attached("other");
+    ASSERT_EQ(InCommand::Status::Success, Attached.AttachSchema(name));
+    EXPECT_EQ(Attached.GetSchemaFingerprint(), SubTenant.GetSchemaFingerprint());
+    {
+        const char *argv[] = { "app", "build", "-c", "debug", "lib", "-v", "--trace" };
+        InCommand::CCommandExpression cmdExp;
+        ASSERT_EQ(InCommand::Status::Success, Attached.ReadCommandExpression(7, argv, cmdExp));
+        EXPECT_EQ(cmdExp.GetVariableValue(configHandle, ""), "debug");
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(verboseHandle));
+    }
+    EXPECT_EQ(Attached.OptionDetailsString(deployHandle), SubTenant.OptionDetailsString(deployHandle));
+    EXPECT_EQ(InCommand::Status::Success, InCommand::CCommandReader::UnpublishSchema(name));
+#endif
+}
+
+TEST(InCommand, ReaderMoves)
+{
+    InCommand::CCommandReader Base("app");
+    InCommand::CategoryHandle buildHandle = Base.DeclareCategory("build");
+    InCommand::VariableHandle configHandle = Base.DeclareVariable(buildHandle, "config", 'c', std::vector<std::string>{ "debug", "release" });
+
+    // A moved reader keeps the same declarations and handles, and takes new ones
+    InCommand::CCommandReader Moved(std::move(Base));
+    InCommand::SwitchHandle verboseHandle = Moved.DeclareSwitch(buildHandle, "verbose", 'v');
+    {
+        const char *argv[] = { "app", "build", "--config", "release", "-v" };
+        InCommand::CCommandExpression cmdExp;
+        ASSERT_EQ(InCommand::Status::Success, Moved.ReadCommandExpression(5, argv, cmdExp));
+        EXPECT_EQ(cmdExp.GetCategory(), buildHandle);
+        EXPECT_EQ(cmdExp.GetVariableValue(configHandle, ""), "release");
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(verboseHandle));
+    }
+
+    // Move assignment replaces the target's declarations, including a frozen schema
+    InCommand::CCommandReader Target("other");
+    Target.DeclareCategory("unrelated");
+    Target = std::move(Moved);
+    InCommand::CategoryHandle cleanHandle = Target.DeclareCategory("clean");
+    {
+        const char *argv[] = { "app", "build", "-c", "debug", "--verbose" };
+        InCommand::CCommandExpression cmdExp;
+        ASSERT_EQ(InCommand::Status::Success, Target.ReadCommandExpression(5, argv, cmdExp));
+        EXPECT_EQ(cmdExp.GetVariableValue(configHandle, ""), "debug");
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(verboseHandle));
+    }
+    {
+        const char *argv[] = { "app", "clean" };
+        InCommand::CCommandExpression cmdExp;
+        ASSERT_EQ(InCommand::Status::Success, Target.ReadCommandExpression(2, argv, cmdExp));
+        EXPECT_EQ(cmdExp.GetCategory(), cleanHandle);
+    }
+    {
+        const char *argv[] = { "app", "unrelated" };
+        InCommand::CCommandExpression cmdExp;
+        EXPECT_NE(InCommand::Status::Success, Target.ReadCommandExpression(2, argv, cmdExp));
+    }
+
+    // Moved readers can still be layered on
+    InCommand::CCommandReader Tenant(Target);
+    {
+        const char *argv[] = { "app", "build", "-v" };
+        InCommand::CCommandExpression cmdExp;
+        ASSERT_EQ(InCommand::Status::Success, Tenant.ReadCommandExpression(3, argv, cmdExp));
+        EXPECT_TRUE(cmdExp.GetSwitchIsSet(verboseHandle));
+    }
+}
+
+TEST(InCommand, CompactHandles)
+{
+    // A handle is an IndexType and a 32-bit generation
+    EXPECT_LE(sizeof(InCommand::SwitchHandle), 8u);
+    EXPECT_EQ(InCommand::NullCategory, InCommand::CategoryHandle(std::numeric_limits<InCommand::IndexType>::max()));
+
+    // Declaring past the largest index throws; only practical to reach with 16-bit indices
+    if (std::numeric_limits<InCommand::IndexType>::max() <= UINT16_MAX)
+    {
+        InCommand::CCommandReader CmdReader("app");
+        size_t declared = 0;
+        try
+        {
+            for (;; ++declared)
+                CmdReader.DeclareParameter("p" + std::to_string(declared));
+        }
+        catch (const InCommand::Exception &e)
+        {
+            EXPECT_EQ(e.GetStatus(), InCommand::Status::OutOfRange);
+        }
+        EXPECT_EQ(declared, size_t(std::numeric_limits<InCommand::IndexType>::max()));
+    }
+}
+
+TEST(InCommand, ParseCounters)
+{
+    InCommand::CCommandReader CmdReader("app");
+    auto buildCat = CmdReader.DeclareCategory("build");
+    CmdReader.DeclareVariable(buildCat, "config", 'c', std::vector<std::string>{ "debug", "release" });
+    CmdReader.DeclareParameter(buildCat, "target");
+
+    std::vector<InCommand::ParseCounters> observed;
+    CmdReader.SetParseObserver([&observed](const InCommand::ParseCounters &counters, InCommand::Status status)
+    {
+        EXPECT_EQ(status, InCommand::Status::Success);
+        observed.push_back(counters);
+    });
+
+    const char *argv[] = { "app", "build", "-c", "release", "all" };
+    int argc = int(std::size(argv));
+    InCommand::ParseCounters before = InCommand::GetParseCounters();
+    InCommand::CCommandExpression CmdExpression;
+    EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(argc, argv, CmdExpression));
+    InCommand::ParseCounters delta = InCommand::GetParseCounters() - before;
+
+#if defined(IN_COMMAND_INSTRUMENTATION)
+    EXPECT_EQ(delta.Parses, 1u);
+    EXPECT_GE(delta.Tokens, 4u);
+    EXPECT_EQ(delta.CategoryLookups, 2u); // "build", then "all" before it falls to the parameter
+    EXPECT_EQ(delta.OptionLookups, 1u);
+    EXPECT_EQ(delta.DomainChecks, 1u);
+    EXPECT_GE(delta.Probes, delta.CategoryLookups + delta.OptionLookups);
+    EXPECT_GT(delta.Allocations, 0u);
+    ASSERT_EQ(observed.size(), 1u);
+    EXPECT_EQ(observed[0].Parses, 1u);
+    EXPECT_EQ(observed[0].Tokens, delta.Tokens);
+    EXPECT_EQ(observed[0].DomainChecks, 1u);
+
+    // Counters of exited threads remain in the process totals
+    CmdReader.SetParseObserver(nullptr);
+    before = InCommand::GetParseCounters();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back([&CmdReader, &argv, argc]()
+        {
+            for (int i = 0; i < 25; ++i)
+            {
+                InCommand::CCommandExpression ThreadExpression;
+                InCommand::ReadErrorDesc error;
+                CmdReader.ReadCommandExpression(argc, argv, ThreadExpression, error);
+            }
+        });
+    for (auto &thread : threads)
+        thread.join();
+    delta = InCommand::GetParseCounters() - before;
+    EXPECT_EQ(delta.Parses, 100u);
+    EXPECT_EQ(delta.DomainChecks, 100u);
+#else
+    EXPECT_EQ(delta.Parses, 0u);
+    EXPECT_EQ(delta.Tokens, 0u);
+    EXPECT_TRUE(observed.empty());
+#endif
+}
+
+TEST(InCommand, TraceSpans)
+{
+    std::ostringstream discarded;
+    InCommand::WriteTrace(discarded);
+
+    InCommand::CCommandReader CmdReader("app");
+    auto buildCat = CmdReader.DeclareCategory("build");
+    CmdReader.DeclareSwitch(buildCat, "verbose");
+
+    InCommand::CCommandDispatcher<> dispatcher;
+    dispatcher.SetHandler(buildCat, [](const InCommand::CCommandExpression &) { return 0; });
+
+    const char *argv[] = { "app", "build", "--verbose" };
+    std::thread reader([&]()
+    {
+        InCommand::CCommandExpression CmdExpression;
+        InCommand::ReadErrorDesc error;
+        EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(int(std::size(argv)), argv, CmdExpression, error));
+        EXPECT_EQ(dispatcher.Dispatch(CmdExpression), 0);
+    });
+    reader.join();
+    CmdReader.OptionDetailsString(buildCat);
+
+    std::string path = (std::filesystem::temp_directory_path() / "incommand_trace.json").string();
+    ASSERT_EQ(InCommand::Status::Success, InCommand::WriteTrace(path));
+    std::ifstream file(path);
+    std::string trace((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    file.close();
+    std::filesystem::remove(path);
+
+    EXPECT_EQ(trace.rfind("{\"traceEvents\":[", 0), 0u);
+#if defined(IN_COMMAND_TRACING)
+    for (const char *span : { "DeclareCategory", "DeclareOption", "Freeze", "Read", "Dispatch", "OptionDetailsString" })
+        EXPECT_NE(trace.find(std::string("\"name\":\"") + span + "\""), std::string::npos) << span;
+#if defined(__linux__)
+    // Spans are tagged with the OS thread id
+    EXPECT_NE(trace.find(",\"tid\":" + std::to_string(syscall(SYS_gettid)) + ","), std::string::npos);
+#endif
+
+    // Writing discards the spans
+    std::ostringstream empty;
+    InCommand::WriteTrace(empty);
+    EXPECT_EQ(empty.str().find("\"name\""), std::string::npos);
+
+    // Paused recording drops spans
+    InCommand::SetTraceEnabled(false);
+    CmdReader.OptionDetailsString(buildCat);
+    InCommand::SetTraceEnabled(true);
+    std::ostringstream paused;
+    InCommand::WriteTrace(paused);
+    EXPECT_EQ(paused.str().find("\"name\""), std::string::npos);
+#else
+    EXPECT_EQ(trace.find("\"name\""), std::string::npos);
+#endif
+}
+
+TEST(InCommand, UsageCounters)
+{
+    InCommand::CCommandReader CmdReader("app");
+    auto buildCat = CmdReader.DeclareCategory("build");
+    auto testCat = CmdReader.DeclareCategory("test");
+    auto verboseSwitch = CmdReader.DeclareSwitch(buildCat, "verbose");
+    auto configVar = CmdReader.DeclareVariable(buildCat, "config", std::vector<std::string>{ "debug", "release" });
+    auto targetParam = CmdReader.DeclareParameter(buildCat, "target");
+
+    // Nothing is counted until enabled
+    const char *argv[] = { "app", "build", "--verbose", "all" };
+    const int argc = int(std::size(argv));
+    InCommand::CCommandExpression CmdExpression;
+    EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(argc, argv, CmdExpression));
+    EXPECT_FALSE(CmdReader.IsCountingUsage());
+    EXPECT_EQ(CmdReader.GetUsageCount(buildCat), 0u);
+
+    // Threads reading through the shared reader count into separate shards
+    CmdReader.EnableUsageCounters();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back([&CmdReader, &argv]()
+        {
+            for (int i = 0; i < 50; ++i)
+            {
+                InCommand::CCommandExpression ThreadExpression;
+                InCommand::ReadErrorDesc error;
+                EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(argc, argv, ThreadExpression, error));
+            }
+        });
+    for (auto &thread : threads)
+        thread.join();
+
+    EXPECT_EQ(CmdReader.GetUsageCount(InCommand::RootCategory), 200u);
+    EXPECT_EQ(CmdReader.GetUsageCount(buildCat), 200u);
+    EXPECT_EQ(CmdReader.GetUsageCount(verboseSwitch), 200u);
+    EXPECT_EQ(CmdReader.GetUsageCount(targetParam), 200u);
+    EXPECT_EQ(CmdReader.GetUsageCount(configVar), 0u);
+    EXPECT_EQ(CmdReader.GetUsageCount(testCat), 0u);
+
+    // Visits count; validation does not
+    struct NullVisitor
+    {
+        void OnCategory(InCommand::CategoryHandle) {}
+        void OnSwitch(InCommand::SwitchHandle) {}
+        void OnVariable(InCommand::VariableHandle, std::string_view) {}
+        void OnParameter(InCommand::ParameterHandle, std::string_view) {}
+        void OnError(const InCommand::ReadErrorDesc &) {}
+    } visitor;
+    const char *configArgv[] = { "app", "build", "--config", "debug" };
+    EXPECT_EQ(InCommand::Status::Success, CmdReader.VisitCommandExpression(int(std::size(configArgv)), configArgv, visitor));
+    EXPECT_EQ(CmdReader.Validate(int(std::size(configArgv)), configArgv).ErrorStatus, InCommand::Status::Success);
+    EXPECT_EQ(CmdReader.GetUsageCount(configVar), 1u);
+
+    // Handles declared after enabling are counted too
+    auto dryRunSwitch = CmdReader.DeclareSwitch(testCat, "dry-run");
+    const char *testArgv[] = { "app", "test", "--dry-run" };
+    EXPECT_EQ(InCommand::Status::Success, CmdReader.ReadCommandExpression(int(std::size(testArgv)), testArgv, CmdExpression));
+    EXPECT_EQ(CmdReader.GetUsageCount(dryRunSwitch), 1u);
+    EXPECT_EQ(CmdReader.GetUsageCount(buildCat), 201u);
+
+    std::vector<InCommand::UsageCount> counts = CmdReader.GetUsageCounts();
+    ASSERT_EQ(counts.size(), 7u);
+    EXPECT_EQ(counts[1].Path, "app build");
+    EXPECT_EQ(counts[1].Count, 201u);
+    EXPECT_EQ(counts[4].Type, InCommand::ArgumentType::Variable);
+    EXPECT_EQ(counts[4].Path, "app build --config");
+    EXPECT_EQ(counts[5].Path, "app build <target>");
+
+    std::ostringstream dump;
+    CmdReader.WriteUsageCounts(dump);
+    EXPECT_NE(dump.str().find("200 app build --verbose\n"), std::string::npos);
+    EXPECT_NE(dump.str().find("1 app test --dry-run\n"), std::string::npos);
+
+    // Copies do not count until enabled, and then count separately
+    InCommand::CCommandReader Copy(CmdReader);
+    EXPECT_FALSE(Copy.IsCountingUsage());
+    EXPECT_EQ(InCommand::Status::Success, Copy.ReadCommandExpression(argc, argv, CmdExpression));
+    EXPECT_EQ(Copy.GetUsageCount(verboseSwitch), 0u);
+    Copy.EnableUsageCounters();
+    EXPECT_EQ(Copy.GetUsageCount(buildCat), 0u);
+    EXPECT_EQ(InCommand::Status::Success, Copy.ReadCommandExpression(argc, argv, CmdExpression));
+    EXPECT_EQ(Copy.GetUsageCount(verboseSwitch), 1u);
+    EXPECT_EQ(CmdReader.GetUsageCount(verboseSwitch), 200u);
+
+    CmdReader.ResetUsageCounters();
+    EXPECT_EQ(CmdReader.GetUsageCount(verboseSwitch), 0u);
+}